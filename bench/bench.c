@@ -0,0 +1,470 @@
+/*******************************************************************************
+* sqirt-bench - Round trip benchmarks for sqirt. Every benchmark runs against a
+* simulated device on a pseudo terminal (see sim.h), so no serial hardware is
+* needed. Reports p50/p99 round trip latency, queries per second and bytes per
+* second, both through the Ser_* API and the sqirt binary. Also measures the
+* throughput of every checksum algorithm, and compares the fan-out I/O backends
+* (see iobatch.h) by system calls and CPU time per query. Timing values that
+* need no device are checked first, a wrong one fails the run.
+*
+* Usage: sqirt-bench [sqirt binary]     (Run with `make bench`)
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "sim.h"
+#include "serial.h"
+#include "query.h"
+#include "timing.h"
+#include "checksum.h"
+#include "iobatch.h"
+#include "modbus.h"
+
+/*** Configuration ************************************************************/
+#define API_RUNS        10000        //Round trips through the Ser_* API
+#define CANNED_RUNS     1000         //Round trips to the delayed device
+#define CANNED_DELAY    1000         //Its response delay in microseconds
+#define STREAM_RUNS     10           //Streamed responses
+#define STREAM_LEN      (4 << 20)    //Their length (4MiB)
+#define BIN_RUNS        200          //Runs of the sqirt binary
+#define CHK_RUNS        64           //Checksums of the checksum buffer
+#define CHK_LEN         (1 << 20)    //Its length (1MiB)
+#define FAN_PORTS       128          //Devices queried at once by Iob_Run
+#define FAN_ROUNDS      200          //Queries of every device
+
+//sqirt binary to benchmark
+static const char *_sqirt = "bin/sqirt";
+
+//Ping message sent by the Ser_* API benchmarks
+static const char _ping[] = "PING0123456789\r\n";
+#define PING_LEN (sizeof(_ping) - 1)
+
+/*** Results ******************************************************************/
+typedef struct
+{
+	uint64_t *samples;           //Round trip time of each run in microseconds
+	size_t runs;
+	uint64_t total;              //Wall time of every run together
+	uint64_t bytes;              //Response bytes received in every run
+} BenchResult;
+
+static int Bench_CompareU64(const void *a, const void *b)
+{
+	uint64_t lhs = *(const uint64_t *)a;
+	uint64_t rhs = *(const uint64_t *)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+//Prints one result line, then frees its samples
+static void Bench_Report(const char *name, BenchResult *res)
+{
+	if(res->runs == 0)
+	{
+		printf("%-28s %8s\n", name, "FAILED");
+		free(res->samples);
+		return;
+	}
+
+	qsort(res->samples, res->runs, sizeof(uint64_t), Bench_CompareU64);
+
+	uint64_t p50 = res->samples[res->runs * 50 / 100];
+	uint64_t p99 = res->samples[res->runs * 99 / 100];
+	double secs = (double)res->total / 1e6;
+
+	printf("%-28s %8zu %10llu %10llu %12.1f %14.0f\n", name, res->runs,
+	       (unsigned long long)p50, (unsigned long long)p99,
+	       (double)res->runs / secs, (double)res->bytes / secs);
+
+	free(res->samples);
+}
+
+/*** Checks *******************************************************************/
+//Checks the Modbus RTU frame silence against known baudrates.
+//Returns the number of wrong values
+static int Bench_CheckSilence(void)
+{
+	static const struct {unsigned int baud; uint64_t us;} known[] = {
+		{2400, 16042}, {9600, 4011}, {19200, 2006}, {115200, 1750}
+	};
+
+	int failed = 0;
+	for(size_t idx = 0; idx < sizeof(known) / sizeof(known[0]); idx++)
+	{
+		uint64_t got = Mb_SilenceUs(known[idx].baud);
+		if(got == known[idx].us) continue;
+
+		fprintf(stderr, "modbus silence at %u baud: %llu us, expected "
+		        "%llu us\n", known[idx].baud, (unsigned long long)got,
+		        (unsigned long long)known[idx].us);
+		++failed;
+	}
+
+	return failed;
+}
+
+/*** Benchmarks ***************************************************************/
+//Writes the ping and reads it back from an echo device with the Ser_* API
+static void Bench_ApiEcho(const char *port, const size_t runs,
+                          BenchResult *res)
+{
+	SerialDevice dev;
+	PortSettings port_conf;
+	Qry_DefaultPortSettings(&port_conf);
+	if(Qry_OpenPort(port, &port_conf, &dev) != 0) return;
+
+	char buf[PING_LEN];
+	for(size_t run = 0; run < runs; run++)
+	{
+		uint64_t start = Tim_NowUs();
+		if(Ser_WriteBuffer(_ping, PING_LEN, &dev) != 0) break;
+
+		uint64_t deadline = Tim_DeadlineIn(TIM_MS(1000));
+		size_t got = 0;
+		while(got < PING_LEN)
+		{
+			ssize_t ret = Ser_ReadTimed(buf + got, PING_LEN - got, deadline,
+			                            &dev);
+			if(ret <= 0) break;
+			got += (size_t)ret;
+		}
+		if(got != PING_LEN) break;
+
+		res->samples[res->runs++] = Tim_NowUs() - start;
+		res->bytes += got;
+	}
+
+	Ser_CloseDevice(&dev);
+}
+
+//Queries a device with Qry_Transact, until its "OK\r\n" terminator arrives
+static void Bench_ApiQuery(const char *port, const size_t runs,
+                           BenchResult *res)
+{
+	SerialDevice dev;
+	PortSettings port_conf;
+	Qry_DefaultPortSettings(&port_conf);
+	if(Qry_OpenPort(port, &port_conf, &dev) != 0) return;
+
+	QuerySettings query;
+	Qry_DefaultQuerySettings(&query);
+	query.rxdelay = 0;
+	query.first_byte = TIM_MS(1000);
+	query.inter_char = TIM_MS(1000);
+	query.term = "OK\r\n";
+	query.term_len = 4;
+
+	char buf[64];
+	for(size_t run = 0; run < runs; run++)
+	{
+		uint64_t start = Tim_NowUs();
+		ssize_t ret = Qry_Transact(&dev, &query, _ping, PING_LEN, buf,
+		                           sizeof(buf));
+		if(ret != 4) break;
+
+		res->samples[res->runs++] = Tim_NowUs() - start;
+		res->bytes += (size_t)ret;
+	}
+
+	Ser_CloseDevice(&dev);
+}
+
+static int Bench_CountSink(const char *data, const size_t len, void *ctx)
+{
+	(void)data;
+	(void)len;
+	(void)ctx;
+	return 0;
+}
+
+//Streams a large response with Qry_TransactStream
+static void Bench_ApiStream(const char *port, const size_t runs,
+                            BenchResult *res)
+{
+	SerialDevice dev;
+	PortSettings port_conf;
+	Qry_DefaultPortSettings(&port_conf);
+	if(Qry_OpenPort(port, &port_conf, &dev) != 0) return;
+
+	QuerySettings query;
+	Qry_DefaultQuerySettings(&query);
+	query.rxdelay = 0;
+	query.first_byte = TIM_MS(1000);
+	query.inter_char = TIM_MS(1000);
+	query.term = "END\r\n";
+	query.term_len = 5;
+
+	char buf[4096];
+	for(size_t run = 0; run < runs; run++)
+	{
+		uint64_t start = Tim_NowUs();
+		ssize_t ret = Qry_TransactStream(&dev, &query, _ping, PING_LEN, buf,
+		                                 sizeof(buf), Bench_CountSink, NULL);
+		if(ret != STREAM_LEN + 5) break;
+
+		res->samples[res->runs++] = Tim_NowUs() - start;
+		res->bytes += (size_t)ret;
+	}
+
+	Ser_CloseDevice(&dev);
+}
+
+//Runs the sqirt binary against an echo device, including its start up time
+static void Bench_Binary(const char *port, const size_t runs, BenchResult *res)
+{
+	for(size_t run = 0; run < runs; run++)
+	{
+		uint64_t start = Tim_NowUs();
+
+		pid_t pid = fork();
+		if(pid < 0) break;
+		if(pid == 0)
+		{
+			int null_fd = open("/dev/null", O_WRONLY);
+			if(null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+
+			execl(_sqirt, _sqirt, "-p", port, "-m", "PING", "-nl", "-tm", "\\n",
+			      "-rd", "0", "-to", "1000ms", (char *)NULL);
+			_exit(127);
+		}
+
+		int status;
+		if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		   WEXITSTATUS(status) != 0)
+		{
+			break;
+		}
+
+		res->samples[res->runs++] = Tim_NowUs() - start;
+		res->bytes += 6;
+	}
+}
+
+//Checksums a buffer with the algorithm [name], each run is one whole buffer
+static void Bench_Checksum(const char *name, const size_t runs,
+                           BenchResult *res)
+{
+	uint8_t *buf = malloc(CHK_LEN);
+	if(buf == NULL) return;
+
+	for(size_t idx = 0; idx < CHK_LEN; idx++) buf[idx] = (uint8_t)(idx * 131);
+
+	//Keep the result live so the work cannot be optimised away
+	volatile uint32_t sink = 0;
+	uint64_t start = Tim_NowUs();
+	for(size_t run = 0; run < runs; run++)
+	{
+		uint64_t run_start = Tim_NowUs();
+
+		uint32_t value;
+		if(Chk_Compute(name, buf, CHK_LEN, &value) != 0) break;
+		sink ^= value;
+
+		res->samples[res->runs++] = Tim_NowUs() - run_start;
+		res->bytes += CHK_LEN;
+	}
+	res->total = Tim_NowUs() - start;
+	(void)sink;
+
+	free(buf);
+}
+
+//Queries every device in [sims] at once, [rounds] times, with [backend].
+//Reports system calls and CPU time (of this process only) per query
+static void Bench_Fanout(const IobBackend backend, SimDevice *sims,
+                         const size_t count, const size_t rounds)
+{
+	const char *name = Iob_BackendName(backend);
+
+	IoBatch iob;
+	int uring_err;
+	SerialDevice *devs = calloc(count, sizeof(SerialDevice));
+	IobQuery *queries = calloc(count, sizeof(IobQuery));
+	if(devs == NULL || queries == NULL ||
+	   Iob_Init(&iob, backend, count, 64, &uring_err) != 0)
+	{
+		printf("%-10s %8s\n", name, "FAILED");
+		free(devs);
+		free(queries);
+		return;
+	}
+
+	if(iob.backend != backend)
+	{
+		printf("%-10s %8s (%s)\n", name, "N/A", strerror(uring_err));
+		goto cleanup;
+	}
+
+	PortSettings port_conf;
+	Qry_DefaultPortSettings(&port_conf);
+
+	QuerySettings query;
+	Qry_DefaultQuerySettings(&query);
+	query.txdelay = 0;
+	query.rxdelay = 0;
+	query.first_byte = TIM_MS(1000);
+	query.inter_char = TIM_MS(1000);
+	query.term = "OK\r\n";
+	query.term_len = 4;
+
+	size_t opened = 0;
+	for(; opened < count; opened++)
+	{
+		int open_err = Qry_OpenPort(sims[opened].path, &port_conf,
+		                            &devs[opened]);
+		if(open_err != 0) break;
+	}
+
+	size_t done = 0;
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	uint64_t start = Tim_NowUs();
+
+	for(size_t round = 0; round < rounds && opened == count; round++)
+	{
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			queries[idx].dev = &devs[idx];
+			queries[idx].mesg = _ping;
+			queries[idx].mesg_len = PING_LEN;
+			queries[idx].query = &query;
+			queries[idx].status = 0;
+		}
+
+		if(Iob_Run(&iob, queries, count) != 0) break;
+
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			if(queries[idx].status == 0 && queries[idx].rx.term_found) ++done;
+		}
+	}
+
+	uint64_t total = Tim_NowUs() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	if(done == 0)
+	{
+		printf("%-10s %8s\n", name, "FAILED");
+	} else {
+		double cpu =
+			(double)(after.ru_utime.tv_sec - before.ru_utime.tv_sec +
+			         after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e6 +
+			(double)(after.ru_utime.tv_usec - before.ru_utime.tv_usec +
+			         after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+
+		printf("%-10s %8zu %8zu %12.0f %12.2f %12.2f\n", name, count, done,
+		       (double)done / ((double)total / 1e6),
+		       (double)iob.syscalls / (double)done, cpu / (double)done);
+	}
+
+	for(size_t idx = 0; idx < opened; idx++) Ser_CloseDevice(&devs[idx]);
+
+cleanup:
+	Iob_Free(&iob);
+	free(devs);
+	free(queries);
+}
+
+/*** Main Program *************************************************************/
+typedef void (*BenchFunc)(const char *port, const size_t runs, BenchResult *);
+
+//Starts a device with [conf], runs [runs] of benchmark [func] against it and
+//reports the result
+static void Bench_Run(const char *name, const SimConfig *conf,
+                      const size_t runs, BenchFunc func)
+{
+	BenchResult res = {NULL, 0, 0, 0};
+	res.samples = malloc(runs * sizeof(uint64_t));
+
+	SimDevice sim;
+	int sim_err = res.samples == NULL ? ENOMEM : Sim_Start(conf, &sim);
+	if(sim_err != 0)
+	{
+		fprintf(stderr, "%s: Cannot start device: %s\n", name,
+		        strerror(sim_err));
+		free(res.samples);
+		return;
+	}
+
+	uint64_t start = Tim_NowUs();
+	func(sim.path, runs, &res);
+	res.total = Tim_NowUs() - start;
+
+	Sim_Stop(&sim);
+	Bench_Report(name, &res);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1) _sqirt = argv[1];
+
+	if(Bench_CheckSilence() != 0) return 1;
+
+	SimConfig echo = {SIM_ECHO, 0, 0};
+	SimConfig canned = {SIM_CANNED, 0, 0};
+	SimConfig delayed = {SIM_CANNED, CANNED_DELAY, 0};
+	SimConfig stream = {SIM_STREAM, 0, STREAM_LEN};
+
+	printf("%-28s %8s %10s %10s %12s %14s\n", "Benchmark", "Runs", "p50 us",
+	       "p99 us", "Queries/s", "Bytes/s");
+
+	Bench_Run("api echo", &echo, API_RUNS, Bench_ApiEcho);
+	Bench_Run("api query", &canned, API_RUNS, Bench_ApiQuery);
+	Bench_Run("api query 1ms delay", &delayed, CANNED_RUNS, Bench_ApiQuery);
+	Bench_Run("api stream 4MiB", &stream, STREAM_RUNS, Bench_ApiStream);
+	Bench_Run("sqirt binary echo", &echo, BIN_RUNS, Bench_Binary);
+
+	//Checksums need no device, each run checksums 1MiB
+	static const char *const algorithms[] = {
+		"crc8", "crc16-ccitt", "crc16-xmodem", "crc16-modbus", "crc32",
+		"crc32c", "sum8", "xor8"
+	};
+
+	for(size_t idx = 0; idx < sizeof(algorithms) / sizeof(algorithms[0]); idx++)
+	{
+		BenchResult res = {malloc(CHK_RUNS * sizeof(uint64_t)), 0, 0, 0};
+		if(res.samples == NULL) break;
+
+		char name[32];
+		snprintf(name, sizeof(name), "checksum %s 1MiB", algorithms[idx]);
+		Bench_Checksum(algorithms[idx], CHK_RUNS, &res);
+		Bench_Report(name, &res);
+	}
+
+	/*** Fan-out backends, one query to every device per round ***************/
+	SimDevice *sims = calloc(FAN_PORTS, sizeof(SimDevice));
+	if(sims == NULL) return 1;
+
+	size_t started = 0;
+	for(; started < FAN_PORTS; started++)
+	{
+		int sim_err = Sim_Start(&canned, &sims[started]);
+		if(sim_err != 0)
+		{
+			fprintf(stderr, "fan-out: Cannot start device: %s\n",
+			        strerror(sim_err));
+			break;
+		}
+	}
+
+	printf("\n%-10s %8s %8s %12s %12s %12s\n", "Fan-out", "Ports", "Queries",
+	       "Queries/s", "Syscalls/q", "CPU us/q");
+
+	if(started == FAN_PORTS)
+	{
+		Bench_Fanout(IOB_POLL, sims, FAN_PORTS, FAN_ROUNDS);
+		Bench_Fanout(IOB_URING, sims, FAN_PORTS, FAN_ROUNDS);
+	}
+
+	for(size_t idx = 0; idx < started; idx++) Sim_Stop(&sims[idx]);
+	free(sims);
+
+	return 0;
+}
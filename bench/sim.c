@@ -0,0 +1,135 @@
+/*******************************************************************************
+* Device simulator - Attaches a simulated serial device to a pseudo terminal
+* pair, so sqirt can be benchmarked on a machine with no serial hardware.
+* The device runs in a child process on the master end, sqirt opens the slave
+* end by its path like any other port.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+#include "timing.h"
+
+/*** Private Functions ********************************************************/
+//Writes all [len] bytes of [buf] to [fd]. Returns 0 if ok, -1 on error
+static int Sim_WriteAll(const int fd, const char *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t ret = write(fd, buf, len);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+//Sends the response to one received line
+static int Sim_Respond(const SimConfig *conf, const int fd, const char *payload)
+{
+	Tim_SleepUs(conf->delay);
+
+	if(conf->mode == SIM_STREAM)
+	{
+		if(Sim_WriteAll(fd, payload, conf->stream_len) != 0) return -1;
+		return Sim_WriteAll(fd, "END\r\n", 5);
+	}
+
+	return Sim_WriteAll(fd, "OK\r\n", 4);
+}
+
+//The device process. Runs until it is killed or the pty fails
+static void Sim_Run(const SimConfig *conf, const int fd)
+{
+	char *payload = NULL;
+	if(conf->mode == SIM_STREAM)
+	{
+		payload = malloc(conf->stream_len);
+		if(payload == NULL) _exit(EXIT_FAILURE);
+
+		for(size_t idx = 0; idx < conf->stream_len; idx++)
+		{
+			payload[idx] = (char)('A' + idx % 26);
+		}
+	}
+
+	char buf[4096];
+	for(;;)
+	{
+		ssize_t byte_count = read(fd, buf, sizeof(buf));
+		if(byte_count < 0 && errno == EINTR) continue;
+		if(byte_count <= 0) _exit(EXIT_FAILURE);
+
+		if(conf->mode == SIM_ECHO)
+		{
+			if(Sim_WriteAll(fd, buf, (size_t)byte_count) != 0) _exit(EXIT_FAILURE);
+			continue;
+		}
+
+		//Respond once for every line ending received
+		for(ssize_t idx = 0; idx < byte_count; idx++)
+		{
+			if(buf[idx] == '\n' && Sim_Respond(conf, fd, payload) != 0)
+			{
+				_exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+/*** API Functions ************************************************************/
+int Sim_Start(const SimConfig *conf, SimDevice *sim)
+{
+	//Start the slave end raw, so nothing is echoed or translated before the
+	//port under test configures it
+	struct termios raw;
+	memset(&raw, 0, sizeof(raw));
+	cfmakeraw(&raw);
+
+	if(openpty(&sim->master, &sim->slave, sim->path, &raw, NULL) != 0)
+	{
+		return errno;
+	}
+
+	sim->pid = fork();
+	if(sim->pid < 0)
+	{
+		int err = errno;
+		close(sim->master);
+		close(sim->slave);
+		return err;
+	}
+
+	if(sim->pid == 0)
+	{
+		close(sim->slave);
+		Sim_Run(conf, sim->master);
+	}
+
+	return 0;
+}
+
+int Sim_Stop(SimDevice *sim)
+{
+	kill(sim->pid, SIGTERM);
+	if(waitpid(sim->pid, NULL, 0) < 0) return errno;
+
+	close(sim->master);
+	close(sim->slave);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*******************************************************************************
+* Device simulator - Attaches a simulated serial device to a pseudo terminal
+* pair, so sqirt can be benchmarked on a machine with no serial hardware.
+* The device runs in a child process on the master end, sqirt opens the slave
+* end by its path like any other port.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef SIM_H
+#define SIM_H
+
+//What the simulated device does with what it receives
+typedef enum
+{
+	SIM_ECHO,                    //Sends every byte straight back
+	SIM_CANNED,                  //Sends "OK\r\n" [delay] after each line
+	SIM_STREAM                   //Sends [stream_len] bytes then "END\r\n"
+	                             //[delay] after each line
+} SimMode;
+
+typedef struct
+{
+	SimMode mode;
+	uint64_t delay;              //Response delay in microseconds
+	size_t stream_len;           //Payload length for SIM_STREAM
+} SimConfig;
+
+typedef struct
+{
+	char path[64];               //Slave end, open this as the port
+	int master;
+	int slave;                   //Held open so the device never sees a hangup
+	pid_t pid;                   //Device process
+} SimDevice;
+
+//Creates a pty pair and starts the device described by [conf] on it.
+//Returns errno (=0 if ok)
+int Sim_Start(const SimConfig *conf, SimDevice *);
+
+//Stops the device and closes the pty pair. Returns errno (=0 if ok)
+int Sim_Stop(SimDevice *);
+
+#endif
@@ -0,0 +1,33 @@
+/*******************************************************************************
+* Batch handler - Runs a stream of queries back to back on one open
+* SerialDevice, so the port is only opened and configured once.
+*
+* Input:  One message per line, using the escape sequences from escape.h.
+*         Empty lines and lines starting with '#' are skipped.
+* Output: One record per message, in the same order:
+*         <line number>\tOK\t<escaped response>\n
+*         <line number>\tERR\t<error string>\n
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "serial.h"
+#include "query.h"
+#include "cache.h"
+
+#ifndef BATCH_H
+#define BATCH_H
+
+//Runs every message read from [in] on [dev], writing a record for each to
+//[out]. [newline] appends "\r\n" to every message, [resp_len] is the maximum
+//response size. If the query has a cache_ttl, repeated messages are answered
+//from [cache] while their response is valid.
+//Returns the number of queries that failed, or -1 if [in] or [out] failed.
+long Bat_Run(FILE *in, FILE *out, SerialDevice *, const PortSettings *,
+             const QuerySettings *, const bool newline, const size_t resp_len,
+             ResponseCache *cache);
+
+#endif
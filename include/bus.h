@@ -0,0 +1,68 @@
+/*******************************************************************************
+* Bus coordination - Lets separate sqirt processes share one port. A shared
+* memory object per port, /dev/shm/sqirt.<port path>, holds the query that is
+* currently on the bus and the response of the last one.
+*
+* The object is also flock()ed while a query is on the bus, so queries from
+* different processes never collide on the tty. A caller whose query is
+* identical to the one already on the bus waits for it, and is handed a copy of
+* its response instead of running its own transaction.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "query.h"
+
+#ifndef BUS_H
+#define BUS_H
+
+#define BUS_MAX_MESG_LEN 4096        //Longer messages are never shared
+#define BUS_MAX_RESP_LEN (1 << 16)   //Longer responses are never shared (64KiB)
+
+//A process's link to the shared state of one port
+typedef struct
+{
+	int filedesc;                //Shared memory object, also the bus lock
+	struct BusShared *shared;    //Mapping of the object
+
+	//Set while this process has the bus
+	bool leading;
+	uint64_t gen;                //Generation of the transaction being run
+	QuerySink sink;              //Sink the response is passed on to
+	void *sink_ctx;
+	char *resp;                  //Copy of the response, for the waiters
+	size_t resp_len;             //May exceed BUS_MAX_RESP_LEN, then not shared
+} BusLink;
+
+//Opens, or creates, the shared state of the port [filename].
+//Returns errno (=0 if ok)
+int Bus_Open(const char *filename, BusLink *);
+
+//Starts a query of [mesg] with the given settings.
+//If the same query is already on the bus, waits for it to finish, passes its
+//response to [sink] and sets [*shared]. [*status] is then the errno of the
+//shared transaction (=0 if ok).
+//Otherwise, waits for the bus to be free and takes it. The caller must then
+//run the transaction with Bus_Sink as the sink and [link] as the context, and
+//call Bus_End, even if the port could not be opened.
+//Returns errno (=0 if ok)
+int Bus_Begin(BusLink *, const PortSettings *, const QuerySettings *,
+              const char *mesg, const size_t mesg_len, QuerySink sink,
+              void *ctx, bool *shared, int *status);
+
+//QuerySink that keeps a copy of the response for the waiters, then passes it
+//on to the sink given to Bus_Begin. [ctx] is the BusLink
+int Bus_Sink(const char *data, const size_t len, void *ctx);
+
+//Hands the response and [status] of the transaction (errno, =0 if ok) to any
+//waiters, then frees the bus
+void Bus_End(BusLink *, const int status);
+
+//Unmaps the shared state. Frees the bus first if it is still held
+void Bus_Close(BusLink *);
+
+#endif
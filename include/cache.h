@@ -0,0 +1,83 @@
+/*******************************************************************************
+* Response cache - Keeps the responses of recent queries for a short time, so
+* a repeated identical query can be answered without touching the bus.
+*
+* Responses are keyed on the port, its settings, the receive settings and the
+* message. Each entry expires after the TTL it was stored with. Only complete
+* responses are stored, see Cch_Store.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "query.h"
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CCH_MAX_ENTRIES  128         //Entries kept, least recently used go first
+#define CCH_MAX_RESP_LEN (1 << 16)   //Larger responses are not cached (64KiB)
+
+typedef struct
+{
+	uint64_t hash;               //Hash of [key], checked before comparing it
+	char *key;
+	size_t key_len;
+	char *resp;
+	size_t resp_len;
+	uint64_t expires;            //timing.h deadline the entry is valid until
+	unsigned long last_used;     //Lookup counter value of the last use
+	bool used;
+} CchEntry;
+
+typedef struct
+{
+	CchEntry entries[CCH_MAX_ENTRIES];
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long lookups;
+} ResponseCache;
+
+//Key of one query, built by Cch_Lookup and kept by the caller until the
+//response is stored with Cch_Store. Its buffer is reused by later lookups
+typedef struct
+{
+	char *data;                  //=NULL if the key could not be built
+	size_t len;
+	size_t size;
+	uint64_t hash;
+} CchKey;
+
+//Starts an empty cache
+void Cch_Init(ResponseCache *);
+
+//Starts an empty key
+void Cch_InitKey(CchKey *);
+
+//Looks up the response to [mesg] of length [mesg_len] on [port], building
+//the key of the query into [key].
+//Returns the entry if a response is stored and has not expired, or NULL
+const CchEntry *Cch_Lookup(ResponseCache *, CchKey *key, const char *port,
+                           const PortSettings *, const QuerySettings *,
+                           const char *mesg, const size_t mesg_len);
+
+//Stores [resp] of length [resp_len] as the response to the query of [key],
+//valid for [ttl] microseconds. Empty responses, responses without the
+//terminator and responses over CCH_MAX_RESP_LEN are not stored.
+//Returns errno (=0 if ok, ENOSPC/ENODATA if the response was not stored)
+int Cch_Store(ResponseCache *, const CchKey *key, const QuerySettings *,
+              const char *resp, const size_t resp_len, const uint64_t ttl);
+
+//Writes the hit and miss counters to [out] as one line
+void Cch_PrintStats(const ResponseCache *, FILE *out);
+
+//Frees every entry
+void Cch_Free(ResponseCache *);
+
+//Frees the buffer of [key]
+void Cch_FreeKey(CchKey *);
+
+#endif
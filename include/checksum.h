@@ -0,0 +1,106 @@
+/*******************************************************************************
+* Checksum engine - Computes, appends and verifies the CRCs and checksums
+* devices add to their messages. CRCs use slicing-by-8 tables, built on first
+* use, and CRC-32C uses the SSE4.2 crc32 instruction when the CPU has it.
+* Responses can be verified as they are streamed, without being held in full.
+*
+* Algorithms       Width  Wire order
+*   crc8           8      -             poly 0x07
+*   crc16-ccitt    16     big endian    poly 0x1021, init 0xFFFF
+*   crc16-xmodem   16     big endian    poly 0x1021, init 0x0000
+*   crc16-modbus   16     little endian poly 0x8005, reflected
+*   crc32          32     little endian poly 0x04C11DB7, reflected (zlib)
+*   crc32c         32     little endian poly 0x1EDC6F41, reflected
+*   sum8           8      -             sum of every byte
+*   xor8           8      -             xor of every byte
+* A ":be" or ":le" suffix on the name overrides the wire order.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "query.h"
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#define CHK_MAX_LEN 4                //Longest checksum, in bytes
+
+typedef enum
+{
+	CHK_CRC,
+	CHK_SUM,
+	CHK_XOR
+} ChkKind;
+
+typedef struct
+{
+	const char *name;
+	ChkKind kind;
+	unsigned int width;          //Width in bits
+	uint32_t poly;               //Reflected for reflected CRCs
+	uint32_t init;
+	uint32_t xorout;
+	bool reflected;
+	bool big_endian;             //Default wire order
+} ChkAlgorithm;
+
+//A checksum being computed, and the wire order it uses
+typedef struct
+{
+	const ChkAlgorithm *alg;
+	uint32_t state;
+	bool big_endian;
+} ChkState;
+
+//Checks a streamed response as it is passed on to another sink. The last
+//[hold_len] bytes are held back, as they are the checksum (and terminator)
+typedef struct
+{
+	ChkState chk;
+	QuerySink next;              //Sink the response is passed on to
+	void *next_ctx;
+	uint8_t held[CHK_MAX_LEN + QRY_MAX_TERM_LEN];
+	size_t hold_len;
+	size_t held_len;
+} ChkStream;
+
+//Starts the checksum [name] (see above) in [chk].
+//Returns 0 if ok, -1 if the name is not known
+int Chk_Begin(const char *name, ChkState *chk);
+
+//Adds [len] bytes of [data] to the checksum
+void Chk_Update(ChkState *chk, const void *data, size_t len);
+
+//Returns the checksum of everything added
+uint32_t Chk_Final(const ChkState *chk);
+
+//Returns the length of the checksum on the wire, in bytes
+size_t Chk_Length(const ChkState *chk);
+
+//Writes [value] into [out] in wire order. Returns the bytes written
+size_t Chk_Encode(const ChkState *chk, const uint32_t value, uint8_t *out);
+
+//Computes the checksum [name] of [len] bytes of [data] in one call.
+//Returns 0 if ok, -1 if the name is not known
+int Chk_Compute(const char *name, const void *data, const size_t len,
+                uint32_t *value);
+
+//Starts checking a stream with the checksum in [chk] (already begun) that
+//ends with the checksum then [term_len] bytes of terminator, passing the
+//bytes on to [next]
+void Chk_StreamBegin(ChkStream *, const ChkState *chk, const size_t term_len,
+                     QuerySink next, void *next_ctx);
+
+//QuerySink that checks and passes on each chunk. [ctx] is a ChkStream
+int Chk_StreamSink(const char *data, const size_t len, void *ctx);
+
+//Checks the checksum at the end of the stream.
+//Returns 0 if it matches, EBADMSG if it does not, ENODATA if the stream was
+//too short to hold one
+int Chk_StreamResult(const ChkStream *);
+
+#endif
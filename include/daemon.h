@@ -0,0 +1,93 @@
+/*******************************************************************************
+* sqirtd - Persistent sqirt daemon. Keeps SerialDevices open and configured,
+* and serves query requests from local clients over a Unix Domain Socket.
+* Requests from many clients are queued for their port, then run one at a
+* time in priority order by its scheduler (see scheduler.h). Every port runs
+* at once.
+* Also contains the client side, used by sqirt to forward queries to sqirtd
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "query.h"
+#include "scheduler.h"
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*** Configuration ************************************************************/
+#define DMN_DEFAULT_SOCKET "/tmp/sqirtd.sock"
+#define DMN_MAX_PORTS      32          //Maximum number of ports kept open
+#define DMN_MAX_PORT_LEN   256         //Maximum length of a port filename
+#define DMN_MAX_MESG_LEN   (1 << 16)   //Maximum message length (64KiB)
+#define DMN_CHUNK_LEN      4096        //Response bytes read/sent at once
+#define DMN_MAX_CLIENTS    SCH_MAX_QUEUED  //Clients connected at once
+
+//Magic value at the start of every request, changes with the protocol
+#define DMN_MAGIC          0x53515207
+
+/*** Wire Protocol ************************************************************/
+//Sent by the client, followed by [port_len] bytes of port filename,
+//[mesg_len] bytes of message and [term_len] bytes of terminator.
+//Values are in host byte order, as the socket is always local
+typedef struct
+{
+	uint32_t magic;              //Must be DMN_MAGIC
+	uint32_t baud;               //PortSettings
+	uint32_t bitlength;
+	uint32_t txdelay;            //QuerySettings, all times in microseconds
+	uint32_t rxdelay;
+	uint32_t first_byte;
+	uint32_t inter_char;
+	uint32_t deadline;
+	uint32_t cache_ttl;          //0 to skip the response cache
+	uint32_t priority;           //SchClass of the request
+	uint64_t sent;               //Tim_NowUs() when sent, CLOCK_MONOTONIC is
+	                             //shared by every process on the machine
+	uint32_t port_len;
+	uint32_t mesg_len;
+	uint32_t term_len;
+} DmnRequest;
+
+//Sent by the daemon, followed by [len] bytes of response. The response is
+//streamed as it arrives, as any number of frames with a [len] > 0, then ends
+//with a frame with a [len] of 0 and the final status of the query
+typedef struct
+{
+	int32_t status;              //errno of the transaction (=0 if ok)
+	uint32_t len;                //Number of response bytes that follow
+	uint32_t queue_us;           //End frame only, time spent queued
+	uint32_t bus_us;             //End frame only, time spent on the bus
+} DmnResponse;
+
+//Priority of a query sent to the daemon, and the times it reports back
+typedef struct
+{
+	SchClass priority;
+	uint64_t queue_us;           //Set by Dmn_Query
+	uint64_t bus_us;             //Set by Dmn_Query, 0 for a cached response
+} DmnSchedule;
+
+/*** API Functions ************************************************************/
+//Listen on [sock_path] and serve requests until SIGINT or SIGTERM is received.
+//Requests with a cache_ttl are answered from the response cache while their
+//response is valid, without being queued. The cache and queue counters are
+//written to stderr on SIGUSR1.
+//Returns errno (=0 if ok)
+int Dmn_Serve(const char *sock_path);
+
+//Sends a query to the daemon listening on [sock_path]. The response is read
+//through [buf] of size [buf_len] and passed to [sink] as it arrives.
+//[sched] gives the priority and receives the times, NULL for normal priority.
+//Returns bytes received, if this is -1, an error occured. See errno
+ssize_t Dmn_Query(const char *sock_path, const char *port,
+                  const PortSettings *, const QuerySettings *,
+                  const char *mesg, const size_t mesg_len,
+                  char *buf, const size_t buf_len, QuerySink sink, void *ctx,
+                  DmnSchedule *sched);
+
+#endif
@@ -0,0 +1,23 @@
+/*******************************************************************************
+* Escape handler - Converts between raw byte strings and single line, C style
+* escaped text (\r \n \t \\ \xHH) used by the sqirt text record formats
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+//Decodes the escape sequences in [str] in-place. The decoded string may
+//contain '\0' bytes, so its length is returned. Unknown escape sequences are
+//kept as-is.
+size_t Esc_Decode(char *str);
+
+//Writes [len] bytes of [buf] to [out], escaping all control characters,
+//non-ASCII bytes and '\' so the output fits on a single line.
+//Returns 0 if ok, EOF if a write error occured
+int Esc_Encode(const char *buf, const size_t len, FILE *out);
+
+#endif
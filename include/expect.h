@@ -0,0 +1,96 @@
+/*******************************************************************************
+* Expect handler - Runs a send/expect conversation script against one open
+* SerialDevice, e.g. to bring up a modem or a bootloader. Received bytes are
+* matched against the expected pattern as they arrive, so the next step starts
+* the moment its trigger shows up rather than after a fixed delay.
+*
+* Input:  One step per line, fields separated by tabs, using the escape
+*         sequences from escape.h:
+*         send\t<message>
+*         expect\t<pattern>\t<timeout>[\t<on failure>]
+*         sleep\t<time>
+*         label\t<name>
+*         goto\t<name>
+*         exit\t<status>
+*         Times use the same format as the -to argument, an expect timeout of
+*         0 waits forever. On failure is one of:
+*         retry <n>     run again from the last send, up to n more times
+*         goto <name>   continue from the label
+*         exit <status> end the script with that exit status
+*         and is "exit 1" if not given.
+*         Bytes received after a match are kept for the next expect.
+*         Empty lines and lines starting with '#' are skipped.
+* Output: Every byte received is written to the transcript as it arrives.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "serial.h"
+
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#define EXP_MAX_STEPS 1024     //Maximum number of steps in one script
+
+typedef enum
+{
+	EXP_SEND,
+	EXP_EXPECT,
+	EXP_SLEEP,
+	EXP_LABEL,
+	EXP_GOTO,
+	EXP_EXIT
+} ExpOp;
+
+typedef enum
+{
+	EXP_FAIL_EXIT,
+	EXP_FAIL_RETRY,
+	EXP_FAIL_GOTO
+} ExpFail;
+
+typedef struct
+{
+	ExpOp op;
+	unsigned long line;          //Line in the script file
+
+	char *text;                  //Message, pattern or label name
+	size_t text_len;
+	size_t *prefix;              //expect: matched prefix table of the pattern
+	uint64_t time;               //expect timeout or sleep time
+	int status;                  //exit status
+
+	ExpFail fail;                //expect: what to do when it times out
+	unsigned long retries;       //  EXP_FAIL_RETRY: retries allowed
+	int fail_status;             //  EXP_FAIL_EXIT: exit status
+	char *fail_label;            //  EXP_FAIL_GOTO: label name
+	size_t target;               //goto, EXP_FAIL_GOTO: step to continue from
+} ExpStep;
+
+typedef struct
+{
+	ExpStep *steps;
+	size_t count;
+} ExpScript;
+
+//Reads the script from [in]. [newline] appends "\r\n" to every message.
+//Returns 0 if ok, or -1 on error with [*line_num] set to the offending line
+//(0 for an I/O or memory error)
+int Exp_ReadScript(FILE *in, const bool newline, ExpScript *,
+                   unsigned long *line_num);
+
+//Runs [script] on [dev], writing everything received to [transcript].
+//Returns the exit status of the script, or -1 if the port failed (see errno).
+//[*fail_line] is set to the line of the expect that ended the script by
+//failing, 0 if there was none
+int Exp_Run(const ExpScript *, SerialDevice *, FILE *transcript,
+            unsigned long *fail_line);
+
+//Frees the steps of the script
+void Exp_FreeScript(ExpScript *);
+
+#endif
@@ -0,0 +1,67 @@
+/*******************************************************************************
+* Fan-out handler - Sends messages to many SerialDevices at once, then gathers
+* all of the responses together (see iobatch.h), so the total time taken is
+* that of the slowest device rather than the sum of them all.
+*
+* Input:  One query per line, using the escape sequences from escape.h:
+*         <port>\t<message>[\t<timeout>]
+*         The optional timeout replaces the Timeout (first byte) for that port
+*         and uses the same format as the -to argument.
+*         Empty lines and lines starting with '#' are skipped.
+* Output: One record per query, in the same order:
+*         <port>\tOK\t<escaped response>\n
+*         <port>\tERR\t<error string>\n
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "serial.h"
+#include "query.h"
+#include "iobatch.h"
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#define FAN_MAX_ENTRIES 256    //Maximum number of ports in one fan-out
+
+typedef struct
+{
+	char *port;                  //Port filename
+	char *mesg;                  //Message to send
+	size_t mesg_len;
+	QuerySettings query;         //Settings for this port only
+
+	SerialDevice dev;
+	bool open;
+
+	//Results
+	int status;                  //errno of the query (=0 if ok)
+	char *resp;                  //Response buffer, resp_len bytes long
+	QueryRx rx;                  //Receive progress, rx.total bytes received
+} FanEntry;
+
+//Reads the query list from [in], each entry copies the settings in [query],
+//and the port timeout if given. [newline] appends "\r\n" to every message.
+//Returns the number of entries read into [*entries], or -1 on error with
+//[*line_num] set to the offending line (0 for an I/O or memory error)
+long Fan_ReadList(FILE *in, const QuerySettings *, const bool newline,
+                  FanEntry **entries, unsigned long *line_num);
+
+//Opens every port, transmits every message, then receives every response
+//concurrently using [backend]. Each entry gets its own status and response.
+//If uring was asked for but is not available, poll is used and [*uring_err]
+//is set to the reason.
+//Returns the number of entries that failed, or -1 if the backend failed (errno)
+long Fan_Run(FanEntry *, const size_t count, const PortSettings *,
+             const size_t resp_len, const IobBackend backend, int *uring_err);
+
+//Writes a result record for every entry to [out]
+void Fan_PrintResults(const FanEntry *, const size_t count, FILE *out);
+
+//Frees the entries and their buffers
+void Fan_FreeList(FanEntry *, const size_t count);
+
+#endif
@@ -0,0 +1,95 @@
+/*******************************************************************************
+* I/O batch handler - Runs one query on each of many open SerialDevices at
+* once: every message is sent, then every response is received together.
+* Two backends do the I/O, with the same receive rules (see QueryRx):
+*
+*   poll   One epoll_wait() for all ports, then a read() for each that is
+*          ready. A few system calls per query.
+*   uring  The writes, and a poll then read of every port, are queued on an
+*          io_uring and submitted together, so one io_uring_enter() can start
+*          and complete I/O on every port. Reads go into registered buffers.
+*
+* The uring backend falls back to poll if the kernel, or the build, does not
+* support it (see uring.h).
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "serial.h"
+#include "query.h"
+#include "uring.h"
+
+#ifndef IOBATCH_H
+#define IOBATCH_H
+
+#define IOB_TX_LEN 256         //Longer messages are not sent from a
+                               //registered buffer
+
+typedef enum
+{
+	IOB_POLL,
+	IOB_URING,
+	IOB_AUTO                     //uring if it is available, otherwise poll
+} IobBackend;
+
+//One query of a batch
+typedef struct
+{
+	SerialDevice *dev;           //Open port
+	const char *mesg;            //Message to send
+	size_t mesg_len;
+	const QuerySettings *query;  //Receive settings for this port only
+
+	//Results
+	int status;                  //errno of the query (=0 if ok)
+	char *resp;                  //Response, set by Iob_Run
+	QueryRx rx;                  //Receive progress, rx.total bytes received
+
+	//Private to the uring backend
+	unsigned int inflight;       //Requests queued and not yet completed
+	size_t sent;
+} IobQuery;
+
+typedef struct
+{
+	IobBackend backend;          //Backend in use, never IOB_AUTO
+	size_t max_queries;
+	size_t resp_len;             //Size of each response buffer
+	char *bufs;                  //Response buffers, then message buffers
+
+	int epfd;                    //poll backend
+	UrgRing ring;                //uring backend
+	bool fixed;                  //bufs is registered with the ring
+	bool linked;                 //Reads are linked after the writes this run
+
+	unsigned long syscalls;      //I/O system calls made by every Iob_Run
+} IoBatch;
+
+//Parses a backend name, "poll", "uring" or "auto".
+//Returns 0 if ok, -1 if [str] is not a valid backend
+int Iob_ParseBackend(const char *str, IobBackend *);
+
+//Returns the name of [backend]
+const char *Iob_BackendName(const IobBackend backend);
+
+//Sets up a batch of up to [max_queries] queries, with responses of up to
+//[resp_len] bytes, using [backend]. If the uring backend is not available,
+//poll is used and [*uring_err] is set to the reason (=0 if not needed).
+//Returns errno (=0 if ok)
+int Iob_Init(IoBatch *, const IobBackend backend, const size_t max_queries,
+             const size_t resp_len, int *uring_err);
+
+//Sends every message in [queries], then receives every response at once.
+//The delays are those of the first query and are shared by all of them.
+//Each query gets its own status and response.
+//Returns errno (=0 if ok), if the backend itself failed
+int Iob_Run(IoBatch *, IobQuery *queries, const size_t count);
+
+//Frees the batch and its buffers
+void Iob_Free(IoBatch *);
+
+#endif
@@ -0,0 +1,58 @@
+/*******************************************************************************
+* Marker matcher - Finds the first of several end markers, e.g. "OK\r\n",
+* "ERROR\r\n" or "+CME ERROR:", in a response as it is received.
+* The markers are compiled into an Aho-Corasick automaton, so each byte is
+* looked at once, whatever the number of markers, and nothing is buffered.
+* The match state is kept between calls, so a marker split across reads is
+* still found.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef MARKER_H
+#define MARKER_H
+
+#define MRK_MAX_MARKERS 32           //Most markers in one set
+#define MRK_MAX_LEN     1024         //Most bytes of all markers together
+
+//A compiled set of markers. Read only once built, so it can be shared
+typedef struct
+{
+	size_t count;
+	char *text[MRK_MAX_MARKERS];     //Decoded markers, in the order given
+	size_t len[MRK_MAX_MARKERS];
+
+	size_t state_count;
+	uint16_t *next;                  //Next state, [state * 256 + byte]
+	int8_t *found;                   //Marker that ends at each state, -1 for
+	                                 //none
+} MrkSet;
+
+//Match progress through one response
+typedef struct
+{
+	const MrkSet *set;
+	uint16_t state;
+	int marker;                      //Index of the marker found, -1 for none
+} MrkMatch;
+
+//Builds [set] from [str], a list of markers separated by '|', using the escape
+//sequences from escape.h. "\|" is a literal '|'.
+//Returns errno (=0 if ok), EINVAL if the list is not valid
+int Mrk_Parse(const char *str, MrkSet *);
+
+//Starts matching a new response against [set]
+void Mrk_Begin(MrkMatch *, const MrkSet *set);
+
+//Matches [len] more bytes of [data]. Stops at the end of the first marker.
+//Returns true once a marker has been found, see [match->marker]
+bool Mrk_Feed(MrkMatch *, const char *data, const size_t len);
+
+//Frees the markers and the automaton
+void Mrk_Free(MrkSet *);
+
+#endif
@@ -0,0 +1,74 @@
+/*******************************************************************************
+* Modbus RTU master - Encodes requests for function codes 1-6, 15 and 16,
+* performs the transaction on a SerialDevice and decodes the response.
+* The end of a response frame is found by its length as soon as that is known,
+* or by the 3.5 character silence computed from the baudrate, so a poll takes
+* the wire time plus the device time.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* EBADMSG is returned for a CRC error, EPROTO for a response to a different
+* unit or function, ETIMEDOUT if the device did not respond.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+
+#include "serial.h"
+
+#ifndef MODBUS_H
+#define MODBUS_H
+
+#define MB_MAX_ADU        256    //Largest RTU frame, including address and CRC
+#define MB_MAX_READ_BITS  2000   //Most coils/inputs read at once (FC 1, 2)
+#define MB_MAX_READ_REGS  125    //Most registers read at once (FC 3, 4)
+#define MB_MAX_WRITE_BITS 1968   //Most coils written at once (FC 15)
+#define MB_MAX_WRITE_REGS 123    //Most registers written at once (FC 16)
+
+typedef struct
+{
+	uint8_t unit;                //Slave address, 0 to broadcast a write
+	uint8_t function;            //Function code: 1-6, 15 or 16
+	uint16_t addr;               //First coil/register address
+	uint16_t count;              //Number of coils/registers to read or write
+	uint16_t values[MB_MAX_WRITE_BITS];  //Values to write. Coils are 0 or 1
+} MbRequest;
+
+typedef struct
+{
+	uint8_t exception;           //Exception code, 0 if the request succeeded
+	uint16_t values[MB_MAX_READ_BITS];   //Values read. Coils are 0 or 1
+	size_t count;
+} MbResponse;
+
+//Computes the Modbus CRC-16 of [len] bytes of [data] (see checksum.h)
+uint16_t Mb_Crc16(const uint8_t *data, const size_t len);
+
+//Returns the 3.5 character silence that ends a frame at [baud], in
+//microseconds. Fixed at 1750us above 19200 baud, as the spec recommends
+uint64_t Mb_SilenceUs(const unsigned int baud);
+
+//Parses a request string "unit,function,address,count" for reads, or
+//"unit,function,address,value[,value...]" for writes, into [req]. Numbers are
+//decimal, or hex with a 0x prefix.
+//Returns 0 if ok, -1 if the string is not valid
+int Mb_ParseRequest(const char *str, MbRequest *req);
+
+//Encodes [req] into [frame] of at least MB_MAX_ADU bytes, with its CRC.
+//Returns errno (=0 if ok), [*len] is set to the frame length
+int Mb_Encode(const MbRequest *req, uint8_t *frame, size_t *len);
+
+//Checks and decodes the response [frame] of [len] bytes to [req].
+//Returns errno (=0 if ok, including an exception response)
+int Mb_Decode(const MbRequest *req, const uint8_t *frame, const size_t len,
+              MbResponse *resp);
+
+//Sends [req] on [dev] running at [baud], then receives and decodes the
+//response, allowing [timeout] microseconds for it to start.
+//Broadcasts (unit 0) do not wait for a response. Returns errno (=0 if ok)
+int Mb_Transact(SerialDevice *, const MbRequest *req, const unsigned int baud,
+                const uint64_t timeout, MbResponse *resp);
+
+//Returns a description of a Modbus exception code
+const char *Mb_ExceptionString(const uint8_t code);
+
+#endif
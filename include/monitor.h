@@ -0,0 +1,36 @@
+/*******************************************************************************
+* Monitor handler - Keeps a SerialDevice open and captures everything it sends
+* to a file descriptor, until a signal, a byte limit or an error. Bytes are
+* moved with splice() where the kernel supports it, or large reads otherwise.
+* Running driver counters (see Ser_GetCounters) and the rate are written to a
+* stats stream as it runs.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "serial.h"
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+typedef struct
+{
+	uint64_t limit;              //Bytes to capture, 0 for no limit
+	uint64_t interval;           //Microseconds between stats lines, 0 for
+	                             //only one at the end
+	size_t chunk_len;            //Most bytes moved at once
+} MonSettings;
+
+//Streams every byte received on [dev] to [out_fd] until SIGINT or SIGTERM is
+//received, [limit] bytes have been captured or an error occurs. Stats lines
+//are written to [stats] if it is not NULL. [*total] is set to the number of
+//bytes captured.
+//Returns errno (=0 if ok)
+int Mon_Run(SerialDevice *, const int out_fd, const MonSettings *,
+            FILE *stats, uint64_t *total);
+
+#endif
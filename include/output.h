@@ -0,0 +1,45 @@
+/*******************************************************************************
+* Output handler - Writes a response to a file descriptor as it is streamed,
+* in raw binary, text, hex or base64. Bytes go straight to the fd with
+* write()/writev(), so every byte received is written, including 0x00, with
+* no stdio buffering or extra copies.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+typedef enum
+{
+	OUT_TEXT,                    //The bytes as received, then a newline
+	OUT_RAW,                     //The bytes as received, nothing else
+	OUT_HEX,                     //Lowercase hex pairs, then a newline
+	OUT_BASE64                   //Standard base64 with padding, then a newline
+} OutFormat;
+
+typedef struct
+{
+	int fd;
+	OutFormat format;
+	unsigned char carry[3];      //base64 input not yet making a whole group
+	size_t carry_len;
+} OutWriter;
+
+//Sets up [out] to write to [fd] in [format]
+void Out_Init(OutWriter *out, const int fd, const OutFormat format);
+
+//Gets the format named [name]: text, raw, hex or base64.
+//Returns 0 if ok, -1 if the name is not known
+int Out_ParseFormat(const char *name, OutFormat *format);
+
+//Writes [len] bytes of [data]. The context [ctx] is an OutWriter, so this can
+//be used as a QuerySink directly. Returns errno (=0 if ok)
+int Out_Write(const char *data, const size_t len, void *ctx);
+
+//Writes anything still held back and the end of the output. Returns errno
+int Out_Finish(OutWriter *out);
+
+#endif
@@ -0,0 +1,81 @@
+/*******************************************************************************
+* Periodic handler - Runs a schedule of queries at fixed periods from one
+* resident process. Every entry has its own timerfd, so runs are started on
+* kernel deadlines rather than from sleep loops. Ports are opened once and kept
+* open, and each port runs one query at a time, the earliest due first.
+*
+* Input:  One entry per line, using the escape sequences from escape.h:
+*         <port>\t<message>\t<period>[\t<offset>]
+*         Period and offset use the same format as the -to argument. The
+*         offset delays the first run, to spread entries out over the period.
+*         Empty lines and lines starting with '#' are skipped.
+* Output: One record per run, or per run that was missed, as it happens:
+*         <time>\t<line>\t<port>\tOK\t<escaped response>\n
+*         <time>\t<line>\t<port>\tERR\t<error string>\n
+*         <time>\t<line>\t<port>\tMISS\t<runs missed>\n
+*         <time> is the wall clock time the run was due, in seconds with
+*         microseconds, and <line> is the entry's line in the schedule file.
+*         A run is missed if its entry is still queued or running when it is
+*         due again.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "serial.h"
+#include "query.h"
+
+#ifndef PERIODIC_H
+#define PERIODIC_H
+
+#define PER_MAX_ENTRIES 1024   //Maximum number of entries in one schedule
+#define PER_MIN_PERIOD  1000   //Shortest period allowed, in microseconds
+
+typedef struct
+{
+	char *port;                  //Port filename
+	char *mesg;                  //Message to send
+	size_t mesg_len;
+	uint64_t period;             //Microseconds between runs
+	uint64_t offset;             //Microseconds before the first run
+	unsigned long line;          //Line in the schedule file
+
+	//Run state
+	int timerfd;
+	size_t port_idx;             //Index of the entry's port in the run
+	uint64_t due;                //Time the next run is due (Tim_NowUs)
+	uint64_t run_due;            //Time the queued or running run was due
+	bool pending;                //Queued or running
+
+	//Counters
+	unsigned long runs;
+	unsigned long failed;
+	unsigned long missed;
+	uint64_t max_late;           //Longest a run waited for its port
+} PerEntry;
+
+//Reads the schedule from [in]. [newline] appends "\r\n" to every message.
+//Returns the number of entries read into [*entries], or -1 on error with
+//[*line_num] set to the offending line (0 for an I/O or memory error)
+long Per_ReadList(FILE *in, const bool newline, PerEntry **entries,
+                  unsigned long *line_num);
+
+//Runs the schedule until SIGINT or SIGTERM is received, writing a record to
+//[out] for every run. Ports that fail are reopened at their next run.
+//[query] is used for every entry, its txdelay only once after each port is
+//opened. [resp_len] is the largest response kept.
+//Returns errno (=0 if ok)
+int Per_Run(PerEntry *, const size_t count, const PortSettings *,
+            const QuerySettings *, const size_t resp_len, FILE *out);
+
+//Writes the counters of every entry to [out]
+void Per_PrintStats(const PerEntry *, const size_t count, FILE *out);
+
+//Frees the entries and their buffers
+void Per_FreeList(PerEntry *, const size_t count);
+
+#endif
@@ -0,0 +1,73 @@
+/*******************************************************************************
+* Pipeline handler - Keeps up to a set number of queries outstanding on one
+* SerialDevice, for devices that accept a new command before answering the last
+* one and tag each reply. Replies are matched back to their query by tag, so
+* they may arrive in any order, and results are written in query order.
+*
+* Input:  One query per line, using the escape sequences from escape.h:
+*         <tag>\t<message>[\t<timeout>]
+*         The optional timeout replaces the Timeout for that query, it uses
+*         the same format as the -to argument.
+*         Empty lines and lines starting with '#' are skipped.
+* Output: One record per query, in the same order:
+*         <tag>\tOK\t<escaped response>\n
+*         <tag>\tERR\t<error string>\n
+*
+* Replies are split at the terminator, then the tag of each one is taken from
+* the first capture group of a POSIX extended regex (or the whole match if it
+* has no groups). Replies without a tag of an outstanding query are discarded.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <regex.h>
+
+#include "serial.h"
+#include "query.h"
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#define PIP_MAX_ENTRIES 65536  //Maximum number of queries in one pipeline
+#define PIP_MAX_DEPTH   256    //Maximum number of outstanding queries
+
+typedef struct
+{
+	char *tag;                   //Tag the reply must carry
+	char *mesg;                  //Message to send
+	size_t mesg_len;
+	uint64_t timeout;            //Time allowed for the reply, from sending
+
+	//Results
+	int status;                  //errno of the query (=0 if ok)
+	char *resp;                  //Reply, including the terminator
+	size_t resp_len;
+	uint64_t deadline;           //When the reply is due, once sent
+	bool sent;
+	bool done;
+} PipEntry;
+
+//Reads the query list from [in]. Each query gets the first byte timeout in
+//[query] unless it gives its own. [newline] appends "\r\n" to every message.
+//Returns the number of entries read into [*entries], or -1 on error with
+//[*line_num] set to the offending line (0 for an I/O or memory error)
+long Pip_ReadList(FILE *in, const QuerySettings *, const bool newline,
+                  PipEntry **entries, unsigned long *line_num);
+
+//Sends every query on [dev], with at most [depth] awaiting a reply at once,
+//and matches replies to them with [tag_re]. The terminator in [query] splits
+//the replies, each of which may be up to [resp_len] bytes long.
+//Records are written to [out] in order, as soon as each one is known.
+//Returns the number of queries that failed, or -1 if an I/O error occured on
+//[dev] or [out] (see errno). A hangup of [dev] is an I/O error (EIO)
+long Pip_Run(PipEntry *, const size_t count, SerialDevice *,
+             const QuerySettings *, const size_t depth, const regex_t *tag_re,
+             const size_t resp_len, FILE *out);
+
+//Frees the entries and their buffers
+void Pip_FreeList(PipEntry *, const size_t count);
+
+#endif
@@ -0,0 +1,110 @@
+/*******************************************************************************
+* Query handler - Configures a SerialDevice and performs a single transmit then
+* receive transaction on it. Shared by the sqirt command line and the daemon
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "serial.h"
+#include "marker.h"
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#define QRY_MAX_TERM_LEN 64          //Maximum terminator length
+
+//Serial line settings, applied when a port is opened
+typedef struct
+{
+	unsigned int baud;           //Baudrate, e.g. 115200 (see Ser_SetBaudRate)
+	unsigned int bitlength;      //Bit Length, as a CSx constant
+} PortSettings;
+
+//Settings for a single query transaction. All times are in microseconds
+typedef struct
+{
+	uint64_t txdelay;            //Delay before transmitting
+	uint64_t rxdelay;            //Delay before receiving
+	uint64_t first_byte;         //Time allowed for the first byte to arrive
+	uint64_t inter_char;         //Longest gap allowed between bytes
+	                             //For both, 0 only reads bytes already waiting
+	uint64_t deadline;           //Overall receive deadline. 0 for none
+	const char *term;            //Terminator sequence, NULL for none
+	size_t term_len;             //Length of the terminator sequence
+	MrkMatch *markers;           //End markers (see marker.h), NULL for none.
+	                             //Reset by each query, so it must not be
+	                             //shared by queries running at once
+	uint64_t cache_ttl;          //Time the response may be reused by a cache
+	                             //(see cache.h), 0 to always query the port
+} QuerySettings;
+
+//Receive progress of a single query. Lets a caller that waits on many ports at
+//once (see fanout.h) drive the same receive rules as Qry_Transact.
+//The terminator is matched as bytes arrive, only the last few bytes are kept
+//so the response itself never has to be held in one buffer
+typedef struct
+{
+	uint64_t end;                //Overall deadline (timing.h deadline)
+	uint64_t wait_end;           //First byte / inter character deadline
+	size_t total;                //Bytes received so far
+	size_t limit;                //Maximum bytes to receive, 0 for no limit
+	char tail[QRY_MAX_TERM_LEN]; //Last bytes received, for split terminators
+	size_t tail_len;
+	bool term_found;             //The terminator has been received
+	bool done;                   //Receiving is complete
+} QueryRx;
+
+//Receives each chunk of a streamed response as it arrives.
+//Returns 0 to continue, or an errno value to abort the query
+typedef int (*QuerySink)(const char *data, const size_t len, void *ctx);
+
+//Fill the settings structs with the sqirt default values
+void Qry_DefaultPortSettings(PortSettings *);
+void Qry_DefaultQuerySettings(QuerySettings *);
+
+//Opens the port [filename] and configures it as a raw terminal using the
+//given settings. VMIN and VTIME are both 0, all timing is done by the query.
+//Returns errno (=0 if ok)
+int Qry_OpenPort(const char *filename, const PortSettings *, SerialDevice *);
+
+//Applies the user configurable settings to an already open port.
+//Returns errno (=0 if ok)
+int Qry_ApplyPortSettings(const PortSettings *, SerialDevice *);
+
+//Waits txdelay, transmits [mesg] of length [mesg_len], waits rxdelay then
+//reads the response into [resp] of size [resp_len].
+//Reading stops when the first byte or inter character timeout expires, the
+//deadline passes, the terminator or a marker (if any) is received or [resp]
+//is full.
+//Returns bytes read, if this is -1 an error occured. See errno
+ssize_t Qry_Transact(SerialDevice *, const QuerySettings *, const char *mesg,
+                     const size_t mesg_len, char *resp, const size_t resp_len);
+
+//As Qry_Transact, but the response is read through the reusable buffer [buf]
+//of size [buf_len] and passed to [sink] as it arrives, so its size is only
+//limited by the timeouts and terminator.
+//Returns total bytes read, if this is -1 an error occured. See errno
+ssize_t Qry_TransactStream(SerialDevice *, const QuerySettings *,
+                           const char *mesg, const size_t mesg_len,
+                           char *buf, const size_t buf_len,
+                           QuerySink sink, void *ctx);
+
+//Starts receiving a response of at most [limit] bytes (0 for no limit), the
+//timeouts start from now
+void Qry_RxBegin(QueryRx *, const QuerySettings *, const size_t limit);
+
+//Returns the deadline the next read must wait until
+uint64_t Qry_RxDeadline(const QueryRx *);
+
+//Adds [len] newly received bytes [data] to the response. A [len] of 0 means
+//the deadline passed.
+//Returns true when receiving is complete
+bool Qry_RxAdd(QueryRx *, const QuerySettings *, const char *data,
+               const size_t len);
+
+#endif
@@ -0,0 +1,101 @@
+/*******************************************************************************
+* Request scheduler - Orders queued requests for a shared bus by priority
+* class, so urgent queries are not stuck behind bulk transfers.
+*
+* Each class has a queue deadline, a request that waits longer than it is
+* expired instead of being run late. Starvation is prevented by ageing, a
+* request that has waited the age of its class is treated as the class above.
+* Time spent waiting in the queue and time spent on the bus are counted
+* separately for each class.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define SCH_MAX_QUEUED 64            //Maximum requests waiting at once
+
+//Priority classes, most urgent first
+typedef enum
+{
+	SCH_HIGH = 0,                //e.g. alarm polling
+	SCH_NORMAL,
+	SCH_BULK,                    //e.g. configuration dumps
+	SCH_CLASS_COUNT
+} SchClass;
+
+//Settings of a class. All times are in microseconds, 0 for none
+typedef struct
+{
+	uint64_t deadline;           //Longest a request may wait in the queue
+	uint64_t age;                //Wait after which it moves up one class
+} SchClassConf;
+
+//Counters of a class
+typedef struct
+{
+	unsigned long run;           //Requests taken from the queue to be run
+	unsigned long expired;       //Requests that passed their queue deadline
+	uint64_t wait_total;         //Time run requests spent in the queue
+	uint64_t wait_max;
+	uint64_t bus_total;          //Time run requests spent on the bus
+	uint64_t bus_max;
+} SchStats;
+
+typedef struct
+{
+	void *item;                  //The caller's request
+	SchClass class;
+	uint64_t queued;             //Tim_NowUs() when it was queued
+	uint64_t seq;                //Queue order, for FIFO within a class
+} SchEntry;
+
+typedef struct
+{
+	SchClassConf conf[SCH_CLASS_COUNT];
+	SchStats stats[SCH_CLASS_COUNT];
+	SchEntry entries[SCH_MAX_QUEUED];
+	size_t count;
+	uint64_t seq;
+} Scheduler;
+
+//Starts an empty scheduler with the default class settings:
+//  high    deadline 1s,  never ages (already the highest)
+//  normal  deadline 10s, moves up after 1s
+//  bulk    no deadline,  moves up after 2s
+void Sch_Init(Scheduler *);
+
+//Parses a class name: high, normal or bulk.
+//Returns 0 if ok, -1 if the name is not valid
+int Sch_ParseClass(const char *str, SchClass *);
+
+//Returns the name of [class]
+const char *Sch_ClassName(const SchClass class);
+
+//Queues [item] in [class], its queue time counts from [queued] (a Tim_NowUs()
+//time, 0 for now). Returns errno (=0 if ok, ENOSPC if full)
+int Sch_Push(Scheduler *, void *item, const SchClass class,
+             const uint64_t queued);
+
+//Removes a request that has waited past the deadline of its class, counting
+//it as expired. [*class] and [*wait] are set to its class and queue time.
+//Returns the item, or NULL if no request has expired
+void *Sch_PopExpired(Scheduler *, SchClass *class, uint64_t *wait);
+
+//Removes the request to run next: the most urgent class after ageing, then
+//the one queued first. [*class] and [*wait] are set to its class and queue
+//time. Returns the item, or NULL if the queue is empty
+void *Sch_Pop(Scheduler *, SchClass *class, uint64_t *wait);
+
+//Counts a request of [class] that waited [wait] then took [bus] on the bus
+void Sch_Record(Scheduler *, const SchClass class, const uint64_t wait,
+                const uint64_t bus);
+
+//Writes one line of counters per class to [out], prefixed by [prefix]
+void Sch_PrintStats(const Scheduler *, const char *prefix, FILE *out);
+
+#endif
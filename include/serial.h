@@ -9,14 +9,43 @@
 #include <termios.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+
+#ifndef SERIAL_H
+#define SERIAL_H
 
 typedef struct
 {
 	const char *filename;        //Filename string
 	struct termios terminal;     //Serial Terminal data
 	int filedesc;                //File Descriptor
+	bool defer_attr;             //Inside a Ser_BeginConfig transaction
+	unsigned int custom_baud;    //Non-standard baudrate set with termios2,
+	                             //0 if a standard Bxxx baudrate is used
 } SerialDevice;
 
+//Driver line counters, counting from when the driver was loaded
+typedef struct
+{
+	unsigned long rx, tx;        //Bytes received and transmitted
+	unsigned long frame;         //Framing errors
+	unsigned long parity;        //Parity errors
+	unsigned long brk;           //BREAK conditions received
+	unsigned long overrun;       //Bytes lost by the UART hardware
+	unsigned long buf_overrun;   //Bytes lost because the tty buffer was full
+} SerCounters;
+
+//RS-485 settings. The driver drives RTS to switch the transceiver to transmit
+//while sending, and back to receive afterwards
+typedef struct
+{
+	bool enable;
+	bool rts_on_send;            //RTS level while sending, true for high
+	bool rx_during_tx;           //Also receive the bytes being sent
+	unsigned int delay_before;   //Milliseconds from RTS to the first bit
+	unsigned int delay_after;    //Milliseconds from the last bit to RTS
+} SerRS485;
+
 /*** High Level Serial Management *********************************************/
 //Opens the termios serial bus. NOTE THIS MUST BE DONE BEFORE MODIFYING VALUES
 int Ser_OpenDevice(const char *filename, SerialDevice *);
@@ -27,18 +56,91 @@ int Ser_CloseDevice(SerialDevice *dev);
 //Returns errno (=0 if ok)
 int Ser_WriteBuffer(const char *buf, const size_t len, SerialDevice *);
 
+//Write as much of a buffer [buf] of length [len] as the Serial Device will
+//take without waiting.
+//Returns bytes written (0 if its buffer is full), if -1 an error occured.
+ssize_t Ser_WriteSome(const char *buf, const size_t len, SerialDevice *);
+
 //Read a buffer [buf] from a Serial Device of length [len]
 //Returns bytes read, is this is -1, an error occured. See errno
 ssize_t Ser_ReadBuffer(char *buf, const size_t len, SerialDevice *);
 
+//Waits until data is available or [deadline] (see timing.h) passes, then reads
+//a buffer [buf] of length [len] from a Serial Device.
+//Empty reads are retried until the deadline, so 0 is only returned once it
+//has passed. Returns bytes read, 0 on timeout. If -1, an error occured (EIO
+//if the port hung up)
+ssize_t Ser_ReadTimed(char *buf, const size_t len, const uint64_t deadline,
+                      SerialDevice *);
+
+//Waits until all written data has been transmitted. Returns errno
+int Ser_Drain(SerialDevice *);
+
+//Discards any received data that has not been read yet. Returns errno
+int Ser_FlushInput(SerialDevice *);
+
+/*** Latency Settings *******************************************************/
+//These change the driver, not the termios data, and stay in effect after the
+//port is closed. Each returns errno, ENOTSUP or ENOTTY if the driver does not
+//support it
+
+//Sets the ASYNC_LOW_LATENCY flag with TIOCSSERIAL, so received bytes are
+//passed to the reader as soon as they arrive
+int Ser_SetLowLatency(const bool en, SerialDevice *);
+
+//Gets or sets the latency timer of a USB serial adapter (e.g. FTDI) in
+//milliseconds, through sysfs. ENOENT if the port does not have one
+int Ser_GetLatencyTimer(unsigned int *ms, SerialDevice *);
+int Ser_SetLatencyTimer(const unsigned int ms, SerialDevice *);
+
+//Reads the driver line counters with TIOCGICOUNT. Returns errno, ENOTTY or
+//EINVAL if the driver does not keep them
+int Ser_GetCounters(SerCounters *, SerialDevice *);
+
+/*** RS-485 *******************************************************************/
+//Parses a comma separated RS-485 setting list into [conf]. Any of:
+//  rts=high|low   RTS level while sending (Default: high)
+//  before=MS      Delay from RTS to the first bit (Default: 0)
+//  after=MS       Delay from the last bit to RTS (Default: 0)
+//  echo           Also receive the bytes being sent
+//  off            Disable RS-485 mode
+//An empty string enables RS-485 with the defaults.
+//Returns 0 if ok, -1 if the list is not valid
+int Ser_ParseRS485(const char *str, SerRS485 *conf);
+
+//Sets RS-485 mode with TIOCSRS485. Like the latency settings, this changes the
+//driver and stays in effect after the port is closed.
+//Returns errno, ENOTTY or ENOTSUP if the driver does not support RS-485
+int Ser_SetRS485(const SerRS485 *conf, SerialDevice *);
+
 /*** Serial Setings & variable handling ***************************************/
 //Manually set or get the termios variables
+//NOTE: Inside a configuration transaction, Ser_SetAttr does nothing
 int Ser_GetAttr(SerialDevice *);
 int Ser_SetAttr(SerialDevice *);
 
-//Sets the baudrate to use on the serial bus
+//Starts a configuration transaction. Until Ser_CommitConfig is called, the
+//setters below only change the stored termios data, not the port
+int Ser_BeginConfig(SerialDevice *);
+
+//Ends a configuration transaction, applying every change with one tcsetattr.
+//If the port is already configured this way, tcsetattr is skipped entirely
+int Ser_CommitConfig(SerialDevice *);
+
+//Sets the baudrate to use on the serial bus, as a Bxxx constant
 int Ser_SetBaud(const unsigned int baud, SerialDevice *);
 
+//Sets the baudrate from its integer value, e.g. 115200 or 1000000. Rates
+//without a Bxxx constant are set with the Linux termios2/BOTHER interface
+int Ser_SetBaudRate(const unsigned int rate, SerialDevice *);
+
+//Gets the baudrate the port is actually running at, which the driver may have
+//rounded from the rate requested. Returns errno
+int Ser_GetBaudRate(unsigned int *rate, SerialDevice *);
+
+//Returns the Bxxx constant for an integer baudrate, or 0 (B0) if there is none
+speed_t Ser_BaudToSpeed(const unsigned int rate);
+
 //Sets the bit depth/length of the serial bus
 //Options: CS5    CS6    CS7    CS8
 int Ser_SetBits(const unsigned int bits, SerialDevice *);
@@ -49,6 +151,8 @@ int Ser_SetVmin(const uint8_t bytes, SerialDevice *);
 
 //Set timeout length on the serial bus
 //Values 0 - 255    0.1 second incriments    0s - 25.5s
+//NOTE: Ports are opened non-blocking, so this has no effect unless the
+//O_NONBLOCK flag is cleared. Use Ser_ReadTimed instead
 int Ser_SetVtime(const uint8_t time, SerialDevice *);
 
 //Sets if software control is enabled.
@@ -71,3 +175,5 @@ int Ser_IgnoreBreak(const bool en, SerialDevice *);
 
 //Sets what parity to use on the serial bus.
 int Ser_SetParity(const bool odd, const bool even, SerialDevice *);
+
+#endif
@@ -0,0 +1,22 @@
+/*******************************************************************************
+* libsqirt - The serial port and query handlers of sqirt, as a library for
+* programs that want to run queries without starting sqirt for each one.
+* Build with "make lib", then link with bin/libsqirt.a or -Lbin -lsqirt.
+*
+*   serial.h       Opening and configuring ports, raw reads and writes
+*   query.h        Port and query settings, blocking transactions
+*   transaction.h  Non-blocking transactions for an event loop
+*   timing.h       Monotonic time and deadlines, as used by the above
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include "serial.h"
+#include "query.h"
+#include "transaction.h"
+#include "timing.h"
+
+#ifndef SQIRT_H
+#define SQIRT_H
+
+#endif
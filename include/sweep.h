@@ -0,0 +1,52 @@
+/*******************************************************************************
+* Address sweep - Polls every slave on a multi-drop (e.g. RS-485) bus in one
+* run. The same message is sent to each address in turn on one open
+* SerialDevice, with the address substituted into it, so a sweep takes the sum
+* of the frame times rather than the sum of process startups.
+*
+* Message: The address is substituted for each of these in the message:
+*          %a  decimal, e.g. 7     %x  two hex digits, e.g. 07
+*          %b  one raw byte        %%  a single %
+* Output:  One record per address, in the order given:
+*          <address>\tOK\t<escaped response>\n
+*          <address>\tERR\t<error string>\n
+*          No response, or no terminator when one is set, is a timeout.
+*          With a checksum, a response that does not end with it (before any
+*          terminator) is an error too.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "serial.h"
+#include "query.h"
+#include "checksum.h"
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#define SWP_MAX_ADDRESS 255          //Highest address, so %b fits in a byte
+
+typedef struct
+{
+	unsigned char addrs[SWP_MAX_ADDRESS + 1];
+	size_t count;
+} SwpList;
+
+//Parses an address list of numbers and ranges, e.g. "1-16,20,32".
+//Returns 0 if ok, -1 if the list is not valid
+int Swp_ParseList(const char *str, SwpList *);
+
+//Polls every address in [list] on [dev] with the message template [mesg] of
+//length [mesg_len]. [chk], if not NULL, is the checksum each response is
+//checked with, [chk_append] also appends it to each message. [newline] then
+//appends "\r\n". [resp_len] is the maximum response size.
+//Returns the number of addresses that failed, or -1 if [out] failed
+long Swp_Run(SerialDevice *, const QuerySettings *, const char *mesg,
+             const size_t mesg_len, const ChkState *chk, const bool chk_append,
+             const bool newline, const SwpList *list, const size_t resp_len,
+             FILE *out);
+
+#endif
@@ -0,0 +1,31 @@
+/*******************************************************************************
+* termios2 helpers - Sets and reads arbitrary baudrates with the Linux
+* termios2/BOTHER interface. Kept apart from serial.c because <asm/termbits.h>
+* conflicts with <termios.h>. Only used by serial.c
+*
+* PLEASE NOTE: All functions return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#ifndef TERMIOS2_H
+#define TERMIOS2_H
+
+#include <stddef.h>
+
+//Line settings of a <termios.h> struct termios, copied field by field as the
+//two layouts differ. The baudrate bits of [cflag] are ignored
+typedef struct
+{
+	unsigned int iflag, oflag, cflag, lflag;
+	unsigned char line;
+	const unsigned char *cc;     //Control characters, [cc_len] of them
+	size_t cc_len;
+} T2Attr;
+
+//Applies [attr] with the input and output baudrate set to [rate] using
+//BOTHER, all in one TCSETS2 call
+int T2_SetAttr(const int fd, const T2Attr *attr, const unsigned int rate);
+
+//Gets the output baudrate [fd] is running at, as reported by the driver
+int T2_GetBaudRate(const int fd, unsigned int *rate);
+
+#endif
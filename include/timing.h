@@ -0,0 +1,50 @@
+/*******************************************************************************
+* Timing handler - Microsecond resolution delays, deadlines and file descriptor
+* waits, based on CLOCK_MONOTONIC and ppoll().
+* All times are in microseconds. Deadlines are absolute Tim_NowUs() values.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdint.h>
+
+#ifndef TIMING_H
+#define TIMING_H
+
+//A deadline that never expires
+#define TIM_NEVER UINT64_MAX
+
+//Conversion helpers
+#define TIM_MS(ms)  ((uint64_t)(ms) * 1000)
+#define TIM_INC(inc) ((uint64_t)(inc) * 100000)     //0.1 second increments
+
+//Returns the current CLOCK_MONOTONIC time in microseconds
+uint64_t Tim_NowUs(void);
+
+//Returns the deadline [us] microseconds from now, or TIM_NEVER if [us] is 0
+uint64_t Tim_DeadlineIn(const uint64_t us);
+
+//Returns the microseconds left until [deadline], 0 if it has passed
+uint64_t Tim_Remaining(const uint64_t deadline);
+
+//Sleeps for [us] microseconds, resuming the sleep if a signal interrupts it
+void Tim_SleepUs(const uint64_t us);
+
+//Waits until [fd] has data to read, or [deadline] passes.
+//Returns the poll() revents (>0) if readable or hung up, 0 if the deadline
+//passed, -1 on error (see errno)
+int Tim_WaitReadable(const int fd, const uint64_t deadline);
+
+//Locks all current and future memory of the process into RAM, so a page fault
+//cannot delay a response. Returns errno (=0 if ok)
+int Tim_LockMemory(void);
+
+//Runs the process with the SCHED_FIFO real time policy at [priority] (1-99),
+//so it is woken as soon as its data arrives. Returns errno (=0 if ok)
+int Tim_SetRealtime(const int priority);
+
+//Parses a time string into [us] microseconds. Plain numbers are in 0.1 second
+//increments, a "ms" or "us" suffix selects milliseconds or microseconds.
+//Returns 0 if ok, -1 if [str] is not a valid time, -2 if it exceeds [limit]
+int Tim_ParseUs(const char *str, uint64_t *us, const uint64_t limit);
+
+#endif
@@ -0,0 +1,67 @@
+/*******************************************************************************
+* Trace handler - Optional per-phase timing of a query. Each phase is stamped
+* with CLOCK_MONOTONIC as it completes, then printed as a single JSON or
+* key=value line, so where the time of a query goes can be compared across
+* adapters, kernels and firmware versions.
+* Stamps are only taken once tracing is enabled, so it costs nothing otherwise
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+//Query phases, in the order they complete
+typedef enum
+{
+	TRC_PARSED = 0,              //Arguments parsed
+	TRC_OPENED,                  //Port opened
+	TRC_CONFIGURED,              //termios settings applied
+	TRC_TX_DELAY,                //Transmit delay finished
+	TRC_WRITTEN,                 //Message written and drained (tcdrain)
+	TRC_FIRST_BYTE,              //First response byte received
+	TRC_LAST_BYTE,               //Last response byte received
+	TRC_CLOSED,                  //Port closed
+	TRC_PHASE_COUNT
+} TrcPhase;
+
+//Durations measured elsewhere, e.g. reported back by the daemon
+typedef enum
+{
+	TRC_QUEUE_TIME = 0,          //Time spent queued for the bus
+	TRC_BUS_TIME,                //Time spent on the bus
+	TRC_TIME_COUNT
+} TrcTime;
+
+//Output formats
+typedef enum
+{
+	TRC_FMT_JSON,                //{"parsed_us":12,"opened_us":80,...}
+	TRC_FMT_KV                   //parsed_us=12 opened_us=80 ...
+} TrcFormat;
+
+//Sets the time all phases are measured from, and clears every stamp.
+//Call as early as possible, e.g. at the start of main()
+void Trc_Start(void);
+
+//Enables or disables tracing, and returns true if tracing is enabled
+void Trc_Enable(const bool en);
+bool Trc_Enabled(void);
+
+//Stamps [phase] with the current time. Trc_MarkFirst only stamps a phase that
+//has not been stamped yet
+void Trc_Mark(const TrcPhase phase);
+void Trc_MarkFirst(const TrcPhase phase);
+
+//Sets the duration [time] to [us] microseconds
+void Trc_SetTime(const TrcTime time, const uint64_t us);
+
+//Writes one line of every stamped phase to [out], in microseconds since
+//Trc_Start, followed by every duration that was set.
+//Returns 0 if ok, EOF if a write error occured
+int Trc_Print(const TrcFormat format, FILE *out);
+
+#endif
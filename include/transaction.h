@@ -0,0 +1,88 @@
+/*******************************************************************************
+* Transaction handler - A non-blocking form of Qry_Transact, for programs that
+* run many queries from their own event loop. A transaction never sleeps or
+* waits, it is driven by calling Trn_Step whenever its file descriptor is ready
+* or its deadline has passed:
+*
+*   Trn_Begin(&trn, &dev, &query, mesg, mesg_len, resp, resp_len);
+*   while(Trn_Step(&trn) == EINPROGRESS)
+*   {
+*       struct pollfd pfd = {Trn_Fd(&trn), Trn_Events(&trn), 0};
+*       poll(&pfd, 1, Trn_TimeoutMs(&trn));
+*   }
+*
+* The delays and receive rules are the same as Qry_Transact.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+
+#include "serial.h"
+#include "query.h"
+
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+typedef enum
+{
+	TRN_TX_DELAY,                //Waiting for the transmit delay
+	TRN_TRANSMIT,                //Writing the message
+	TRN_RX_DELAY,                //Waiting for the receive delay
+	TRN_RECEIVE,                 //Reading the response
+	TRN_DONE
+} TrnState;
+
+typedef struct
+{
+	SerialDevice *dev;
+	const QuerySettings *query;  //Must stay valid until the transaction ends
+	const char *mesg;
+	size_t mesg_len;
+	size_t sent;                 //Bytes of the message written so far
+
+	char *resp;                  //Response buffer, resp_len bytes long
+	size_t resp_len;
+	QueryRx rx;                  //Receive progress, rx.total bytes received
+	QuerySink sink;              //Streamed responses only (Trn_BeginStream)
+	void *ctx;
+
+	TrnState state;
+	uint64_t wake;               //End of the current delay (timing.h)
+	int status;                  //errno of the transaction once done
+} Transaction;
+
+//Starts a transaction of [mesg] on the open port [dev]. Nothing is done until
+//the first Trn_Step, which should be called straight away.
+void Trn_Begin(Transaction *, SerialDevice *dev, const QuerySettings *,
+               const char *mesg, const size_t mesg_len, char *resp,
+               const size_t resp_len);
+
+//As Trn_Begin, but the response is read through the reusable buffer [buf] of
+//size [buf_len] and passed to [sink] as it arrives (see Qry_TransactStream).
+//A [sink] error ends the transaction with that error
+void Trn_BeginStream(Transaction *, SerialDevice *dev, const QuerySettings *,
+                     const char *mesg, const size_t mesg_len, char *buf,
+                     const size_t buf_len, QuerySink sink, void *ctx);
+
+//Does as much of the transaction as can be done without waiting.
+//Returns EINPROGRESS until it is done, then 0 if ok or its errno. Unless it
+//is streamed, the response is then the first [rx.total] bytes of [resp]
+int Trn_Step(Transaction *);
+
+//Returns the file descriptor to wait on
+int Trn_Fd(const Transaction *);
+
+//Returns the poll() events to wait for, 0 to only wait for the deadline
+short Trn_Events(const Transaction *);
+
+//Returns the deadline Trn_Step must be called by (timing.h), TIM_NEVER for
+//none
+uint64_t Trn_Deadline(const Transaction *);
+
+//Returns the milliseconds until the deadline, rounded up, for poll(). -1 if
+//there is no deadline
+int Trn_TimeoutMs(const Transaction *);
+
+#endif
@@ -0,0 +1,89 @@
+/*******************************************************************************
+* io_uring handler - A minimal io_uring ring, set up with the raw system calls
+* so no liburing is needed. Requests are queued with the Urg_Prep* functions
+* and all of them are submitted, and completions waited for, with a single
+* system call in Urg_Submit.
+*
+* Built without io_uring support if SQIRT_NO_URING is defined (see Makefile),
+* then Urg_Init always fails with ENOSYS so callers can fall back to poll().
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef URING_H
+#define URING_H
+
+//No registered buffer, for Urg_PrepRead and Urg_PrepWrite
+#define URG_NO_BUFFER -1
+
+typedef struct
+{
+	int ring_fd;
+	unsigned int features;       //IORING_FEAT_* flags of the kernel
+
+	//Submission queue
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;  //Tail including requests not yet submitted
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+
+	//Completion queue
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	//Mappings, for Urg_Free
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+} UrgRing;
+
+//Sets up a ring with room for at least [entries] queued requests.
+//Returns errno (=0 if ok), ENOSYS or ENOTSUP if the kernel cannot run it
+int Urg_Init(UrgRing *, const unsigned int entries);
+
+//Registers [len] bytes at [buf] as fixed buffer 0, so reads into it skip
+//mapping the pages on every request. Returns errno (=0 if ok)
+int Urg_RegisterBuffer(UrgRing *, void *buf, const size_t len);
+
+//Queue a request. [buf_index] is a registered buffer that [buf] lies within,
+//or URG_NO_BUFFER. [link] makes the next request wait for this one to
+//succeed, and fail if it does not. [user_data] is returned with the result.
+//Return errno (=0 if ok), ENOSPC if the submission queue is full
+int Urg_PrepRead(UrgRing *, const int fd, void *buf, const size_t len,
+                 const int buf_index, const bool link,
+                 const uint64_t user_data);
+int Urg_PrepWrite(UrgRing *, const int fd, const void *buf, const size_t len,
+                  const int buf_index, const bool link,
+                  const uint64_t user_data);
+int Urg_PrepPoll(UrgRing *, const int fd, const short events, const bool link,
+                 const uint64_t user_data);
+
+//Queue a request that cancels the request queued with [target]
+int Urg_PrepCancel(UrgRing *, const uint64_t target, const uint64_t user_data);
+
+//Returns how many more requests can be queued before Urg_Flush or
+//Urg_Submit is needed
+unsigned int Urg_Space(const UrgRing *);
+
+//Submits every queued request without waiting for any result. [*calls] is
+//incremented for each system call made. Returns errno (=0 if ok)
+int Urg_Flush(UrgRing *, unsigned long *calls);
+
+//Submits every queued request, then waits until a result is ready or
+//[deadline] (see timing.h) passes. Makes no system call if there is nothing
+//to submit and a result is already waiting. [*calls] is incremented for each
+//system call made. Returns errno (=0 if ok, also when the deadline passed)
+int Urg_Submit(UrgRing *, const uint64_t deadline, unsigned long *calls);
+
+//Takes the next result. Returns true if there was one, with its [*user_data]
+//and [*res] (bytes, or a negative errno)
+bool Urg_NextResult(UrgRing *, uint64_t *user_data, int32_t *res);
+
+//Tears the ring down
+void Urg_Free(UrgRing *);
+
+#endif
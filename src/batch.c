@@ -0,0 +1,114 @@
+/*******************************************************************************
+* Batch handler - Runs a stream of queries back to back on one open
+* SerialDevice, so the port is only opened and configured once.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "escape.h"
+#include "query.h"
+#include "serial.h"
+
+long Bat_Run(FILE *in, FILE *out, SerialDevice *dev, const PortSettings *port,
+             const QuerySettings *query, const bool newline,
+             const size_t resp_len, ResponseCache *cache)
+{
+	long failed = 0;
+	unsigned long line_num = 0;
+
+	//getline() grows the line buffer as needed, the response buffer is fixed
+	char *line = NULL;
+	size_t line_size = 0;
+	char *resp = malloc(resp_len);
+	if(resp == NULL) return -1;
+
+	CchKey key;
+	Cch_InitKey(&key);
+
+	ssize_t line_len;
+	while((line_len = getline(&line, &line_size, in)) >= 0)
+	{
+		++line_num;
+
+		//Strip the line ending, then skip empty lines and comments
+		while(line_len > 0 && (line[line_len - 1] == '\n' ||
+		                       line[line_len - 1] == '\r'))
+		{
+			line[--line_len] = '\0';
+		}
+		if(line_len == 0 || line[0] == '#') continue;
+
+		//getline() always leaves room for at least one extra char, make sure
+		//there is room for the newline too
+		size_t mesg_len = Esc_Decode(line);
+		if(newline)
+		{
+			if(line_size < mesg_len + 2)
+			{
+				char *grown = realloc(line, mesg_len + 2);
+				if(grown == NULL)
+				{
+					failed = -1;
+					break;
+				}
+				line = grown;
+				line_size = mesg_len + 2;
+			}
+
+			memcpy(line + mesg_len, "\r\n", 2);
+			mesg_len += 2;
+		}
+
+		ssize_t byte_count;
+		const CchEntry *hit = NULL;
+		if(query->cache_ttl != 0)
+		{
+			hit = Cch_Lookup(cache, &key, dev->filename, port, query, line,
+			                 mesg_len);
+		}
+
+		if(hit != NULL)
+		{
+			byte_count = (ssize_t)hit->resp_len;
+			memcpy(resp, hit->resp, hit->resp_len);
+		} else {
+			byte_count = Qry_Transact(dev, query, line, mesg_len, resp, resp_len);
+
+			if(byte_count >= 0 && query->cache_ttl != 0)
+			{
+				Cch_Store(cache, &key, query, resp, (size_t)byte_count,
+				          query->cache_ttl);
+			}
+		}
+
+		if(byte_count < 0)
+		{
+			++failed;
+			fprintf(out, "%lu\tERR\t%s\n", line_num, strerror(errno));
+		} else {
+			fprintf(out, "%lu\tOK\t", line_num);
+			Esc_Encode(resp, (size_t)byte_count, out);
+			fputc('\n', out);
+		}
+
+		//Flush each record so consumers see results as they happen
+		if(fflush(out) != 0)
+		{
+			failed = -1;
+			break;
+		}
+	}
+
+	if(ferror(in)) failed = -1;
+
+	free(line);
+	free(resp);
+	Cch_FreeKey(&key);
+	return failed;
+}
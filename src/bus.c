@@ -0,0 +1,360 @@
+/*******************************************************************************
+* Bus coordination - Lets separate sqirt processes share one port. A shared
+* memory object per port holds the query that is currently on the bus and the
+* response of the last one, identical queries share one transaction.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //pthread_mutexattr_setrobust()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bus.h"
+#include "timing.h"
+
+//Changes with the layout of BusShared
+#define BUS_MAGIC        0x53514201
+
+//How often a waiter checks that the process running its query is still alive
+#define BUS_SLICE_US     TIM_MS(50)
+
+//Longest a waiter waits for a query with no deadline to finish, before
+//running it itself
+#define BUS_WAIT_LIMIT   TIM_INC(100)
+
+/*** Private Variables ********************************************************/
+struct BusShared
+{
+	uint32_t magic;              //BUS_MAGIC once initialised
+	pthread_mutex_t lock;        //Robust, protects everything below
+	pthread_cond_t done;         //Broadcast when a transaction finishes
+	uint64_t gen;                //Generation of the last transaction started
+	uint64_t done_gen;           //Generation of the last transaction finished
+
+	//The query on the bus, only the settings that change what is received
+	bool in_flight;
+	PortSettings port;
+	uint64_t first_byte;
+	uint64_t inter_char;
+	uint64_t deadline;
+	size_t term_len;
+	char term[QRY_MAX_TERM_LEN];
+	size_t mesg_len;
+	char mesg[BUS_MAX_MESG_LEN];
+
+	//Result of the last transaction
+	int status;
+	bool resp_valid;             //The whole response fit in [resp]
+	size_t resp_len;
+	char resp[BUS_MAX_RESP_LEN];
+};
+
+typedef struct BusShared BusShared;
+
+/*** Private Functions ********************************************************/
+//flock() that retries when interrupted. Returns errno (=0 if ok)
+static int Bus_Flock(const int fd, const int operation)
+{
+	while(flock(fd, operation) != 0)
+	{
+		if(errno != EINTR) return errno;
+	}
+
+	return 0;
+}
+
+//Locks the shared state. If a process died holding the lock, the state is
+//still usable: the bus lock shows whether its transaction is still running.
+//Returns errno (=0 if ok)
+static int Bus_Lock(BusShared *shared)
+{
+	int err = pthread_mutex_lock(&shared->lock);
+	if(err == EOWNERDEAD) err = pthread_mutex_consistent(&shared->lock);
+
+	return err;
+}
+
+//Waits up to BUS_SLICE_US for a transaction to finish. The lock must be held
+static void Bus_WaitSlice(BusShared *shared)
+{
+	uint64_t until = Tim_NowUs() + BUS_SLICE_US;
+	struct timespec ts = {
+		.tv_sec = (time_t)(until / 1000000),
+		.tv_nsec = (long)(until % 1000000) * 1000
+	};
+
+	if(pthread_cond_timedwait(&shared->done, &shared->lock, &ts) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&shared->lock);
+	}
+}
+
+//Initialises a new shared state. The bus lock must be held
+static int Bus_InitShared(BusShared *shared)
+{
+	memset(shared, 0, sizeof(*shared));
+
+	pthread_mutexattr_t mutex_attr;
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	int err = pthread_mutex_init(&shared->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(err != 0) return err;
+
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&shared->done, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if(err != 0) return err;
+
+	//Other processes only use the state once the magic is visible
+	__atomic_store_n(&shared->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+//Returns true if the query on the bus is the same as the given one
+static bool Bus_Matches(const BusShared *shared, const PortSettings *port,
+                        const QuerySettings *query, const char *mesg,
+                        const size_t mesg_len)
+{
+	size_t term_len = query->term ? query->term_len : 0;
+
+	return shared->in_flight &&
+	       shared->port.baud == port->baud &&
+	       shared->port.bitlength == port->bitlength &&
+	       shared->first_byte == query->first_byte &&
+	       shared->inter_char == query->inter_char &&
+	       shared->deadline == query->deadline &&
+	       shared->term_len == term_len &&
+	       (term_len == 0 ||
+	        memcmp(shared->term, query->term, term_len) == 0) &&
+	       shared->mesg_len == mesg_len &&
+	       memcmp(shared->mesg, mesg, mesg_len) == 0;
+}
+
+/*** API Functions ************************************************************/
+int Bus_Open(const char *filename, BusLink *link)
+{
+	memset(link, 0, sizeof(*link));
+	link->filedesc = -1;
+
+	//Name the object after the real path, so every name for a port is the same
+	//object. e.g. /dev/ttyUSB0 is /dev/shm/sqirt.dev.ttyUSB0
+	char path[PATH_MAX];
+	if(realpath(filename, path) == NULL) return errno;
+
+	char name[NAME_MAX + 1];
+	if(snprintf(name, sizeof(name), "/sqirt%s", path) >= (int)sizeof(name))
+	{
+		return ENAMETOOLONG;
+	}
+	for(char *chr = name + 1; *chr != '\0'; chr++)
+	{
+		if(*chr == '/') *chr = '.';
+	}
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+	if(fd < 0) return errno;
+
+	//Only one process sizes and initialises a new object, the others wait for
+	//it on the bus lock
+	int err = 0;
+	bool locked = false;
+	BusShared *shared = MAP_FAILED;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0) goto error;
+	if((size_t)st.st_size < sizeof(BusShared))
+	{
+		if((err = Bus_Flock(fd, LOCK_EX)) != 0) goto error;
+		locked = true;
+
+		if(fstat(fd, &st) != 0) goto error;
+		if((size_t)st.st_size < sizeof(BusShared) &&
+		   ftruncate(fd, (off_t)sizeof(BusShared)) != 0) goto error;
+	}
+
+	shared = mmap(NULL, sizeof(BusShared), PROT_READ | PROT_WRITE, MAP_SHARED,
+	              fd, 0);
+	if(shared == MAP_FAILED) goto error;
+
+	if(__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != BUS_MAGIC)
+	{
+		if(locked == false && (err = Bus_Flock(fd, LOCK_EX)) != 0) goto error;
+		locked = true;
+
+		if(__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != BUS_MAGIC &&
+		   (err = Bus_InitShared(shared)) != 0) goto error;
+	}
+
+	if(locked) Bus_Flock(fd, LOCK_UN);
+
+	link->filedesc = fd;
+	link->shared = shared;
+	return 0;
+
+error:
+	if(err == 0) err = errno;
+	if(shared != MAP_FAILED) munmap(shared, sizeof(BusShared));
+	close(fd);
+	return err;
+}
+
+int Bus_Begin(BusLink *link, const PortSettings *port,
+              const QuerySettings *query, const char *mesg,
+              const size_t mesg_len, QuerySink sink, void *ctx,
+              bool *shared_resp, int *status)
+{
+	BusShared *shared = link->shared;
+
+	*shared_resp = false;
+	*status = 0;
+	link->sink = sink;
+	link->sink_ctx = ctx;
+	link->resp_len = 0;
+
+	if(link->resp == NULL && (link->resp = malloc(BUS_MAX_RESP_LEN)) == NULL)
+	{
+		return ENOMEM;
+	}
+
+	int err = Bus_Lock(shared);
+	if(err != 0) return err;
+
+	/*** Wait for the same query if it is already on the bus ******************/
+	bool have_bus = false;
+	if(Bus_Matches(shared, port, query, mesg, mesg_len))
+	{
+		uint64_t gen = shared->gen;
+		uint64_t limit = query->txdelay + query->rxdelay + query->first_byte +
+		                 (query->deadline ? query->deadline : BUS_WAIT_LIMIT);
+		uint64_t end = Tim_DeadlineIn(limit);
+
+		while(shared->done_gen < gen && Tim_NowUs() < end)
+		{
+			//A process that died mid-query leaves it marked as on the bus, but
+			//no longer holds the bus lock. Take over from it
+			if(flock(link->filedesc, LOCK_EX | LOCK_NB) == 0)
+			{
+				have_bus = true;
+				break;
+			}
+
+			Bus_WaitSlice(shared);
+		}
+
+		//Share the response, unless it was too long to keep or was missed
+		if(have_bus == false && shared->done_gen == gen && shared->resp_valid)
+		{
+			*status = shared->status;
+			link->resp_len = shared->resp_len;
+			memcpy(link->resp, shared->resp, shared->resp_len);
+			pthread_mutex_unlock(&shared->lock);
+
+			*shared_resp = true;
+			if(*status != 0 || link->resp_len == 0) return 0;
+			return sink(link->resp, link->resp_len, ctx);
+		}
+	}
+
+	/*** Otherwise take the bus and run this query ****************************/
+	if(have_bus == false)
+	{
+		pthread_mutex_unlock(&shared->lock);
+
+		if((err = Bus_Flock(link->filedesc, LOCK_EX)) != 0) return err;
+		if((err = Bus_Lock(shared)) != 0)
+		{
+			Bus_Flock(link->filedesc, LOCK_UN);
+			return err;
+		}
+	}
+
+	link->gen = ++shared->gen;
+	link->leading = true;
+
+	//Messages or terminators too long to keep are still run, but never shared
+	size_t term_len = query->term ? query->term_len : 0;
+	shared->in_flight = mesg_len <= BUS_MAX_MESG_LEN &&
+	                    term_len <= QRY_MAX_TERM_LEN;
+	if(shared->in_flight)
+	{
+		shared->port = *port;
+		shared->first_byte = query->first_byte;
+		shared->inter_char = query->inter_char;
+		shared->deadline = query->deadline;
+		shared->term_len = term_len;
+		if(term_len != 0) memcpy(shared->term, query->term, term_len);
+		shared->mesg_len = mesg_len;
+		memcpy(shared->mesg, mesg, mesg_len);
+	}
+
+	pthread_mutex_unlock(&shared->lock);
+	return 0;
+}
+
+int Bus_Sink(const char *data, const size_t len, void *ctx)
+{
+	BusLink *link = ctx;
+
+	if(link->resp_len + len <= BUS_MAX_RESP_LEN)
+	{
+		memcpy(link->resp + link->resp_len, data, len);
+	}
+	link->resp_len += len;
+
+	return link->sink(data, len, link->sink_ctx);
+}
+
+void Bus_End(BusLink *link, const int status)
+{
+	if(link->leading == false) return;
+	BusShared *shared = link->shared;
+
+	if(Bus_Lock(shared) == 0)
+	{
+		shared->status = status;
+		shared->resp_valid = shared->in_flight &&
+		                     link->resp_len <= BUS_MAX_RESP_LEN;
+		shared->resp_len = shared->resp_valid ? link->resp_len : 0;
+		memcpy(shared->resp, link->resp, shared->resp_len);
+
+		shared->done_gen = link->gen;
+		shared->in_flight = false;
+
+		pthread_cond_broadcast(&shared->done);
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	Bus_Flock(link->filedesc, LOCK_UN);
+	link->leading = false;
+}
+
+void Bus_Close(BusLink *link)
+{
+	if(link->filedesc < 0) return;
+
+	Bus_End(link, ECANCELED);
+
+	munmap(link->shared, sizeof(BusShared));
+	close(link->filedesc);
+	free(link->resp);
+
+	link->filedesc = -1;
+	link->shared = NULL;
+	link->resp = NULL;
+}
@@ -0,0 +1,219 @@
+/*******************************************************************************
+* Response cache - Keeps the responses of recent queries for a short time, so
+* a repeated identical query can be answered without touching the bus.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //memmem()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cache.h"
+#include "timing.h"
+
+/*** Private Functions ********************************************************/
+//FNV-1a hash of [len] bytes of [data]
+static uint64_t Cch_Hash(const char *data, const size_t len)
+{
+	uint64_t hash = 0xCBF29CE484222325;
+	for(size_t idx = 0; idx < len; idx++)
+	{
+		hash ^= (unsigned char)data[idx];
+		hash *= 0x100000001B3;
+	}
+
+	return hash;
+}
+
+//Appends [len] bytes of [data] to the key being built. The size was already
+//made large enough by Cch_BuildKey
+static void Cch_KeyAppend(CchKey *key, const void *data, const size_t len)
+{
+	memcpy(key->data + key->len, data, len);
+	key->len += len;
+}
+
+//Builds the key of a query into [key]. Lengths are stored before each
+//variable length field, so two different queries can never share a key.
+//Returns errno (=0 if ok)
+static int Cch_BuildKey(CchKey *key, const char *port,
+                        const PortSettings *settings,
+                        const QuerySettings *query,
+                        const char *mesg, const size_t mesg_len)
+{
+	size_t port_len = strlen(port);
+	size_t term_len = query->term ? query->term_len : 0;
+
+	size_t needed = port_len + term_len + mesg_len + 3 * sizeof(size_t) +
+	                2 * sizeof(unsigned int) + 3 * sizeof(uint64_t);
+	if(needed > key->size)
+	{
+		char *grown = realloc(key->data, needed);
+		if(grown == NULL) return ENOMEM;
+
+		key->data = grown;
+		key->size = needed;
+	}
+
+	//Only the settings that change what is received are part of the key
+	key->len = 0;
+	Cch_KeyAppend(key, &port_len, sizeof(port_len));
+	Cch_KeyAppend(key, port, port_len);
+	Cch_KeyAppend(key, &settings->baud, sizeof(settings->baud));
+	Cch_KeyAppend(key, &settings->bitlength, sizeof(settings->bitlength));
+	Cch_KeyAppend(key, &query->first_byte, sizeof(query->first_byte));
+	Cch_KeyAppend(key, &query->inter_char, sizeof(query->inter_char));
+	Cch_KeyAppend(key, &query->deadline, sizeof(query->deadline));
+	Cch_KeyAppend(key, &term_len, sizeof(term_len));
+	Cch_KeyAppend(key, query->term, term_len);
+	Cch_KeyAppend(key, &mesg_len, sizeof(mesg_len));
+	Cch_KeyAppend(key, mesg, mesg_len);
+
+	key->hash = Cch_Hash(key->data, key->len);
+	return 0;
+}
+
+static void Cch_FreeEntry(CchEntry *entry)
+{
+	free(entry->key);
+	free(entry->resp);
+	memset(entry, 0, sizeof(*entry));
+}
+
+/*** API Functions ************************************************************/
+void Cch_Init(ResponseCache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+}
+
+void Cch_InitKey(CchKey *key)
+{
+	memset(key, 0, sizeof(*key));
+}
+
+const CchEntry *Cch_Lookup(ResponseCache *cache, CchKey *key,
+                           const char *port,
+                           const PortSettings *settings,
+                           const QuerySettings *query,
+                           const char *mesg, const size_t mesg_len)
+{
+	++cache->lookups;
+
+	if(Cch_BuildKey(key, port, settings, query, mesg, mesg_len) != 0)
+	{
+		key->len = 0;
+		++cache->misses;
+		return NULL;
+	}
+
+	uint64_t now = Tim_NowUs();
+	for(size_t idx = 0; idx < CCH_MAX_ENTRIES; idx++)
+	{
+		CchEntry *entry = &cache->entries[idx];
+		if(entry->used == false || entry->hash != key->hash ||
+		   entry->key_len != key->len ||
+		   memcmp(entry->key, key->data, key->len) != 0) continue;
+
+		//Expired entries are dropped as they are found
+		if(entry->expires <= now)
+		{
+			Cch_FreeEntry(entry);
+			break;
+		}
+
+		entry->last_used = cache->lookups;
+		++cache->hits;
+		return entry;
+	}
+
+	++cache->misses;
+	return NULL;
+}
+
+int Cch_Store(ResponseCache *cache, const CchKey *key,
+              const QuerySettings *query, const char *resp,
+              const size_t resp_len, const uint64_t ttl)
+{
+	if(key->len == 0) return ENOMEM;
+	if(resp_len > CCH_MAX_RESP_LEN) return ENOSPC;
+
+	//A response that timed out part way through must not be handed out again
+	if(resp_len == 0 || (query->term != NULL && query->term_len != 0 &&
+	   memmem(resp, resp_len, query->term, query->term_len) == NULL))
+	{
+		return ENODATA;
+	}
+
+	//Use the slot of an older response to the same query, then a free or
+	//expired slot, then the least recently used one
+	uint64_t now = Tim_NowUs();
+	CchEntry *slot = NULL;
+	for(size_t idx = 0; idx < CCH_MAX_ENTRIES; idx++)
+	{
+		CchEntry *crnt = &cache->entries[idx];
+
+		if(crnt->used && crnt->hash == key->hash &&
+		   crnt->key_len == key->len &&
+		   memcmp(crnt->key, key->data, key->len) == 0)
+		{
+			slot = crnt;
+			break;
+		}
+
+		bool crnt_free = !crnt->used || crnt->expires <= now;
+		if(slot == NULL || (slot->used && slot->expires > now &&
+		   (crnt_free || crnt->last_used < slot->last_used))) slot = crnt;
+	}
+
+	char *key_copy = malloc(key->len);
+	char *copy = malloc(resp_len);
+	if(key_copy == NULL || copy == NULL)
+	{
+		free(key_copy);
+		free(copy);
+		return ENOMEM;
+	}
+
+	memcpy(key_copy, key->data, key->len);
+	memcpy(copy, resp, resp_len);
+
+	Cch_FreeEntry(slot);
+	slot->hash = key->hash;
+	slot->key = key_copy;
+	slot->key_len = key->len;
+	slot->resp = copy;
+	slot->resp_len = resp_len;
+	slot->expires = Tim_DeadlineIn(ttl);
+	slot->last_used = cache->lookups;
+	slot->used = true;
+
+	return 0;
+}
+
+void Cch_PrintStats(const ResponseCache *cache, FILE *out)
+{
+	size_t entries = 0;
+	for(size_t idx = 0; idx < CCH_MAX_ENTRIES; idx++)
+	{
+		if(cache->entries[idx].used) ++entries;
+	}
+
+	fprintf(out, "Cache: hits=%lu misses=%lu entries=%zu\n",
+	        cache->hits, cache->misses, entries);
+	fflush(out);
+}
+
+void Cch_Free(ResponseCache *cache)
+{
+	for(size_t idx = 0; idx < CCH_MAX_ENTRIES; idx++)
+	{
+		Cch_FreeEntry(&cache->entries[idx]);
+	}
+}
+
+void Cch_FreeKey(CchKey *key)
+{
+	free(key->data);
+	memset(key, 0, sizeof(*key));
+}
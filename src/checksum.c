@@ -0,0 +1,359 @@
+/*******************************************************************************
+* Checksum engine - Computes, appends and verifies the CRCs and checksums
+* devices add to their messages. CRCs use slicing-by-8 tables, built on first
+* use, and CRC-32C uses the SSE4.2 crc32 instruction when the CPU has it.
+* Responses can be verified as they are streamed, without being held in full.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <string.h>
+#include <errno.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CHK_HW_CRC32C
+#endif
+
+/*** Algorithm Table **********************************************************/
+static const ChkAlgorithm _chk_algorithms[] = {
+	{"crc8",         CHK_CRC, 8,  0x07,       0x00,       0x00,       false, true},
+	{"crc16-ccitt",  CHK_CRC, 16, 0x1021,     0xFFFF,     0x0000,     false, true},
+	{"crc16-xmodem", CHK_CRC, 16, 0x1021,     0x0000,     0x0000,     false, true},
+	{"crc16-modbus", CHK_CRC, 16, 0xA001,     0xFFFF,     0x0000,     true, false},
+	{"crc32",        CHK_CRC, 32, 0xEDB88320, 0xFFFFFFFF, 0xFFFFFFFF, true, false},
+	{"crc32c",       CHK_CRC, 32, 0x82F63B78, 0xFFFFFFFF, 0xFFFFFFFF, true, false},
+	{"sum8",         CHK_SUM, 8,  0,          0,          0,          false, true},
+	{"xor8",         CHK_XOR, 8,  0,          0,          0,          false, true},
+};
+
+#define CHK_ALG_COUNT (sizeof(_chk_algorithms) / sizeof(_chk_algorithms[0]))
+
+//Slicing-by-8 tables of each algorithm, built on first use
+static uint32_t _chk_tables[CHK_ALG_COUNT][8][256];
+static bool _chk_table_ready[CHK_ALG_COUNT];
+
+#ifdef CHK_HW_CRC32C
+static int _chk_hw_crc32c = -1;         //-1 until the CPU has been checked
+#endif
+
+/*** Private Functions ********************************************************/
+//Builds the slicing-by-8 tables for [alg]. Reflected CRCs are computed right
+//aligned, others left aligned in 32 bits, so both can share the same loops
+static void Chk_BuildTables(const ChkAlgorithm *alg, uint32_t table[8][256])
+{
+	for(uint32_t byte = 0; byte < 256; byte++)
+	{
+		uint32_t crc;
+		if(alg->reflected)
+		{
+			crc = byte;
+			for(int bit = 0; bit < 8; bit++)
+			{
+				crc = (crc & 1) ? (crc >> 1) ^ alg->poly : crc >> 1;
+			}
+		} else {
+			uint32_t poly = alg->poly << (32 - alg->width);
+			crc = byte << 24;
+			for(int bit = 0; bit < 8; bit++)
+			{
+				crc = (crc & 0x80000000) ? (crc << 1) ^ poly : crc << 1;
+			}
+		}
+		table[0][byte] = crc;
+	}
+
+	//Each table advances the one before it by one more byte
+	for(int slice = 1; slice < 8; slice++)
+	{
+		for(int byte = 0; byte < 256; byte++)
+		{
+			uint32_t prev = table[slice - 1][byte];
+			table[slice][byte] = alg->reflected
+			                   ? (prev >> 8) ^ table[0][prev & 0xFF]
+			                   : (prev << 8) ^ table[0][prev >> 24];
+		}
+	}
+}
+
+static uint32_t Chk_UpdateReflected(uint32_t table[8][256], uint32_t crc,
+                                    const uint8_t *data, size_t len)
+{
+	while(len >= 8)
+	{
+		uint32_t word = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+		                       (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+
+		crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+		      table[5][(word >> 16) & 0xFF] ^ table[4][word >> 24] ^
+		      table[3][data[4]] ^ table[2][data[5]] ^
+		      table[1][data[6]] ^ table[0][data[7]];
+
+		data += 8;
+		len -= 8;
+	}
+
+	while(len--) crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
+
+static uint32_t Chk_UpdateNormal(uint32_t table[8][256], uint32_t crc,
+                                 const uint8_t *data, size_t len)
+{
+	while(len >= 8)
+	{
+		uint32_t word = crc ^ ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+		                       (uint32_t)data[2] << 8 | (uint32_t)data[3]);
+
+		crc = table[7][word >> 24] ^ table[6][(word >> 16) & 0xFF] ^
+		      table[5][(word >> 8) & 0xFF] ^ table[4][word & 0xFF] ^
+		      table[3][data[4]] ^ table[2][data[5]] ^
+		      table[1][data[6]] ^ table[0][data[7]];
+
+		data += 8;
+		len -= 8;
+	}
+
+	while(len--) crc = (crc << 8) ^ table[0][(crc >> 24) ^ *data++];
+	return crc;
+}
+
+#ifdef CHK_HW_CRC32C
+__attribute__((target("sse4.2")))
+static uint32_t Chk_UpdateCrc32cHw(uint32_t crc, const uint8_t *data,
+                                   size_t len)
+{
+	uint64_t crc64 = crc;
+	while(len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+
+		data += 8;
+		len -= 8;
+	}
+
+	crc = (uint32_t)crc64;
+	while(len--) crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+#endif
+
+/*** API Functions ************************************************************/
+int Chk_Begin(const char *name, ChkState *chk)
+{
+	//Split off a wire order suffix
+	size_t name_len = strlen(name);
+	int order = -1;
+	if(name_len > 3 && strcmp(name + name_len - 3, ":be") == 0) order = 1;
+	if(name_len > 3 && strcmp(name + name_len - 3, ":le") == 0) order = 0;
+	if(order >= 0) name_len -= 3;
+
+	for(size_t idx = 0; idx < CHK_ALG_COUNT; idx++)
+	{
+		const ChkAlgorithm *alg = &_chk_algorithms[idx];
+		if(strlen(alg->name) != name_len ||
+		   strncmp(alg->name, name, name_len) != 0)
+		{
+			continue;
+		}
+
+		if(alg->kind == CHK_CRC && _chk_table_ready[idx] == false)
+		{
+			Chk_BuildTables(alg, _chk_tables[idx]);
+			_chk_table_ready[idx] = true;
+		}
+
+		chk->alg = alg;
+		chk->big_endian = order >= 0 ? order == 1 : alg->big_endian;
+		chk->state = alg->kind != CHK_CRC || alg->reflected
+		           ? alg->init : alg->init << (32 - alg->width);
+		return 0;
+	}
+
+	return -1;
+}
+
+void Chk_Update(ChkState *chk, const void *data, size_t len)
+{
+	const ChkAlgorithm *alg = chk->alg;
+	const uint8_t *bytes = data;
+
+	switch(alg->kind)
+	{
+		//Summed 8 bytes at a time. Each 16 bit lane of a 64 bit word gathers
+		//2 bytes of every word, so it cannot overflow within 128 words
+		case CHK_SUM:
+		{
+			uint32_t sum = chk->state;
+			while(len >= 8)
+			{
+				size_t words = len / 8 < 128 ? len / 8 : 128;
+				uint64_t lanes = 0;
+				for(size_t idx = 0; idx < words; idx++, bytes += 8)
+				{
+					uint64_t word;
+					memcpy(&word, bytes, 8);
+					lanes += word & 0x00FF00FF00FF00FFULL;
+					lanes += (word >> 8) & 0x00FF00FF00FF00FFULL;
+				}
+				len -= words * 8;
+
+				//Add the 16 bit lanes together
+				lanes = (lanes & 0x0000FFFF0000FFFFULL) +
+				        ((lanes >> 16) & 0x0000FFFF0000FFFFULL);
+				sum += (uint32_t)(lanes + (lanes >> 32));
+			}
+
+			while(len--) sum += *bytes++;
+			chk->state = sum;
+			break;
+		}
+
+		//XOR is the same in every byte lane, fold the lanes at the end
+		case CHK_XOR:
+		{
+			uint64_t lanes = 0;
+			for( ; len >= 8; len -= 8, bytes += 8)
+			{
+				uint64_t word;
+				memcpy(&word, bytes, 8);
+				lanes ^= word;
+			}
+			lanes ^= lanes >> 32;
+			lanes ^= lanes >> 16;
+			lanes ^= lanes >> 8;
+
+			uint32_t xor = chk->state ^ (uint32_t)(lanes & 0xFF);
+			while(len--) xor ^= *bytes++;
+			chk->state = xor;
+			break;
+		}
+
+		case CHK_CRC:
+		{
+			size_t idx = (size_t)(alg - _chk_algorithms);
+
+			#ifdef CHK_HW_CRC32C
+			if(alg->poly == 0x82F63B78 && alg->width == 32)
+			{
+				if(_chk_hw_crc32c < 0)
+				{
+					_chk_hw_crc32c = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+				}
+				if(_chk_hw_crc32c)
+				{
+					chk->state = Chk_UpdateCrc32cHw(chk->state, bytes, len);
+					break;
+				}
+			}
+			#endif
+
+			chk->state = alg->reflected
+			           ? Chk_UpdateReflected(_chk_tables[idx], chk->state,
+			                                 bytes, len)
+			           : Chk_UpdateNormal(_chk_tables[idx], chk->state,
+			                              bytes, len);
+			break;
+		}
+	}
+}
+
+uint32_t Chk_Final(const ChkState *chk)
+{
+	const ChkAlgorithm *alg = chk->alg;
+	uint32_t mask = alg->width == 32 ? 0xFFFFFFFF : (1u << alg->width) - 1;
+
+	uint32_t value = chk->state;
+	if(alg->kind == CHK_CRC && alg->reflected == false)
+	{
+		value >>= 32 - alg->width;
+	}
+
+	return (value ^ alg->xorout) & mask;
+}
+
+size_t Chk_Length(const ChkState *chk)
+{
+	return chk->alg->width / 8;
+}
+
+size_t Chk_Encode(const ChkState *chk, const uint32_t value, uint8_t *out)
+{
+	size_t len = Chk_Length(chk);
+	for(size_t idx = 0; idx < len; idx++)
+	{
+		size_t shift = chk->big_endian ? (len - 1 - idx) * 8 : idx * 8;
+		out[idx] = (uint8_t)(value >> shift);
+	}
+
+	return len;
+}
+
+int Chk_Compute(const char *name, const void *data, const size_t len,
+                uint32_t *value)
+{
+	ChkState chk;
+	if(Chk_Begin(name, &chk) != 0) return -1;
+
+	Chk_Update(&chk, data, len);
+	*value = Chk_Final(&chk);
+	return 0;
+}
+
+void Chk_StreamBegin(ChkStream *stream, const ChkState *chk,
+                     const size_t term_len, QuerySink next, void *next_ctx)
+{
+	stream->chk = *chk;
+	stream->next = next;
+	stream->next_ctx = next_ctx;
+	stream->hold_len = Chk_Length(chk) + term_len;
+	stream->held_len = 0;
+}
+
+int Chk_StreamSink(const char *data, const size_t len, void *ctx)
+{
+	ChkStream *stream = ctx;
+
+	//The response is passed on unchanged, only the checksum is held back
+	int sink_err = stream->next(data, len, stream->next_ctx);
+	if(sink_err != 0) return sink_err;
+
+	size_t total = stream->held_len + len;
+	if(total <= stream->hold_len)
+	{
+		memcpy(stream->held + stream->held_len, data, len);
+		stream->held_len = total;
+		return 0;
+	}
+
+	//Add the bytes that leave the held window to the checksum, the oldest
+	//held bytes first, then the start of the new data
+	size_t leaving = total - stream->hold_len;
+	size_t from_held = leaving < stream->held_len ? leaving : stream->held_len;
+	size_t from_data = leaving - from_held;
+
+	Chk_Update(&stream->chk, stream->held, from_held);
+	Chk_Update(&stream->chk, data, from_data);
+
+	stream->held_len -= from_held;
+	memmove(stream->held, stream->held + from_held, stream->held_len);
+	memcpy(stream->held + stream->held_len, data + from_data, len - from_data);
+	stream->held_len += len - from_data;
+
+	return 0;
+}
+
+int Chk_StreamResult(const ChkStream *stream)
+{
+	if(stream->held_len < stream->hold_len) return ENODATA;
+
+	uint8_t expected[CHK_MAX_LEN];
+	size_t len = Chk_Encode(&stream->chk, Chk_Final(&stream->chk), expected);
+
+	if(memcmp(stream->held, expected, len) != 0) return EBADMSG;
+	return 0;
+}
@@ -0,0 +1,1052 @@
+/*******************************************************************************
+* sqirtd - Persistent sqirt daemon. Keeps SerialDevices open and configured,
+* and serves query requests from local clients over a Unix Domain Socket.
+* Every port has its own queue and runs its requests one at a time, while all
+* of the ports run at once from one epoll event loop.
+* Also contains the client side, used by sqirt to forward queries to sqirtd
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //accept4()
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "daemon.h"
+#include "cache.h"
+#include "scheduler.h"
+#include "timing.h"
+#include "query.h"
+#include "serial.h"
+#include "transaction.h"
+
+//How long a connected client may stall mid-request, or leave a response
+//unsent, before being dropped
+#define DMN_CLIENT_TIMEOUT     TIM_MS(5000)
+
+//Most response bytes kept for a client that is not reading them
+#define DMN_MAX_OUT_LEN        (1 << 20)
+
+//Times new connections and requests are taken in before an idle port starts
+//its next request. Requests arrive while the port is busy, they must all be
+//seen before choosing, but a constant stream of them must not stop requests
+//being run
+#define DMN_INGEST_ROUNDS      4
+
+//epoll user data of a file descriptor: its table index and what it is
+#define DMN_EV_LISTENER        0
+#define DMN_EV_CLIENT          1
+#define DMN_EV_PORT            2
+#define DMN_EV(idx, kind)      (((uint64_t)(idx) << 2) | (kind))
+
+/*** Private Variables ********************************************************/
+//A connected client, and its last request. Sockets are non-blocking, so a
+//client is read and written as far as it allows, and never stalls the others
+typedef struct
+{
+	int sock;                    //Client socket, -1 if disconnected
+	uint32_t events;             //epoll events it is registered for
+	DmnRequest req;
+	size_t in_len;               //Bytes of the request read so far
+	uint64_t in_start;           //Tim_NowUs() when its first byte arrived
+	char port[DMN_MAX_PORT_LEN + 1];
+	char *mesg;                  //[req.mesg_len] bytes of message
+	size_t mesg_size;
+	char term[QRY_MAX_TERM_LEN];
+	CchKey key;                  //Cache key of the request, if it may be cached
+	bool busy;                   //Its request is queued or running. The slot
+	                             //is only free once it is not
+
+	char *out;                   //Response frames, [out_done] of them sent
+	size_t out_len;
+	size_t out_done;
+	size_t out_size;
+	uint64_t out_since;          //Tim_NowUs() when the output last moved
+} DmnClient;
+
+//Context for Dmn_ClientSink
+typedef struct
+{
+	DmnClient *client;
+	int err;                     //errno of a failed write to the client
+	char *copy;                  //Copy of the response to cache, NULL for none
+	size_t copy_len;             //Response length, may exceed CCH_MAX_RESP_LEN
+} DmnSinkCtx;
+
+//A port kept open by the daemon, its queue and the request it is running
+typedef struct
+{
+	char filename[DMN_MAX_PORT_LEN + 1];   //Empty if the slot is free
+	SerialDevice dev;
+	PortSettings settings;       //Settings last applied
+	unsigned long last_used;     //Request counter value of the last use
+	bool open;                   //[dev] is open, it is reopened if it fails
+	uint32_t events;             //epoll events it is registered for
+
+	Scheduler sched;             //Requests waiting for the port
+	DmnClient *active;           //Request being run, NULL if idle
+	SchClass class;              //Its class and time spent queued
+	uint64_t wait;
+	uint64_t bus_start;          //Tim_NowUs() when it started
+	QuerySettings query;
+	Transaction trn;
+	DmnSinkCtx sink_ctx;
+	char resp_buf[DMN_CHUNK_LEN];
+	char *cache_buf;             //CCH_MAX_RESP_LEN bytes, allocated when used
+} DmnPort;
+
+static DmnPort _ports[DMN_MAX_PORTS];
+static DmnClient _clients[DMN_MAX_CLIENTS];
+static int _epfd = -1;
+static unsigned long _request_count = 0;
+static volatile sig_atomic_t _running = 0;
+static volatile sig_atomic_t _print_stats = 0;
+
+//Responses of requests that allow caching
+static ResponseCache _cache;
+
+/*** Private Functions ********************************************************/
+static void Dmn_SignalHandler(int sig)
+{
+	(void)sig;
+	_running = 0;
+}
+
+static void Dmn_StatsHandler(int sig)
+{
+	(void)sig;
+	_print_stats = 1;
+}
+
+//Writes the cache counters to stderr if SIGUSR1 asked for them
+static void Dmn_CheckStats(void)
+{
+	if(_print_stats == 0) return;
+
+	_print_stats = 0;
+	fprintf(stderr, "sqirtd: ");
+	Cch_PrintStats(&_cache, stderr);
+
+	//Each port has its own queue counters
+	for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+	{
+		const DmnPort *port = &_ports[idx];
+		if(port->filename[0] == '\0') continue;
+
+		char prefix[DMN_MAX_PORT_LEN + 16];
+		snprintf(prefix, sizeof(prefix), "sqirtd: %.*s: ", DMN_MAX_PORT_LEN,
+		         port->filename);
+		Sch_PrintStats(&port->sched, prefix, stderr);
+	}
+}
+
+//Reads exactly [len] bytes from [fd]. Returns errno (=0 if ok).
+//A closed connection before any bytes are read returns ECONNRESET
+static int Dmn_ReadFull(int fd, void *buf, const size_t len)
+{
+	size_t done = 0;
+	while(done < len)
+	{
+		ssize_t ret = read(fd, (char *)buf + done, len - done);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+		if(ret == 0) return ECONNRESET;
+
+		done += (size_t)ret;
+	}
+
+	return 0;
+}
+
+//Writes exactly [len] bytes to [fd]. Returns errno (=0 if ok)
+static int Dmn_WriteFull(int fd, const void *buf, const size_t len)
+{
+	size_t done = 0;
+	while(done < len)
+	{
+		ssize_t ret = write(fd, (const char *)buf + done, len - done);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+
+		done += (size_t)ret;
+	}
+
+	return 0;
+}
+
+//Fills a sockaddr_un with [sock_path]. Returns errno (=0 if ok)
+static int Dmn_MakeAddress(const char *sock_path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if(strlen(sock_path) >= sizeof(addr->sun_path)) return ENAMETOOLONG;
+	strcpy(addr->sun_path, sock_path);
+
+	return 0;
+}
+
+//Clamps a QuerySettings time to fit in a wire protocol field (~71 minutes)
+static uint32_t Dmn_ClampTime(const uint64_t us)
+{
+	return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static bool Dmn_SettingsMatch(const PortSettings *a, const PortSettings *b)
+{
+	return a->baud == b->baud && a->bitlength == b->bitlength;
+}
+
+//Registers [fd] with the event loop for [events] if they differ from what
+//[*registered] holds. Returns errno (=0 if ok)
+static int Dmn_Watch(const int fd, const uint64_t data, const uint32_t events,
+                     uint32_t *registered)
+{
+	if(events == *registered) return 0;
+
+	struct epoll_event ev = {.events = events, .data.u64 = data};
+	if(epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) != 0) return errno;
+
+	*registered = events;
+	return 0;
+}
+
+//Closes the device of [port], it is reopened by its next request
+static void Dmn_ClosePort(DmnPort *port)
+{
+	if(port->open == false) return;
+
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, port->dev.filedesc, NULL);
+	Ser_CloseDevice(&port->dev);
+	port->open = false;
+}
+
+//Returns the port slot of [filename], taking a free slot (or the least
+//recently used one with nothing queued or running) if it has none yet. The
+//port itself is only opened once a request runs on it.
+//Returns NULL if every slot is busy
+static DmnPort *Dmn_FindPort(const char *filename)
+{
+	DmnPort *slot = NULL;
+	for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+	{
+		DmnPort *crnt = &_ports[idx];
+		if(strcmp(crnt->filename, filename) == 0) return crnt;
+
+		//Slots in use by a queued or running request cannot be taken
+		if(crnt->active != NULL || crnt->sched.count != 0) continue;
+
+		if(slot == NULL || (slot->filename[0] != '\0' &&
+		   (crnt->filename[0] == '\0' || crnt->last_used < slot->last_used)))
+		{
+			slot = crnt;
+		}
+	}
+
+	if(slot == NULL) return NULL;
+
+	Dmn_ClosePort(slot);
+	strcpy(slot->filename, filename);
+	Sch_Init(&slot->sched);
+	return slot;
+}
+
+//Opens [port] if it is not open yet, and applies [settings] if they differ
+//from the last request. Returns errno (=0 if ok)
+static int Dmn_OpenPort(DmnPort *port, const PortSettings *settings)
+{
+	port->last_used = _request_count;
+
+	if(port->open)
+	{
+		if(Dmn_SettingsMatch(&port->settings, settings)) return 0;
+
+		int ser_err = Qry_ApplyPortSettings(settings, &port->dev);
+		if(ser_err != 0) return ser_err;
+
+		port->settings = *settings;
+		return 0;
+	}
+
+	int ser_err = Qry_OpenPort(port->filename, settings, &port->dev);
+	if(ser_err != 0) return ser_err;
+
+	//Only watched while a request is running on it
+	struct epoll_event ev = {.events = 0,
+	                         .data.u64 = DMN_EV(port - _ports, DMN_EV_PORT)};
+	if(epoll_ctl(_epfd, EPOLL_CTL_ADD, port->dev.filedesc, &ev) != 0)
+	{
+		ser_err = errno;
+		Ser_CloseDevice(&port->dev);
+		return ser_err;
+	}
+
+	port->events = 0;
+	port->settings = *settings;
+	port->open = true;
+	return 0;
+}
+
+//Adds [len] bytes of [data] to the output of [client], without sending it.
+//Returns errno (=0 if ok, ENOBUFS if the client has left too much unread)
+static int Dmn_Queue(DmnClient *client, const void *data, const size_t len)
+{
+	//Output is pending from now, unless some already was
+	if(client->out_done == client->out_len)
+	{
+		client->out_len = 0;
+		client->out_done = 0;
+		client->out_since = Tim_NowUs();
+	}
+
+	//Move what is still unsent to the front before growing the buffer
+	if(client->out_len + len > client->out_size && client->out_done != 0)
+	{
+		memmove(client->out, client->out + client->out_done,
+		        client->out_len - client->out_done);
+		client->out_len -= client->out_done;
+		client->out_done = 0;
+	}
+
+	if(client->out_len + len > client->out_size)
+	{
+		size_t needed = client->out_len + len;
+		if(needed > DMN_MAX_OUT_LEN) return ENOBUFS;
+
+		size_t size = client->out_size ? client->out_size : DMN_CHUNK_LEN;
+		while(size < needed) size *= 2;
+
+		char *grown = realloc(client->out, size);
+		if(grown == NULL) return ENOMEM;
+
+		client->out = grown;
+		client->out_size = size;
+	}
+
+	memcpy(client->out + client->out_len, data, len);
+	client->out_len += len;
+	return 0;
+}
+
+//Sends as much of the output of [client] as its socket takes without waiting.
+//Returns errno (=0 if ok)
+static int Dmn_Flush(DmnClient *client)
+{
+	while(client->out_done < client->out_len)
+	{
+		ssize_t ret = write(client->sock, client->out + client->out_done,
+		                    client->out_len - client->out_done);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) return 0;
+			return errno;
+		}
+
+		client->out_done += (size_t)ret;
+		client->out_since = Tim_NowUs();
+	}
+
+	return 0;
+}
+
+//QuerySink that sends each chunk of the response to the client as a frame
+static int Dmn_ClientSink(const char *data, const size_t len, void *ctx)
+{
+	DmnSinkCtx *sink_ctx = ctx;
+	DmnResponse frame = {0, (uint32_t)len, 0, 0};
+
+	//Responses too long to cache are still counted, so Cch_Store rejects them
+	if(sink_ctx->copy != NULL)
+	{
+		if(sink_ctx->copy_len + len <= CCH_MAX_RESP_LEN)
+		{
+			memcpy(sink_ctx->copy + sink_ctx->copy_len, data, len);
+		}
+		sink_ctx->copy_len += len;
+	}
+
+	//A client that has gone ends its request
+	if(sink_ctx->client->sock < 0) return sink_ctx->err = ECONNRESET;
+
+	if((sink_ctx->err = Dmn_Queue(sink_ctx->client, &frame,
+	                              sizeof(frame))) != 0 ||
+	   (sink_ctx->err = Dmn_Queue(sink_ctx->client, data, len)) != 0 ||
+	   (sink_ctx->err = Dmn_Flush(sink_ctx->client)) != 0)
+	{
+		return sink_ctx->err;
+	}
+
+	return 0;
+}
+
+//Sends the end of response frame of a request. Returns errno (=0 if ok)
+static int Dmn_SendEnd(DmnClient *client, const int status,
+                       const uint64_t queue_us, const uint64_t bus_us)
+{
+	DmnResponse resp = {status, 0, Dmn_ClampTime(queue_us),
+	                    Dmn_ClampTime(bus_us)};
+
+	int err = Dmn_Queue(client, &resp, sizeof(resp));
+	if(err != 0) return err;
+	return Dmn_Flush(client);
+}
+
+//Fills the settings structs from the request of [client]
+static void Dmn_GetSettings(const DmnClient *client, PortSettings *settings,
+                            QuerySettings *query)
+{
+	const DmnRequest *req = &client->req;
+
+	settings->baud = req->baud;
+	settings->bitlength = req->bitlength;
+
+	Qry_DefaultQuerySettings(query);
+	query->txdelay = req->txdelay;
+	query->rxdelay = req->rxdelay;
+	query->first_byte = req->first_byte;
+	query->inter_char = req->inter_char;
+	query->deadline = req->deadline;
+	query->term = req->term_len ? client->term : NULL;
+	query->term_len = req->term_len;
+	query->cache_ttl = req->cache_ttl;
+}
+
+//Returns where the next bytes of the request of [client] go, setting [*len]
+//to how many the current field still needs. [*len] is 0 once it is complete
+static char *Dmn_RequestField(DmnClient *client, size_t *len)
+{
+	const DmnRequest *req = &client->req;
+	size_t pos = client->in_len;
+
+	if(pos < sizeof(*req))
+	{
+		*len = sizeof(*req) - pos;
+		return (char *)&client->req + pos;
+	}
+	pos -= sizeof(*req);
+
+	if(pos < req->port_len)
+	{
+		*len = req->port_len - pos;
+		return client->port + pos;
+	}
+	pos -= req->port_len;
+
+	if(pos < req->mesg_len)
+	{
+		*len = req->mesg_len - pos;
+		return client->mesg + pos;
+	}
+	pos -= req->mesg_len;
+
+	*len = pos < req->term_len ? req->term_len - pos : 0;
+	return client->term + pos;
+}
+
+//Checks the request header of [client] once it has arrived, before its
+//variable length fields are read. Returns errno (=0 if ok)
+static int Dmn_CheckHeader(DmnClient *client)
+{
+	const DmnRequest *req = &client->req;
+	if(req->magic != DMN_MAGIC || req->port_len == 0 ||
+	   req->port_len > DMN_MAX_PORT_LEN || req->mesg_len > DMN_MAX_MESG_LEN ||
+	   req->term_len > QRY_MAX_TERM_LEN || req->priority >= SCH_CLASS_COUNT)
+	{
+		return EPROTO;
+	}
+
+	//The message buffer only ever grows
+	if(req->mesg_len > client->mesg_size)
+	{
+		char *grown = realloc(client->mesg, req->mesg_len);
+		if(grown == NULL) return ENOMEM;
+
+		client->mesg = grown;
+		client->mesg_size = req->mesg_len;
+	}
+
+	return 0;
+}
+
+//Reads as much of a request from [client] as has arrived. A complete request
+//the cache can answer is answered straight away, any other is queued to be
+//run.
+//Returns errno (=0 if ok), ECONNRESET when the client has disconnected
+static int Dmn_ReadRequest(DmnClient *client)
+{
+	DmnRequest *req = &client->req;
+	int err;
+
+	while(true)
+	{
+		size_t len;
+		char *field = Dmn_RequestField(client, &len);
+		if(len == 0) break;
+
+		ssize_t ret = read(client->sock, field, len);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) return 0;
+			return errno;
+		}
+		if(ret == 0) return ECONNRESET;
+
+		if(client->in_len == 0) client->in_start = Tim_NowUs();
+		client->in_len += (size_t)ret;
+
+		//Validate the header before reading the variable length fields
+		if(client->in_len == sizeof(*req) &&
+		   (err = Dmn_CheckHeader(client)) != 0) return err;
+	}
+
+	client->in_len = 0;
+	client->port[req->port_len] = '\0';
+
+	//A response still valid in the cache is sent without touching the port
+	if(req->cache_ttl != 0)
+	{
+		PortSettings settings;
+		QuerySettings query;
+		Dmn_GetSettings(client, &settings, &query);
+
+		const CchEntry *hit = Cch_Lookup(&_cache, &client->key, client->port,
+		                                 &settings, &query, client->mesg,
+		                                 req->mesg_len);
+		if(hit != NULL)
+		{
+			DmnSinkCtx sink_ctx = {client, 0, NULL, 0};
+			if(Dmn_ClientSink(hit->resp, hit->resp_len, &sink_ctx) != 0)
+			{
+				return sink_ctx.err;
+			}
+
+			return Dmn_SendEnd(client, 0, 0, 0);
+		}
+	}
+
+	//Queued for its port. Every slot being busy is reported to the client
+	DmnPort *port = Dmn_FindPort(client->port);
+	if(port == NULL) return Dmn_SendEnd(client, EBUSY, 0, 0);
+
+	//The time spent in the socket while another request was running counts
+	//as queue time too
+	if((err = Sch_Push(&port->sched, client, (SchClass)req->priority,
+	                   req->sent)) != 0)
+	{
+		return err;
+	}
+
+	client->busy = true;
+	return 0;
+}
+
+//Disconnects [client], reporting why unless it simply disconnected. A queued
+//request stays in the scheduler and is discarded when it is taken out, a
+//running one ends at its next response bytes
+static void Dmn_DropClient(DmnClient *client, const int err)
+{
+	if(err != 0 && err != ECONNRESET)
+	{
+		fprintf(stderr, "sqirtd: Dropped client: %s\n", strerror(err));
+	}
+
+	close(client->sock);
+	client->sock = -1;
+	client->in_len = 0;
+	client->out_len = 0;
+	client->out_done = 0;
+}
+
+//Drops [client] if it has stalled mid-request, or left its output unread,
+//for longer than DMN_CLIENT_TIMEOUT.
+//Returns the time it must be checked again by, TIM_NEVER for none
+static uint64_t Dmn_CheckTimeout(DmnClient *client, const uint64_t now)
+{
+	uint64_t next = TIM_NEVER;
+	if(client->in_len != 0) next = client->in_start + DMN_CLIENT_TIMEOUT;
+
+	if(client->out_done < client->out_len &&
+	   client->out_since + DMN_CLIENT_TIMEOUT < next)
+	{
+		next = client->out_since + DMN_CLIENT_TIMEOUT;
+	}
+
+	if(next > now) return next;
+
+	Dmn_DropClient(client, ETIMEDOUT);
+	return TIM_NEVER;
+}
+
+//Adds a newly connected client, or turns it away if there is no room
+static void Dmn_AddClient(const int sock)
+{
+	for(size_t idx = 0; idx < DMN_MAX_CLIENTS; idx++)
+	{
+		DmnClient *client = &_clients[idx];
+		if(client->sock >= 0 || client->busy) continue;
+
+		struct epoll_event ev = {.events = EPOLLIN,
+		                         .data.u64 = DMN_EV(idx, DMN_EV_CLIENT)};
+		if(epoll_ctl(_epfd, EPOLL_CTL_ADD, sock, &ev) != 0) break;
+
+		client->sock = sock;
+		client->events = EPOLLIN;
+		client->in_len = 0;
+		client->out_len = 0;
+		client->out_done = 0;
+		return;
+	}
+
+	fprintf(stderr, "sqirtd: Dropped client: %s\n", strerror(EMFILE));
+	close(sock);
+}
+
+//Handles the epoll [events] of [client]
+static void Dmn_ClientEvent(DmnClient *client, const uint32_t events)
+{
+	//Requests are only read while the client has none queued or running.
+	//A hangup is seen by the read, or by the write of pending output
+	int err = 0;
+	if(client->out_done < client->out_len) err = Dmn_Flush(client);
+	if(err == 0 && client->busy == false) err = Dmn_ReadRequest(client);
+	else if(err == 0 && (events & (EPOLLHUP | EPOLLERR))) err = ECONNRESET;
+
+	if(err != 0) Dmn_DropClient(client, err);
+}
+
+//Ends the request [port] is running with [status], sending the end of
+//response frame to its client
+static void Dmn_EndRequest(DmnPort *port, const int status)
+{
+	DmnClient *client = port->active;
+	DmnSinkCtx *sink_ctx = &port->sink_ctx;
+	port->active = NULL;
+	client->busy = false;
+
+	uint64_t bus_time = Tim_NowUs() - port->bus_start;
+	Sch_Record(&port->sched, port->class, port->wait, bus_time);
+
+	if(status != 0 && sink_ctx->err == 0)
+	{
+		//The device may have gone away. Reopen it on the next request
+		Dmn_ClosePort(port);
+	} else if(status == 0 && sink_ctx->copy != NULL) {
+		//Stored under the key of this request, other requests may have
+		//been looked up since it was queued
+		Cch_Store(&_cache, &client->key, &port->query, sink_ctx->copy,
+		          sink_ctx->copy_len, port->query.cache_ttl);
+	}
+
+	//If the client went away there is nobody left to tell
+	if(client->sock < 0) return;
+
+	int err = sink_ctx->err;
+	if(err == 0) err = Dmn_SendEnd(client, status, port->wait, bus_time);
+	if(err != 0) Dmn_DropClient(client, err);
+}
+
+//Steps the request [port] is running as far as it goes without waiting
+static void Dmn_StepPort(DmnPort *port)
+{
+	int status = Trn_Step(&port->trn);
+	if(status != EINPROGRESS) Dmn_EndRequest(port, status);
+}
+
+//Starts the most urgent request queued for the idle [port], failing those
+//that waited past their queue deadline instead of running them late.
+//Requests of clients that have gone are discarded
+static void Dmn_StartNext(DmnPort *port)
+{
+	SchClass class;
+	uint64_t wait;
+	DmnClient *client;
+	while((client = Sch_PopExpired(&port->sched, &class, &wait)) != NULL)
+	{
+		client->busy = false;
+		if(client->sock < 0) continue;
+
+		int err = Dmn_SendEnd(client, ETIMEDOUT, wait, 0);
+		if(err != 0) Dmn_DropClient(client, err);
+	}
+
+	while(port->active == NULL &&
+	      (client = Sch_Pop(&port->sched, &class, &wait)) != NULL)
+	{
+		if(client->sock < 0)
+		{
+			client->busy = false;
+			continue;
+		}
+
+		++_request_count;
+		port->active = client;
+		port->class = class;
+		port->wait = wait;
+		port->bus_start = Tim_NowUs();
+
+		PortSettings settings;
+		Dmn_GetSettings(client, &settings, &port->query);
+
+		//Responses that may be cached are copied as they are sent
+		DmnSinkCtx *sink_ctx = &port->sink_ctx;
+		*sink_ctx = (DmnSinkCtx){client, 0, NULL, 0};
+		if(port->query.cache_ttl != 0)
+		{
+			if(port->cache_buf == NULL)
+			{
+				port->cache_buf = malloc(CCH_MAX_RESP_LEN);
+			}
+			sink_ctx->copy = port->cache_buf;
+		}
+
+		int ser_err = Dmn_OpenPort(port, &settings);
+		if(ser_err != 0)
+		{
+			Dmn_EndRequest(port, ser_err);
+			continue;
+		}
+
+		Trn_BeginStream(&port->trn, &port->dev, &port->query, client->mesg,
+		                client->req.mesg_len, port->resp_buf, DMN_CHUNK_LEN,
+		                Dmn_ClientSink, sink_ctx);
+		Dmn_StepPort(port);
+	}
+}
+
+/*** API Functions ************************************************************/
+int Dmn_Serve(const char *sock_path)
+{
+	struct sockaddr_un addr;
+	int err = Dmn_MakeAddress(sock_path, &addr);
+	if(err != 0) return err;
+
+	//Stop cleanly on SIGINT/SIGTERM. No SA_RESTART so poll() is interrupted
+	struct sigaction sig_act;
+	memset(&sig_act, 0, sizeof(sig_act));
+	sig_act.sa_handler = Dmn_SignalHandler;
+	sigemptyset(&sig_act.sa_mask);
+	sigaction(SIGINT, &sig_act, NULL);
+	sigaction(SIGTERM, &sig_act, NULL);
+
+	sig_act.sa_handler = Dmn_StatsHandler;
+	sigaction(SIGUSR1, &sig_act, NULL);
+
+	//A client disconnecting mid-response must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	//Non-blocking, so every waiting connection can be accepted at once
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(listener < 0) return errno;
+
+	//Remove a stale socket left behind by a previous instance
+	unlink(sock_path);
+	if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	   listen(listener, 16) != 0)
+	{
+		err = errno;
+		close(listener);
+		return err;
+	}
+
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event listen_ev = {.events = EPOLLIN,
+	                                .data.u64 = DMN_EV(0, DMN_EV_LISTENER)};
+	if(_epfd < 0 ||
+	   epoll_ctl(_epfd, EPOLL_CTL_ADD, listener, &listen_ev) != 0)
+	{
+		err = errno;
+		if(_epfd >= 0) close(_epfd);
+		close(listener);
+		return err;
+	}
+
+	Cch_Init(&_cache);
+	for(size_t idx = 0; idx < DMN_MAX_CLIENTS; idx++) _clients[idx].sock = -1;
+
+	struct epoll_event events[DMN_MAX_CLIENTS + DMN_MAX_PORTS + 1];
+	int rounds = 0;
+	_running = 1;
+	while(_running)
+	{
+		Dmn_CheckStats();
+
+		//Watch each client for requests while it has none queued or running,
+		//and for room to send while it has output left
+		uint64_t now = Tim_NowUs(), next = TIM_NEVER;
+		for(size_t idx = 0; idx < DMN_MAX_CLIENTS; idx++)
+		{
+			DmnClient *client = &_clients[idx];
+			if(client->sock < 0) continue;
+
+			uint64_t check = Dmn_CheckTimeout(client, now);
+			if(client->sock < 0) continue;
+			if(check < next) next = check;
+
+			uint32_t want = client->busy ? 0 : EPOLLIN;
+			if(client->out_done < client->out_len) want |= EPOLLOUT;
+
+			int watch_err = Dmn_Watch(client->sock,
+			                          DMN_EV(idx, DMN_EV_CLIENT), want,
+			                          &client->events);
+			if(watch_err != 0) Dmn_DropClient(client, watch_err);
+		}
+
+		//Watch each running port for what its transaction waits on, until
+		//its next deadline. Idle ports with requests waiting start them
+		//straight after new requests have been taken in
+		bool waiting = false;
+		for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+		{
+			DmnPort *port = &_ports[idx];
+			if(port->active == NULL)
+			{
+				if(port->sched.count != 0) waiting = true;
+				if(port->open)
+				{
+					Dmn_Watch(port->dev.filedesc, DMN_EV(idx, DMN_EV_PORT), 0,
+					          &port->events);
+				}
+				continue;
+			}
+
+			short trn_events = Trn_Events(&port->trn);
+			uint32_t want = (trn_events & POLLIN ? EPOLLIN : 0) |
+			                (trn_events & POLLOUT ? EPOLLOUT : 0);
+			int watch_err = Dmn_Watch(port->dev.filedesc,
+			                          DMN_EV(idx, DMN_EV_PORT), want,
+			                          &port->events);
+			if(watch_err != 0)
+			{
+				Dmn_EndRequest(port, watch_err);
+				continue;
+			}
+
+			uint64_t deadline = Trn_Deadline(&port->trn);
+			if(deadline < next) next = deadline;
+		}
+
+		int timeout = -1;
+		if(waiting) timeout = 0;
+		else if(next != TIM_NEVER) timeout = (int)((Tim_Remaining(next) + 999)
+		                                           / 1000);
+
+		int ready = epoll_wait(_epfd, events,
+		                       (int)(sizeof(events) / sizeof(events[0])),
+		                       timeout);
+		if(ready < 0)
+		{
+			if(errno == EINTR) continue;
+			err = errno;
+			break;
+		}
+
+		for(int idx = 0; idx < ready; idx++)
+		{
+			size_t slot = (size_t)(events[idx].data.u64 >> 2);
+			uint32_t ev = events[idx].events;
+
+			switch(events[idx].data.u64 & 3)
+			{
+				case DMN_EV_LISTENER:;
+					int client;
+					while((client = accept4(listener, NULL, NULL,
+					                        SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+					{
+						Dmn_AddClient(client);
+					}
+					break;
+
+				case DMN_EV_CLIENT:
+					if(_clients[slot].sock >= 0)
+					{
+						Dmn_ClientEvent(&_clients[slot], ev);
+					}
+					break;
+
+				//An idle port only reports errors or a hangup, close it so
+				//it is reopened by its next request
+				case DMN_EV_PORT:
+					if(_ports[slot].active != NULL) Dmn_StepPort(&_ports[slot]);
+					else Dmn_ClosePort(&_ports[slot]);
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		//Running ports whose delay or receive deadline has passed
+		now = Tim_NowUs();
+		for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+		{
+			DmnPort *port = &_ports[idx];
+			if(port->active != NULL && Trn_Deadline(&port->trn) <= now)
+			{
+				Dmn_StepPort(port);
+			}
+		}
+
+		//New clients have not been read yet, look again before choosing
+		if(ready > 0 && ++rounds < DMN_INGEST_ROUNDS) continue;
+		rounds = 0;
+
+		for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+		{
+			if(_ports[idx].active == NULL) Dmn_StartNext(&_ports[idx]);
+		}
+	}
+
+	//Disconnect every client, close all ports and remove the socket
+	for(size_t idx = 0; idx < DMN_MAX_CLIENTS; idx++)
+	{
+		if(_clients[idx].sock >= 0) Dmn_DropClient(&_clients[idx], 0);
+		_clients[idx].busy = false;
+		free(_clients[idx].mesg);
+		_clients[idx].mesg = NULL;
+		_clients[idx].mesg_size = 0;
+		free(_clients[idx].out);
+		_clients[idx].out = NULL;
+		_clients[idx].out_size = 0;
+		Cch_FreeKey(&_clients[idx].key);
+	}
+
+	//Final counters, if any request used the cache or a queue
+	_print_stats = _cache.lookups != 0 || _request_count != 0;
+	Dmn_CheckStats();
+	Cch_Free(&_cache);
+
+	for(size_t idx = 0; idx < DMN_MAX_PORTS; idx++)
+	{
+		Dmn_ClosePort(&_ports[idx]);
+		_ports[idx].active = NULL;
+		_ports[idx].filename[0] = '\0';
+		free(_ports[idx].cache_buf);
+		_ports[idx].cache_buf = NULL;
+	}
+
+	close(_epfd);
+	_epfd = -1;
+	close(listener);
+	unlink(sock_path);
+	return err;
+}
+
+ssize_t Dmn_Query(const char *sock_path, const char *port,
+                  const PortSettings *settings, const QuerySettings *query,
+                  const char *mesg, const size_t mesg_len,
+                  char *buf, const size_t buf_len, QuerySink sink, void *ctx,
+                  DmnSchedule *sched)
+{
+	struct sockaddr_un addr;
+	int err = Dmn_MakeAddress(sock_path, &addr);
+	if(err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	size_t port_len = strlen(port);
+	size_t term_len = query->term ? query->term_len : 0;
+	if(port_len == 0 || port_len > DMN_MAX_PORT_LEN || buf_len == 0 ||
+	   mesg_len > DMN_MAX_MESG_LEN || term_len > QRY_MAX_TERM_LEN)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	DmnRequest req = {
+		.magic = DMN_MAGIC,
+		.baud = settings->baud,
+		.bitlength = settings->bitlength,
+		.txdelay = Dmn_ClampTime(query->txdelay),
+		.rxdelay = Dmn_ClampTime(query->rxdelay),
+		.first_byte = Dmn_ClampTime(query->first_byte),
+		.inter_char = Dmn_ClampTime(query->inter_char),
+		.deadline = Dmn_ClampTime(query->deadline),
+		.cache_ttl = Dmn_ClampTime(query->cache_ttl),
+		.priority = sched ? (uint32_t)sched->priority : SCH_NORMAL,
+		.sent = Tim_NowUs(),
+		.port_len = (uint32_t)port_len,
+		.mesg_len = (uint32_t)mesg_len,
+		.term_len = (uint32_t)term_len
+	};
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0) return -1;
+
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	if((err = Dmn_WriteFull(sock, &req, sizeof(req))) != 0 ||
+	   (err = Dmn_WriteFull(sock, port, port_len)) != 0 ||
+	   (err = Dmn_WriteFull(sock, mesg, mesg_len)) != 0 ||
+	   (err = Dmn_WriteFull(sock, query->term, term_len)) != 0)
+	{
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	//Pass each response frame to the sink, until the end frame arrives
+	size_t total = 0;
+	DmnResponse frame;
+	while((err = Dmn_ReadFull(sock, &frame, sizeof(frame))) == 0)
+	{
+		if(frame.len == 0)
+		{
+			err = frame.status;
+			if(sched != NULL)
+			{
+				sched->queue_us = frame.queue_us;
+				sched->bus_us = frame.bus_us;
+			}
+			break;
+		}
+
+		uint32_t left = frame.len;
+		while(left > 0 && err == 0)
+		{
+			size_t chunk = left < buf_len ? left : buf_len;
+			if((err = Dmn_ReadFull(sock, buf, chunk)) == 0)
+			{
+				err = sink(buf, chunk, ctx);
+			}
+
+			left -= (uint32_t)chunk;
+			total += chunk;
+		}
+		if(err != 0) break;
+	}
+
+	close(sock);
+
+	if(err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	return (ssize_t)total;
+}
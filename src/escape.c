@@ -0,0 +1,97 @@
+/*******************************************************************************
+* Escape handler - Converts between raw byte strings and single line, C style
+* escaped text (\r \n \t \\ \xHH) used by the sqirt text record formats
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stddef.h>
+
+#include "escape.h"
+
+/*** Private Functions ********************************************************/
+//Returns the value of hex char [c], or -1 if it is not a hex char
+static int Esc_HexValue(const char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*** API Functions ************************************************************/
+size_t Esc_Decode(char *str)
+{
+	size_t out = 0;
+
+	for(size_t in = 0; str[in] != '\0'; in++)
+	{
+		if(str[in] != '\\' || str[in + 1] == '\0')
+		{
+			str[out++] = str[in];
+			continue;
+		}
+
+		switch(str[in + 1])
+		{
+			case 'r':  str[out++] = '\r'; ++in; break;
+			case 'n':  str[out++] = '\n'; ++in; break;
+			case 't':  str[out++] = '\t'; ++in; break;
+			case '0':  str[out++] = '\0'; ++in; break;
+			case '\\': str[out++] = '\\'; ++in; break;
+
+			case 'x':
+			{
+				int high = Esc_HexValue(str[in + 2]);
+				int low = high < 0 ? -1 : Esc_HexValue(str[in + 3]);
+
+				if(low < 0)
+				{
+					str[out++] = str[in];
+				} else {
+					str[out++] = (char)((high << 4) | low);
+					in += 3;
+				}
+				break;
+			}
+
+			//Unknown sequence, keep the backslash
+			default:
+				str[out++] = str[in];
+				break;
+		}
+	}
+
+	str[out] = '\0';
+	return out;
+}
+
+int Esc_Encode(const char *buf, const size_t len, FILE *out)
+{
+	for(size_t idx = 0; idx < len; idx++)
+	{
+		unsigned char c = (unsigned char)buf[idx];
+		int ret;
+
+		switch(c)
+		{
+			case '\r': ret = fputs("\\r", out); break;
+			case '\n': ret = fputs("\\n", out); break;
+			case '\t': ret = fputs("\\t", out); break;
+			case '\\': ret = fputs("\\\\", out); break;
+
+			default:
+				if(c < 0x20 || c >= 0x7F)
+				{
+					ret = fprintf(out, "\\x%02X", c);
+				} else {
+					ret = fputc(c, out);
+				}
+				break;
+		}
+
+		if(ret < 0) return EOF;
+	}
+
+	return 0;
+}
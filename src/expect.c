@@ -0,0 +1,461 @@
+/*******************************************************************************
+* Expect handler - Runs a send/expect conversation script against one open
+* SerialDevice, matching each pattern as the bytes arrive.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "expect.h"
+#include "escape.h"
+#include "timing.h"
+#include "serial.h"
+
+#define EXP_MAX_FIELDS 4
+#define EXP_READ_LEN   4096          //Most bytes read at once
+#define EXP_MAX_TIME   TIM_INC(36000) //Longest timeout or sleep, 1 hour
+
+/*** Private Functions ********************************************************/
+//Parses a plain decimal number no larger than [limit].
+//Returns 0 if ok, -1 if [str] is not valid
+static int Exp_ParseNumber(const char *str, const unsigned long limit,
+                           unsigned long *val)
+{
+	if(*str < '0' || *str > '9') return -1;
+
+	char *end;
+	errno = 0;
+	*val = strtoul(str, &end, 10);
+	if(*end != '\0' || errno != 0 || *val > limit) return -1;
+
+	return 0;
+}
+
+//Copies the [len] bytes of [text] into [step], adding "\r\n" if [newline].
+//Returns 0 if ok, -1 if out of memory
+static int Exp_SetText(ExpStep *step, const char *text, size_t len,
+                       const bool newline)
+{
+	step->text = malloc(len + 3);
+	if(step->text == NULL) return -1;
+
+	memcpy(step->text, text, len);
+	if(newline)
+	{
+		memcpy(step->text + len, "\r\n", 2);
+		len += 2;
+	}
+	step->text[len] = '\0';
+	step->text_len = len;
+
+	return 0;
+}
+
+//Builds the matched prefix table of an expect pattern, so the pattern can be
+//matched one byte at a time without ever looking back at old bytes
+static int Exp_BuildPrefix(ExpStep *step)
+{
+	step->prefix = malloc(step->text_len * sizeof(size_t));
+	if(step->prefix == NULL) return -1;
+
+	const char *pat = step->text;
+	step->prefix[0] = 0;
+	size_t len = 0;
+	for(size_t idx = 1; idx < step->text_len; idx++)
+	{
+		while(len > 0 && pat[idx] != pat[len]) len = step->prefix[len - 1];
+		if(pat[idx] == pat[len]) ++len;
+		step->prefix[idx] = len;
+	}
+
+	return 0;
+}
+
+//Parses the on failure field of an expect step.
+//Returns 0 if ok, -1 if it is not valid
+static int Exp_ParseFail(char *field, ExpStep *step)
+{
+	char *arg = strchr(field, ' ');
+	if(arg == NULL) return -1;
+	*arg++ = '\0';
+
+	unsigned long val;
+	if(strcmp(field, "retry") == 0)
+	{
+		if(Exp_ParseNumber(arg, 1000000, &val) != 0) return -1;
+		step->fail = EXP_FAIL_RETRY;
+		step->retries = val;
+	} else if(strcmp(field, "goto") == 0) {
+		if(*arg == '\0') return -1;
+		step->fail = EXP_FAIL_GOTO;
+		step->fail_label = strdup(arg);
+		if(step->fail_label == NULL) return -1;
+	} else if(strcmp(field, "exit") == 0) {
+		if(Exp_ParseNumber(arg, 255, &val) != 0) return -1;
+		step->fail = EXP_FAIL_EXIT;
+		step->fail_status = (int)val;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+//Parses one script line (already stripped of its line ending) into [step].
+//Returns 0 if ok, -1 if the line is not valid
+static int Exp_ParseLine(char *line, const bool newline, ExpStep *step)
+{
+	//Split the fields. The first is the operation
+	char *fields[EXP_MAX_FIELDS];
+	size_t field_count = 0;
+	char *pos = line;
+	while(pos != NULL)
+	{
+		if(field_count == EXP_MAX_FIELDS) return -1;
+		fields[field_count++] = pos;
+
+		pos = strchr(pos, '\t');
+		if(pos != NULL) *pos++ = '\0';
+	}
+	if(field_count < 2) return -1;
+
+	char *op = fields[0];
+	char *arg = fields[1];
+	unsigned long val;
+
+	if(strcmp(op, "send") == 0 && field_count == 2)
+	{
+		step->op = EXP_SEND;
+		return Exp_SetText(step, arg, Esc_Decode(arg), newline);
+	}
+
+	if(strcmp(op, "expect") == 0 && field_count >= 3)
+	{
+		step->op = EXP_EXPECT;
+		step->fail = EXP_FAIL_EXIT;
+		step->fail_status = 1;
+
+		size_t arg_len = Esc_Decode(arg);
+		if(arg_len == 0 ||
+		   Tim_ParseUs(fields[2], &step->time, EXP_MAX_TIME) != 0 ||
+		   (field_count == 4 && Exp_ParseFail(fields[3], step) != 0) ||
+		   Exp_SetText(step, arg, arg_len, false) != 0) return -1;
+
+		return Exp_BuildPrefix(step);
+	}
+
+	if(field_count != 2) return -1;
+
+	if(strcmp(op, "sleep") == 0)
+	{
+		step->op = EXP_SLEEP;
+		return Tim_ParseUs(arg, &step->time, EXP_MAX_TIME) == 0 ? 0 : -1;
+	}
+
+	if(strcmp(op, "exit") == 0)
+	{
+		step->op = EXP_EXIT;
+		if(Exp_ParseNumber(arg, 255, &val) != 0) return -1;
+		step->status = (int)val;
+		return 0;
+	}
+
+	if(strcmp(op, "label") == 0 || strcmp(op, "goto") == 0)
+	{
+		step->op = op[0] == 'l' ? EXP_LABEL : EXP_GOTO;
+		if(*arg == '\0') return -1;
+		return Exp_SetText(step, arg, strlen(arg), false);
+	}
+
+	return -1;
+}
+
+//Finds the step of the label [name].
+//Returns 0 if ok, -1 if there is no such label
+static int Exp_FindLabel(const ExpScript *script, const char *name,
+                         size_t *target)
+{
+	for(size_t idx = 0; idx < script->count; idx++)
+	{
+		const ExpStep *step = &script->steps[idx];
+		if(step->op == EXP_LABEL && strcmp(step->text, name) == 0)
+		{
+			*target = idx;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+//Resolves the step every goto and retry continues from.
+//Returns 0 if ok, or the line of the first step that cannot be resolved
+static unsigned long Exp_Resolve(ExpScript *script)
+{
+	size_t last_send = SIZE_MAX;
+	for(size_t idx = 0; idx < script->count; idx++)
+	{
+		ExpStep *step = &script->steps[idx];
+		size_t other;
+
+		switch(step->op)
+		{
+			case EXP_SEND:
+				last_send = idx;
+				break;
+
+			//Labels must be unique
+			case EXP_LABEL:
+				if(Exp_FindLabel(script, step->text, &other) == 0 && other != idx)
+				{
+					return step->line;
+				}
+				break;
+
+			case EXP_GOTO:
+				if(Exp_FindLabel(script, step->text, &step->target) != 0)
+				{
+					return step->line;
+				}
+				break;
+
+			case EXP_EXPECT:
+				if(step->fail == EXP_FAIL_GOTO &&
+				   Exp_FindLabel(script, step->fail_label, &step->target) != 0)
+				{
+					return step->line;
+				}
+
+				//A retry sends the last message again
+				if(step->fail == EXP_FAIL_RETRY)
+				{
+					if(last_send == SIZE_MAX) return step->line;
+					step->target = last_send;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+int Exp_ReadScript(FILE *in, const bool newline, ExpScript *script,
+                   unsigned long *line_num)
+{
+	script->steps = NULL;
+	script->count = 0;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+
+	*line_num = 0;
+	while((line_len = getline(&line, &line_size, in)) >= 0)
+	{
+		++*line_num;
+
+		//Strip the line ending, then skip empty lines and comments
+		while(line_len > 0 && (line[line_len - 1] == '\n' ||
+		                       line[line_len - 1] == '\r'))
+		{
+			line[--line_len] = '\0';
+		}
+		if(line_len == 0 || line[0] == '#') continue;
+
+		if(script->count >= EXP_MAX_STEPS) goto error;
+
+		ExpStep *grown = realloc(script->steps,
+		                         (script->count + 1) * sizeof(ExpStep));
+		if(grown == NULL)
+		{
+			*line_num = 0;
+			goto error;
+		}
+		script->steps = grown;
+
+		ExpStep *step = &script->steps[script->count++];
+		memset(step, 0, sizeof(*step));
+		step->line = *line_num;
+
+		if(Exp_ParseLine(line, newline, step) != 0) goto error;
+	}
+
+	if(ferror(in))
+	{
+		*line_num = 0;
+		goto error;
+	}
+
+	free(line);
+
+	if((*line_num = Exp_Resolve(script)) != 0)
+	{
+		Exp_FreeScript(script);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	free(line);
+	Exp_FreeScript(script);
+	return -1;
+}
+
+int Exp_Run(const ExpScript *script, SerialDevice *dev, FILE *transcript,
+            unsigned long *fail_line)
+{
+	*fail_line = 0;
+
+	//Retries used by each expect step since it last matched
+	unsigned long *retries = calloc(script->count, sizeof(unsigned long));
+	char *buf = malloc(EXP_READ_LEN);
+	if(retries == NULL || buf == NULL)
+	{
+		free(retries);
+		free(buf);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	//Bytes read but not yet matched, kept for the next expect
+	size_t carry_pos = 0, carry_len = 0;
+
+	int status = 0;
+	size_t crnt = 0;
+	while(crnt < script->count)
+	{
+		const ExpStep *step = &script->steps[crnt];
+
+		if(step->op == EXP_SEND)
+		{
+			int ser_err = Ser_WriteBuffer(step->text, step->text_len, dev);
+			if(ser_err != 0)
+			{
+				errno = ser_err;
+				status = -1;
+				break;
+			}
+		} else if(step->op == EXP_SLEEP) {
+			Tim_SleepUs(step->time);
+		} else if(step->op == EXP_GOTO) {
+			crnt = step->target;
+			continue;
+		} else if(step->op == EXP_EXIT) {
+			status = step->status;
+			break;
+		}
+
+		if(step->op != EXP_EXPECT)
+		{
+			++crnt;
+			continue;
+		}
+
+		/*** Match the pattern one byte at a time as they arrive **************/
+		uint64_t deadline = Tim_DeadlineIn(step->time);
+		size_t matched = 0;
+		bool found = false, port_failed = false;
+		while(found == false)
+		{
+			if(carry_len == 0)
+			{
+				ssize_t byte_count = Ser_ReadTimed(buf, EXP_READ_LEN, deadline,
+				                                   dev);
+				//A hangup is a port failure (EIO), and only the deadline passing
+				//is a timeout. Anything else short of it is read again
+				if(byte_count < 0)
+				{
+					port_failed = true;
+					break;
+				}
+				if(byte_count == 0)
+				{
+					if(Tim_NowUs() >= deadline) break;
+					continue;
+				}
+
+				carry_pos = 0;
+				carry_len = (size_t)byte_count;
+			}
+
+			size_t idx = carry_pos, end = carry_pos + carry_len;
+			while(idx < end && found == false)
+			{
+				char chr = buf[idx++];
+				while(matched > 0 && chr != step->text[matched])
+				{
+					matched = step->prefix[matched - 1];
+				}
+				if(chr == step->text[matched]) ++matched;
+				found = matched == step->text_len;
+			}
+
+			fwrite(buf + carry_pos, 1, idx - carry_pos, transcript);
+			carry_len -= idx - carry_pos;
+			carry_pos = idx;
+		}
+		fflush(transcript);
+
+		//Stop if the port failed, rather than treating it as a timeout
+		if(port_failed)
+		{
+			status = -1;
+			break;
+		}
+
+		if(found)
+		{
+			retries[crnt++] = 0;
+			continue;
+		}
+
+		/*** The pattern did not arrive in time *******************************/
+		if(step->fail == EXP_FAIL_GOTO)
+		{
+			crnt = step->target;
+			continue;
+		}
+
+		if(step->fail == EXP_FAIL_RETRY && retries[crnt] < step->retries)
+		{
+			++retries[crnt];
+			crnt = step->target;
+			continue;
+		}
+
+		*fail_line = step->line;
+		status = step->fail == EXP_FAIL_EXIT ? step->fail_status : 1;
+		break;
+	}
+
+	//Bytes received after the last match still belong in the transcript
+	fwrite(buf + carry_pos, 1, carry_len, transcript);
+	fflush(transcript);
+
+	free(retries);
+	free(buf);
+	return status;
+}
+
+void Exp_FreeScript(ExpScript *script)
+{
+	if(script->steps == NULL) return;
+
+	for(size_t idx = 0; idx < script->count; idx++)
+	{
+		free(script->steps[idx].text);
+		free(script->steps[idx].prefix);
+		free(script->steps[idx].fail_label);
+	}
+
+	free(script->steps);
+	script->steps = NULL;
+	script->count = 0;
+}
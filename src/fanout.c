@@ -0,0 +1,256 @@
+/*******************************************************************************
+* Fan-out handler - Sends messages to many SerialDevices at once, then gathers
+* all of the responses together (see iobatch.h), so the total time taken is
+* that of the slowest device rather than the sum of them all.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fanout.h"
+#include "escape.h"
+#include "timing.h"
+#include "query.h"
+#include "serial.h"
+#include "iobatch.h"
+
+/*** Private Functions ********************************************************/
+//Parses one list line (already stripped of its line ending) into [entry].
+//Returns 0 if ok, -1 if the line is not valid
+static int Fan_ParseLine(char *line, const QuerySettings *query,
+                         const bool newline, FanEntry *entry)
+{
+	//Split the port, message and optional timeout fields
+	char *mesg = strchr(line, '\t');
+	if(mesg == NULL || mesg == line) return -1;
+	*mesg++ = '\0';
+
+	char *timeout = strchr(mesg, '\t');
+	if(timeout != NULL) *timeout++ = '\0';
+
+	memset(entry, 0, sizeof(*entry));
+	entry->query = *query;
+
+	if(timeout != NULL &&
+	   Tim_ParseUs(timeout, &entry->query.first_byte, TIM_INC(1000)) != 0)
+	{
+		return -1;
+	}
+
+	size_t mesg_len = Esc_Decode(mesg);
+
+	entry->port = strdup(line);
+	entry->mesg = malloc(mesg_len + 2);
+	if(entry->port == NULL || entry->mesg == NULL)
+	{
+		free(entry->port);
+		free(entry->mesg);
+		return -1;
+	}
+
+	memcpy(entry->mesg, mesg, mesg_len);
+	if(newline)
+	{
+		memcpy(entry->mesg + mesg_len, "\r\n", 2);
+		mesg_len += 2;
+	}
+	entry->mesg_len = mesg_len;
+
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+long Fan_ReadList(FILE *in, const QuerySettings *query, const bool newline,
+                  FanEntry **entries, unsigned long *line_num)
+{
+	FanEntry *list = NULL;
+	size_t count = 0;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+
+	*line_num = 0;
+	while((line_len = getline(&line, &line_size, in)) >= 0)
+	{
+		++*line_num;
+
+		//Strip the line ending, then skip empty lines and comments
+		while(line_len > 0 && (line[line_len - 1] == '\n' ||
+		                       line[line_len - 1] == '\r'))
+		{
+			line[--line_len] = '\0';
+		}
+		if(line_len == 0 || line[0] == '#') continue;
+
+		if(count >= FAN_MAX_ENTRIES) goto error;
+
+		FanEntry *grown = realloc(list, (count + 1) * sizeof(FanEntry));
+		if(grown == NULL)
+		{
+			*line_num = 0;
+			goto error;
+		}
+		list = grown;
+
+		if(Fan_ParseLine(line, query, newline, &list[count]) != 0) goto error;
+		++count;
+	}
+
+	if(ferror(in))
+	{
+		*line_num = 0;
+		goto error;
+	}
+
+	free(line);
+	*entries = list;
+	return (long)count;
+
+error:
+	free(line);
+	Fan_FreeList(list, count);
+	return -1;
+}
+
+long Fan_Run(FanEntry *entries, const size_t count, const PortSettings *port,
+             const size_t resp_len, const IobBackend backend, int *uring_err)
+{
+	IoBatch iob;
+	int iob_err = Iob_Init(&iob, backend, count, resp_len, uring_err);
+	if(iob_err != 0)
+	{
+		errno = iob_err;
+		return -1;
+	}
+
+	IobQuery *queries = calloc(count, sizeof(IobQuery));
+	if(queries == NULL)
+	{
+		Iob_Free(&iob);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/*** Open every port, a port may only be used once ************************/
+	size_t open_count = 0;
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		FanEntry *entry = &entries[idx];
+
+		entry->resp = malloc(resp_len);
+		if(entry->resp == NULL)
+		{
+			entry->status = ENOMEM;
+			continue;
+		}
+
+		for(size_t prev = 0; prev < idx; prev++)
+		{
+			if(strcmp(entries[prev].port, entry->port) == 0)
+			{
+				entry->status = EBUSY;
+				break;
+			}
+		}
+		if(entry->status != 0) continue;
+
+		entry->status = Qry_OpenPort(entry->port, port, &entry->dev);
+		if(entry->status != 0) continue;
+		entry->open = true;
+
+		IobQuery *query = &queries[open_count++];
+		query->dev = &entry->dev;
+		query->mesg = entry->mesg;
+		query->mesg_len = entry->mesg_len;
+		query->query = &entry->query;
+	}
+
+	/*** Query every open port at once ****************************************/
+	iob_err = Iob_Run(&iob, queries, open_count);
+
+	size_t query_idx = 0;
+	for(size_t idx = 0; idx < count && iob_err == 0; idx++)
+	{
+		FanEntry *entry = &entries[idx];
+		if(entry->open == false) continue;
+
+		IobQuery *query = &queries[query_idx++];
+		entry->status = query->status;
+		entry->rx = query->rx;
+		memcpy(entry->resp, query->resp, query->rx.total);
+	}
+
+	free(queries);
+	Iob_Free(&iob);
+
+	if(iob_err != 0)
+	{
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			if(entries[idx].open) Ser_CloseDevice(&entries[idx].dev);
+			entries[idx].open = false;
+		}
+
+		errno = iob_err;
+		return -1;
+	}
+
+	/*** Close every port and work out the final status of each ***************/
+	long failed = 0;
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		FanEntry *entry = &entries[idx];
+
+		if(entry->open) Ser_CloseDevice(&entry->dev);
+		entry->open = false;
+
+		//Nothing received, or the terminator never arrived, is a timeout
+		bool has_term = entry->query.term != NULL && entry->query.term_len;
+		if(entry->status == 0 &&
+		   (entry->rx.total == 0 || (has_term && !entry->rx.term_found)))
+		{
+			entry->status = ETIMEDOUT;
+		}
+
+		if(entry->status != 0) ++failed;
+	}
+
+	return failed;
+}
+
+void Fan_PrintResults(const FanEntry *entries, const size_t count, FILE *out)
+{
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		const FanEntry *entry = &entries[idx];
+
+		if(entry->status != 0)
+		{
+			fprintf(out, "%s\tERR\t%s\n", entry->port, strerror(entry->status));
+		} else {
+			fprintf(out, "%s\tOK\t", entry->port);
+			Esc_Encode(entry->resp, entry->rx.total, out);
+			fputc('\n', out);
+		}
+	}
+
+	fflush(out);
+}
+
+void Fan_FreeList(FanEntry *entries, const size_t count)
+{
+	if(entries == NULL) return;
+
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		free(entries[idx].port);
+		free(entries[idx].mesg);
+		free(entries[idx].resp);
+	}
+
+	free(entries);
+}
@@ -0,0 +1,548 @@
+/*******************************************************************************
+* I/O batch handler - Runs one query on each of many open SerialDevices at
+* once, with an epoll or an io_uring backend.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <sys/epoll.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "iobatch.h"
+#include "timing.h"
+#include "query.h"
+#include "serial.h"
+#include "uring.h"
+
+//Most requests a query queues between two submissions: a poll for room to
+//write, the write, then a poll and read
+#define IOB_MAX_QUEUED   4
+#define IOB_MAX_ENTRIES  32768       //Largest ring the kernel allows
+
+//io_uring user data of a request: the query index and what the request is
+#define IOB_OP_WRITE     1
+#define IOB_OP_POLL      2
+#define IOB_OP_READ      3
+#define IOB_OP_CANCEL    4
+#define IOB_OP_POLL_OUT  5
+#define IOB_DATA(idx, op) (((uint64_t)(idx) << 3) | (op))
+
+/*** Private Functions ********************************************************/
+//Returns the message buffer of query [idx], inside the registered buffers
+static char *Iob_TxBuffer(IoBatch *iob, const size_t idx)
+{
+	return iob->bufs + iob->max_queries * iob->resp_len + idx * IOB_TX_LEN;
+}
+
+/*** poll backend *************************************************************/
+//Marks [query] as finished, removing it from the epoll set
+static void Iob_PollFinish(IoBatch *iob, IobQuery *query, const int status)
+{
+	epoll_ctl(iob->epfd, EPOLL_CTL_DEL, query->dev->filedesc, NULL);
+	++iob->syscalls;
+
+	query->rx.done = true;
+	query->status = status;
+}
+
+static int Iob_RunPoll(IoBatch *iob, IobQuery *queries, const size_t count)
+{
+	/*** Transmit to every port ***********************************************/
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		IobQuery *query = &queries[idx];
+		if(query->status != 0) continue;
+
+		query->status = Ser_WriteBuffer(query->mesg, query->mesg_len,
+		                                query->dev);
+		++iob->syscalls;
+	}
+
+	Tim_SleepUs(queries[0].query->rxdelay);
+
+	/*** Receive from every port at once **************************************/
+	size_t active = 0;
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		IobQuery *query = &queries[idx];
+		query->rx.done = true;
+		if(query->status != 0) continue;
+
+		struct epoll_event ev = {.events = EPOLLIN, .data.u64 = idx};
+		++iob->syscalls;
+		if(epoll_ctl(iob->epfd, EPOLL_CTL_ADD, query->dev->filedesc, &ev) != 0)
+		{
+			query->status = errno;
+			continue;
+		}
+
+		Qry_RxBegin(&query->rx, query->query, iob->resp_len);
+		++active;
+	}
+
+	struct epoll_event events[32];
+	while(active > 0)
+	{
+		//Sleep until the nearest deadline of any port still receiving.
+		//Rounded up, epoll_wait() only has millisecond resolution
+		uint64_t next = TIM_NEVER;
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			if(queries[idx].rx.done) continue;
+
+			uint64_t deadline = Qry_RxDeadline(&queries[idx].rx);
+			if(deadline < next) next = deadline;
+		}
+
+		int timeout_ms = -1;
+		if(next != TIM_NEVER)
+		{
+			uint64_t left = Tim_Remaining(next);
+			timeout_ms = (int)((left + 999) / 1000);
+		}
+
+		int ev_count = epoll_wait(iob->epfd, events, 32, timeout_ms);
+		++iob->syscalls;
+		if(ev_count < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+
+		for(int ev_idx = 0; ev_idx < ev_count; ev_idx++)
+		{
+			IobQuery *query = &queries[events[ev_idx].data.u64];
+			if(query->rx.done) continue;
+
+			ssize_t byte_count = Ser_ReadBuffer(query->resp + query->rx.total,
+			                                    iob->resp_len - query->rx.total,
+			                                    query->dev);
+			++iob->syscalls;
+
+			//A hangup with nothing left to read would otherwise spin forever
+			if(byte_count == 0 &&
+			   (events[ev_idx].events & (EPOLLHUP | EPOLLERR)))
+			{
+				byte_count = -1;
+				errno = EIO;
+			}
+
+			if(byte_count < 0)
+			{
+				Iob_PollFinish(iob, query, errno);
+				--active;
+				continue;
+			}
+
+			if(byte_count > 0 && Qry_RxAdd(&query->rx, query->query,
+			                               query->resp + query->rx.total,
+			                               (size_t)byte_count))
+			{
+				Iob_PollFinish(iob, query, 0);
+				--active;
+			}
+		}
+
+		//Finish every port whose deadline has passed
+		uint64_t now = Tim_NowUs();
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			IobQuery *query = &queries[idx];
+			if(query->rx.done || Qry_RxDeadline(&query->rx) > now) continue;
+
+			Iob_PollFinish(iob, query, 0);
+			--active;
+		}
+	}
+
+	return 0;
+}
+
+/*** uring backend ************************************************************/
+//Makes room for [count] more requests, submitting those already queued if
+//the ring is full. Requests linked together must be queued in one go, a link
+//cannot span two submissions. Returns errno (=0 if ok)
+static int Iob_UringReserve(IoBatch *iob, const unsigned int count)
+{
+	if(Urg_Space(&iob->ring) >= count) return 0;
+
+	int urg_err = Urg_Flush(&iob->ring, &iob->syscalls);
+	if(urg_err != 0) return urg_err;
+
+	return Urg_Space(&iob->ring) >= count ? 0 : ENOSPC;
+}
+
+//Queues a poll of query [idx], linked to a read of what it is waiting for.
+//Polling first keeps the read from blocking a kernel worker on the tty.
+//Returns errno (=0 if ok)
+static int Iob_UringQueueRead(IoBatch *iob, IobQuery *query, const size_t idx)
+{
+	int urg_err = Iob_UringReserve(iob, 2);
+	if(urg_err != 0) return urg_err;
+
+	urg_err = Urg_PrepPoll(&iob->ring, query->dev->filedesc, POLLIN, true,
+	                       IOB_DATA(idx, IOB_OP_POLL));
+	if(urg_err != 0) return urg_err;
+	++query->inflight;
+
+	urg_err = Urg_PrepRead(&iob->ring, query->dev->filedesc,
+	                       query->resp + query->rx.total,
+	                       iob->resp_len - query->rx.total,
+	                       iob->fixed ? 0 : URG_NO_BUFFER, false,
+	                       IOB_DATA(idx, IOB_OP_READ));
+	if(urg_err != 0) return urg_err;
+	++query->inflight;
+
+	return 0;
+}
+
+//Queues a write of the rest of the message of query [idx], after a poll for
+//room to write if [wait]. Linked runs also queue the read after it.
+//Returns errno (=0 if ok)
+static int Iob_UringQueueWrite(IoBatch *iob, IobQuery *query, const size_t idx,
+                               const bool wait)
+{
+	int urg_err = Iob_UringReserve(iob, (wait ? 1u : 0u) + 1u +
+	                                    (iob->linked ? 2u : 0u));
+	if(urg_err != 0) return urg_err;
+
+	//Short messages were copied into the registered buffers
+	const char *mesg = query->mesg;
+	int buf_index = URG_NO_BUFFER;
+	if(iob->fixed && query->mesg_len <= IOB_TX_LEN)
+	{
+		mesg = Iob_TxBuffer(iob, idx);
+		buf_index = 0;
+	}
+
+	if(wait)
+	{
+		urg_err = Urg_PrepPoll(&iob->ring, query->dev->filedesc, POLLOUT, true,
+		                       IOB_DATA(idx, IOB_OP_POLL_OUT));
+		if(urg_err != 0) return urg_err;
+		++query->inflight;
+	}
+
+	urg_err = Urg_PrepWrite(&iob->ring, query->dev->filedesc,
+	                        mesg + query->sent, query->mesg_len - query->sent,
+	                        buf_index, iob->linked,
+	                        IOB_DATA(idx, IOB_OP_WRITE));
+	if(urg_err != 0) return urg_err;
+	++query->inflight;
+
+	if(iob->linked) return Iob_UringQueueRead(iob, query, idx);
+	return 0;
+}
+
+//Marks query [idx] as finished, cancelling any poll it still has queued.
+//Its requests must still complete before its buffer is reused.
+//Returns errno (=0 if ok), if the cancel could not be queued
+static int Iob_UringFinish(IoBatch *iob, IobQuery *query, const size_t idx,
+                           const int status)
+{
+	query->rx.done = true;
+	query->status = status;
+	if(query->inflight == 0) return 0;
+
+	//A write still waiting for room has its own poll to cancel
+	bool writing = query->sent < query->mesg_len;
+	int urg_err = Iob_UringReserve(iob, writing ? 2 : 1);
+	if(urg_err != 0) return urg_err;
+
+	urg_err = Urg_PrepCancel(&iob->ring, IOB_DATA(idx, IOB_OP_POLL),
+	                         IOB_DATA(idx, IOB_OP_CANCEL));
+	if(urg_err != 0) return urg_err;
+	++query->inflight;
+
+	if(writing)
+	{
+		urg_err = Urg_PrepCancel(&iob->ring, IOB_DATA(idx, IOB_OP_POLL_OUT),
+		                         IOB_DATA(idx, IOB_OP_CANCEL));
+		if(urg_err != 0) return urg_err;
+		++query->inflight;
+	}
+
+	return 0;
+}
+
+//Checks [queue_err], the result of Iob_UringQueueRead or Iob_UringQueueWrite
+//for query [idx]. A query that could not be queued is finished with the
+//error. Returns errno (=0 if ok), as Iob_UringFinish
+static int Iob_UringQueued(IoBatch *iob, IobQuery *query, const size_t idx,
+                           const int queue_err)
+{
+	if(queue_err == 0) return 0;
+	return Iob_UringFinish(iob, query, idx, queue_err);
+}
+
+//Handles the result [res] of the request [data].
+//Returns errno (=0 if ok), if the ring itself failed
+static int Iob_UringResult(IoBatch *iob, IobQuery *queries,
+                           const uint64_t data, const int32_t res,
+                           size_t *writing)
+{
+	size_t idx = (size_t)(data >> 3);
+	IobQuery *query = &queries[idx];
+	--query->inflight;
+
+	switch(data & 7)
+	{
+		case IOB_OP_WRITE:
+			--*writing;
+			if(query->rx.done) break;
+
+			//No room in the transmit buffer yet, wait for some. A short
+			//write breaks the link to the read, so the rest is queued with
+			//a new one
+			if(res == -EAGAIN || res == -EINTR)
+			{
+				++*writing;
+				return Iob_UringQueued(iob, query, idx,
+				                       Iob_UringQueueWrite(iob, query, idx,
+				                                           true));
+			}
+			if(res < 0) return Iob_UringFinish(iob, query, idx, -res);
+
+			query->sent += (size_t)res;
+			if(query->sent < query->mesg_len)
+			{
+				++*writing;
+				return Iob_UringQueued(iob, query, idx,
+				                       Iob_UringQueueWrite(iob, query, idx,
+				                                           false));
+			}
+			break;
+
+		//Only a poll that failed matters, the request linked after it is
+		//cancelled with it
+		case IOB_OP_POLL:
+		case IOB_OP_POLL_OUT:
+			if(res < 0 && res != -ECANCELED && query->rx.done == false)
+			{
+				return Iob_UringFinish(iob, query, idx, -res);
+			}
+			break;
+
+		case IOB_OP_READ:
+			if(query->rx.done || res == -ECANCELED) break;
+
+			if(res == -EAGAIN || res == -EINTR)
+			{
+				return Iob_UringQueued(iob, query, idx,
+				                       Iob_UringQueueRead(iob, query, idx));
+			}
+			if(res < 0) return Iob_UringFinish(iob, query, idx, -res);
+
+			//Readable with nothing to read is a hangup
+			if(res == 0) return Iob_UringFinish(iob, query, idx, EIO);
+
+			if(Qry_RxAdd(&query->rx, query->query,
+			             query->resp + query->rx.total, (size_t)res))
+			{
+				return Iob_UringFinish(iob, query, idx, 0);
+			}
+			return Iob_UringQueued(iob, query, idx,
+			                       Iob_UringQueueRead(iob, query, idx));
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static int Iob_RunUring(IoBatch *iob, IobQuery *queries, const size_t count)
+{
+	//With no receive delay, each read is linked straight after its write so
+	//the whole query is submitted at once
+	iob->linked = queries[0].query->rxdelay == 0;
+
+	/*** Queue every write, in registered buffers where they fit **************/
+	size_t writing = 0;
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		IobQuery *query = &queries[idx];
+		if(query->status != 0) continue;
+
+		if(iob->fixed && query->mesg_len <= IOB_TX_LEN)
+		{
+			memcpy(Iob_TxBuffer(iob, idx), query->mesg, query->mesg_len);
+		}
+
+		query->rx.done = false;
+		if(iob->linked) Qry_RxBegin(&query->rx, query->query, iob->resp_len);
+
+		++writing;
+		int iob_err = Iob_UringQueued(iob, query, idx,
+		                              Iob_UringQueueWrite(iob, query, idx,
+		                                                  false));
+		if(iob_err != 0) return iob_err;
+	}
+
+	/*** Run until every query is done and every request has completed ********/
+	bool receiving = iob->linked;
+	while(true)
+	{
+		//Without links, reads are queued once every write has completed and
+		//the receive delay has passed
+		if(receiving == false && writing == 0)
+		{
+			Tim_SleepUs(queries[0].query->rxdelay);
+			for(size_t idx = 0; idx < count; idx++)
+			{
+				IobQuery *query = &queries[idx];
+				if(query->rx.done) continue;
+
+				Qry_RxBegin(&query->rx, query->query, iob->resp_len);
+				int iob_err = Iob_UringQueued(iob, query, idx,
+				                              Iob_UringQueueRead(iob, query,
+				                                                 idx));
+				if(iob_err != 0) return iob_err;
+			}
+			receiving = true;
+		}
+
+		//Wait until the nearest deadline of any port still receiving
+		uint64_t next = TIM_NEVER;
+		bool busy = false;
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			IobQuery *query = &queries[idx];
+			if(query->inflight > 0) busy = true;
+			if(query->rx.done || receiving == false) continue;
+
+			busy = true;
+			uint64_t deadline = Qry_RxDeadline(&query->rx);
+			if(deadline < next) next = deadline;
+		}
+		if(busy == false) break;
+
+		int iob_err = Urg_Submit(&iob->ring, next, &iob->syscalls);
+		if(iob_err != 0) return iob_err;
+
+		uint64_t data;
+		int32_t res;
+		while(Urg_NextResult(&iob->ring, &data, &res))
+		{
+			iob_err = Iob_UringResult(iob, queries, data, res, &writing);
+			if(iob_err != 0) return iob_err;
+		}
+
+		//Finish every port whose deadline has passed
+		if(receiving == false) continue;
+		uint64_t now = Tim_NowUs();
+		for(size_t idx = 0; idx < count; idx++)
+		{
+			IobQuery *query = &queries[idx];
+			if(query->rx.done || Qry_RxDeadline(&query->rx) > now) continue;
+
+			iob_err = Iob_UringFinish(iob, query, idx, 0);
+			if(iob_err != 0) return iob_err;
+		}
+	}
+
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+int Iob_ParseBackend(const char *str, IobBackend *backend)
+{
+	if(strcmp(str, "poll") == 0)       *backend = IOB_POLL;
+	else if(strcmp(str, "uring") == 0) *backend = IOB_URING;
+	else if(strcmp(str, "auto") == 0)  *backend = IOB_AUTO;
+	else return -1;
+
+	return 0;
+}
+
+const char *Iob_BackendName(const IobBackend backend)
+{
+	if(backend == IOB_POLL) return "poll";
+	if(backend == IOB_URING) return "uring";
+	return "auto";
+}
+
+int Iob_Init(IoBatch *iob, const IobBackend backend, const size_t max_queries,
+             const size_t resp_len, int *uring_err)
+{
+	memset(iob, 0, sizeof(*iob));
+	iob->max_queries = max_queries;
+	iob->resp_len = resp_len;
+	iob->epfd = -1;
+	iob->ring.ring_fd = -1;
+	*uring_err = 0;
+
+	size_t bufs_len = max_queries * (resp_len + IOB_TX_LEN);
+	iob->bufs = malloc(bufs_len);
+	if(iob->bufs == NULL) return ENOMEM;
+
+	if(backend != IOB_POLL)
+	{
+		//A smaller ring only means more submissions, see Iob_UringReserve
+		size_t entries = max_queries * IOB_MAX_QUEUED;
+		if(entries > IOB_MAX_ENTRIES) entries = IOB_MAX_ENTRIES;
+
+		*uring_err = Urg_Init(&iob->ring, (unsigned int)entries);
+		if(*uring_err == 0)
+		{
+			//Registering can fail on a low RLIMIT_MEMLOCK, the ring still
+			//works without it
+			iob->backend = IOB_URING;
+			iob->fixed = Urg_RegisterBuffer(&iob->ring, iob->bufs,
+			                                bufs_len) == 0;
+			return 0;
+		}
+	}
+
+	iob->backend = IOB_POLL;
+	iob->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(iob->epfd < 0)
+	{
+		int err = errno;
+		Iob_Free(iob);
+		return err;
+	}
+
+	return 0;
+}
+
+int Iob_Run(IoBatch *iob, IobQuery *queries, const size_t count)
+{
+	if(count == 0) return 0;
+	if(count > iob->max_queries) return E2BIG;
+
+	//Delays are shared by all ports. Only the receive timeouts are per port
+	Tim_SleepUs(queries[0].query->txdelay);
+
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		IobQuery *query = &queries[idx];
+		query->resp = iob->bufs + idx * iob->resp_len;
+		query->rx.total = 0;
+		query->rx.done = true;
+		query->inflight = 0;
+		query->sent = 0;
+		if(query->status != 0) continue;
+
+		//Discard anything left over from a previous query that timed out
+		Ser_FlushInput(query->dev);
+		++iob->syscalls;
+	}
+
+	if(iob->backend == IOB_URING) return Iob_RunUring(iob, queries, count);
+	return Iob_RunPoll(iob, queries, count);
+}
+
+void Iob_Free(IoBatch *iob)
+{
+	if(iob->backend == IOB_URING) Urg_Free(&iob->ring);
+	if(iob->epfd >= 0) close(iob->epfd);
+	free(iob->bufs);
+
+	iob->bufs = NULL;
+	iob->epfd = -1;
+}
@@ -8,29 +8,44 @@
 *
 * ADBeta (c)    Version 1.5.2   18 Nov 2023
 *******************************************************************************/
-//Which sleep method to use: usleep (outdated) or nanosleep
-//#define SLEEP_MODE_USLEEP
-#define SLEEP_MODE_NANOSLEEP
-
-#if defined(SLEEP_MODE_USLEEP) && defined(SLEEP_MODE_NANOSLEEP)
-#error You must not have both usleep and nanosleep methods active at once
-#endif
-
-/******************************************************************************/
-#ifdef SLEEP_MODE_NANOSLEEP
-#include <time.h>
-#endif
-
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "serial.h"
+#include "query.h"
+#include "daemon.h"
+#include "batch.h"
+#include "fanout.h"
+#include "periodic.h"
+#include "pipeline.h"
+#include "monitor.h"
+#include "modbus.h"
+#include "escape.h"
+#include "output.h"
+#include "checksum.h"
+#include "cache.h"
+#include "bus.h"
+#include "scheduler.h"
+#include "sweep.h"
+#include "expect.h"
+#include "marker.h"
+#include "timing.h"
+#include "trace.h"
 #include "args.h"
 
-#define ARG_COUNT 10
+#define ARG_COUNT 39
+
+//Exit status when the response checksum (-ck) does not match
+#define EXIT_CHECKSUM 2
+
+//Exit status when marker n (-mk) ends the response is EXIT_MARKER + n. The
+//first marker (n = 0) exits with success instead
+#define EXIT_MARKER 10
 
 /*** String definitions *******************************************************/
 const char *const help_prompt_str = "Try 'sqirt -h' for more information.";
@@ -38,19 +53,79 @@ const char *const help_str = "\
 sqirt\tSerial Query Interface Response Tool \n\
 Sends a message to a Serial PORT, then echos its reponse to stdout\n\n\
 Basic Usage: sqirt -p [port] -m [message] [OPTIONAL]\n\
+Batch Usage: sqirt -p [port] -bf [file] [OPTIONAL]\n\
+Pipelined Usage: sqirt -p [port] -pl [file] -pt [pattern] [OPTIONAL]\n\
+Monitor Usage: sqirt -p [port] -mo [file] [OPTIONAL]\n\
+Modbus Usage: sqirt -p [port] -rtu [unit,function,address,count|values] [OPTIONAL]\n\
 Example: sqirt -p /dev/ttyUSB0 -m \"Hello World!\" -nl\n\n\
 Arguments:\n\
   -p\tWhich PORT to use (REQUIRED)\n\
   -m\tMessage to send. Use \"\" or \'\' for spaces or special characters (REQUIRED)\n\
 \n\
-  -br\tBaudrate. Valid Options: 2400, 4800, 9600, 19200, 38400, 115200 (Default: 115200)\n\
+  -br\tBaudrate. Any rate the PORT supports, e.g. 9600, 115200, 921600, 3000000 (Default: 115200)\n\
+     \tA warning is printed if the PORT cannot run at exactly this rate\n\
   -td\tDelay before Transmitting to PORT. Valid Options: 0-1000 (0.1 sec increments) (Default: 0)\n\
   -rd\tDelay before Receiving the response from PORT. Valid Options: 0-1000(0.1 sec increments) (Default:  5)\n\
-  -to\tTimeout for the PORT to respond. Valid Options: 0-255 (0.1 sec increments) (Default: 5)\n\
+  -to\tTimeout for the PORT to respond. Valid Options: 0-1000 (0.1 sec increments) (Default: 5)\n\
+  -ic\tInter Character Timeout, the longest gap allowed between received bytes (Default: 0, stop at the first gap)\n\
+  -dl\tDeadline for receiving the whole response (Default: 0, none)\n\
+     \tAll times may instead be given in milliseconds or microseconds with a ms or us suffix, e.g. -to 20ms\n\
   -bl\tBit Length of the PORT. Valid Options: 5, 6, 7, 8 (Default: 8)\n\
-  -bs\tBuffer Size of the response string (Default: 256)\n\
+  -bs\tBuffer Size used to receive the response, the response itself is not limited.\n\
+     \tLimits the response size in Batch and Fan-out modes (Default: 256)\n\
+  -tm\tTerminator. Keep receiving until this sequence arrives, \\r \\n \\t \\\\ \\xHH escapes are allowed, up to 64 bytes.\n\
+     \t-rd defaults to 0 and -ic defaults to the -to Timeout with -tm\n\
+  -mk\tMarkers. Keep receiving until any of these '|' separated sequences arrives, e.g. 'OK\\r\\n|ERROR\\r\\n'.\n\
+     \tExits 0 for the first marker and 10+N for marker N, counting from 0. Defaults as -tm\n\
+\n\
+  -dm\tRun as the sqirtd daemon, serving queries on the given SOCKET. -p and -m are not required\n\
+  -dc\tSend the query through the sqirtd daemon listening on the given SOCKET\n\
+  -pr\tPriority of a -dc query in the daemon queue. Valid Options: high, normal, bulk (Default: normal)\n\
+  -bf\tBatch mode. Sends each line of FILE (- for stdin) as a message, -m is not required\n\
+  -fo\tFan-out mode. Queries every PORT<tab>MESSAGE[<tab>TIMEOUT] line of FILE (- for stdin) at once.\n\
+     \t-p and -m are not required\n\
+  -io\tI/O backend of -fo. Valid Options: poll, uring, auto (Default: poll)\n\
+     \turing batches every write and read into one io_uring, falling back to poll if unavailable\n\
+  -ps\tPeriodic mode. Runs every PORT<tab>MESSAGE<tab>PERIOD[<tab>OFFSET] line of FILE (- for stdin)\n\
+     \tuntil Ctrl+C, keeping the ports open. -p and -m are not required, -rd defaults to 0\n\
+  -ck\tChecksum the response ends with, before the -tm Terminator. Exits with status 2 if it does not match\n\
+     \tValid Options: crc8, crc16-ccitt, crc16-xmodem, crc16-modbus, crc32, crc32c, sum8, xor8\n\
+     \tAdd :be or :le to choose the byte order\n\
+  -of\tOutput Format of the response. Valid Options: text, raw, hex, base64 (Default: text)\n\
+     \ttext adds a newline after the response, raw writes only the bytes received\n\
+  -pl\tPipelined mode. Sends each TAG<tab>MESSAGE[<tab>TIMEOUT] line of FILE (- for stdin) to PORT\n\
+     \twithout waiting for replies, matching each reply by its tag. -m is not required\n\
+  -pd\tPipeline Depth, the most queries awaiting a reply at once. Valid Options: 1-256 (Default: 8)\n\
+  -pt\tPipeline Tag pattern. Extended regex, its first group is the tag of a reply (Default: ^([^ ]+))\n\
+     \tReplies are split at the -tm Terminator (Default: \\n)\n\
+  -ap\tAddress Poll (sweep) mode. Sends -m to every address in the LIST, e.g. 1-16,20, on one open PORT.\n\
+     \t%a, %x and %b in the message are replaced by the address in decimal, hex or as a raw byte.\n\
+     \tPrints ADDRESS<tab>OK|ERR<tab>RESPONSE for each, -rd defaults to 0\n\
+  -es\tExpect mode. Runs the send/expect conversation SCRIPT (- for stdin) on one open PORT.\n\
+     \tLines are send MESG, expect PATTERN TIMEOUT [retry N|goto LABEL|exit N], sleep TIME,\n\
+     \tlabel NAME, goto NAME and exit N, tab separated. -m is not required\n\
+  -rs\tRS-485 mode, with the driver switching RTS around each message. A comma separated list of\n\
+     \trts=high|low (level while sending), before=MS, after=MS (RTS delays), echo, or off. \"\" for the defaults\n\
+  -rtu\tModbus RTU master mode. Reads: unit,function,address,count (function 1-4)\n\
+     \tWrites: unit,function,address,value[,value...] (function 5, 6, 15, 16). -m is not required\n\
+     \tValues read are printed space separated, the -to Timeout is allowed for the response to start\n\
+  -mo\tMonitor mode. Captures everything PORT sends to FILE (- for stdout) until Ctrl+C or the -mb limit.\n\
+     \t-m is optional, and sent once at the start. Bytes, rate and overrun counters go to stderr\n\
+  -mb\tMonitor Byte limit, stop after capturing this many bytes (Default: 0, no limit)\n\
+  -ti\tTiming Instrumentation. Prints the time each phase of the query finished, in microseconds,\n\
+     \tas one line to stderr. Valid Options: json, kv\n\
+  -tf\tAppend the -ti line to this FILE instead of stderr\n\
+  -ct\tCache TTL. Batch mode and the daemon reuse the response to an identical query on the same PORT\n\
+     \tfor this long, without touching the PORT. Hit and miss counters go to stderr (Default: 0, off)\n\
+  -rt\tRun with real time scheduling at this priority, 1-99, and lock memory into RAM.\n\
+     \tUsually needs root or CAP_SYS_NICE / CAP_IPC_LOCK\n\
 \nFlags:\n\
   -nl\tAppends NewLine (\"\\r\\n\") to the message automatically\n\
+  -ca\tAppends the -ck Checksum to the message, before the -nl NewLine\n\
+  -sb\tShared Bus. Waits for other sqirt processes using the PORT with -sb, and shares the response of\n\
+     \tan identical query already in progress instead of sending it again\n\
+  -ll\tLow Latency mode. Sets ASYNC_LOW_LATENCY and a 1ms USB adapter latency_timer on the PORT,\n\
+     \tif it supports them. These stay set after sqirt exits\n\
   -h\tShow this help message\n\
 \n\nSee the GitHub for more Information. <https://github.com/ADBeta/sqirt>\n\
 sqirt Version 1.4.1   (c) ADBeta Nov 2023\n";
@@ -59,11 +134,6 @@ const char *const out_of_range = "Value Out of Range:";
 const char *const invalid_num_str = "Not a Valid Numeric String:";
 
 /*** Function pre-declarations ************************************************/
-//Wait for a specified amount of Increments (0.1 seconds)
-//An old usleep implimentation and a newer nanosleep version are included for
-//devices that lack nanosleep.
-void WaitIncrement(const size_t inc);
-
 //Takes a clam_arg string and pointer to a long; sets the ptr to the numeric 
 //value of the string. Returns int error codes:
 //0    No Error
@@ -71,6 +141,30 @@ void WaitIncrement(const size_t inc);
 //-2   Value exceeded the limit value
 int GetNumericLimitedFromArg(const char *str, long *val, const long limit);
 
+//Gets a time from a clam_arg string (see Tim_ParseUs), limited to 100 seconds. Prints an error
+//message naming [flag_name] and exits if it is not valid
+uint64_t GetTimeFromArgOrExit(const char *flag_name, const char *str);
+
+//Prints a warning to stderr if the baudrate the port is running at is not the
+//one that was requested
+void ReportBaudRate(SerialDevice *dev, const unsigned int requested);
+
+//Sets the low latency options of [dev], reporting whether each one was
+//applied to stderr
+void ApplyLowLatency(SerialDevice *dev);
+
+//Sets RS-485 mode on [dev] with [conf], exiting if the driver does not
+//support it, as the bus cannot be used without direction control
+void ApplyRS485(SerialDevice *dev, const SerRS485 *conf);
+
+//Locks memory and sets real time scheduling at [priority], reporting whether
+//each one was applied to stderr
+void ApplyRealtime(const int priority);
+
+//Writes the timing instrumentation line in [format] to stderr, or appended to
+//[path] if it is not NULL
+void PrintTrace(const TrcFormat format, const char *path);
+
 //Prints an error message to stderr, then exits the program. Pass function the
 //error happened in, and the reason it happened.
 void PrintErrorAndExit(const char *pri, const char *sec, const char *ter);
@@ -78,11 +172,16 @@ void PrintErrorAndExit(const char *pri, const char *sec, const char *ter);
 /*** Main Program *************************************************************/
 int main(int argc, char *argv[])
 {
+	//All timing instrumentation phases are measured from here
+	Trc_Start();
+	
 	/*** Serial Device User Configurable Parameter Pre-definition *************/
-	unsigned int conf_baud = B115200;
-	unsigned int conf_txdelay = 0;
-	unsigned int conf_rxdelay = 5;
-	uint8_t conf_timeout = 5;
+	unsigned int conf_baud = 115200;
+	uint64_t conf_txdelay = 0;                  //All times in microseconds
+	uint64_t conf_rxdelay = TIM_INC(5);
+	uint64_t conf_timeout = TIM_INC(5);
+	uint64_t conf_interchar = 0;
+	uint64_t conf_deadline = 0;
 	unsigned int conf_bitlength = CS8;
 	size_t conf_buffersize = 256;
 	
@@ -102,11 +201,40 @@ int main(int argc, char *argv[])
 	ArgDef_t *tdel_ptr = Clam_AddDefinition(CLAM_TSTRING, "-td");
 	ArgDef_t *rdel_ptr = Clam_AddDefinition(CLAM_TSTRING, "-rd");
 	ArgDef_t *time_ptr = Clam_AddDefinition(CLAM_TSTRING, "-to");
+	ArgDef_t *ichr_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ic");
 	ArgDef_t *bits_ptr = Clam_AddDefinition(CLAM_TSTRING, "-bl");
 	ArgDef_t *buff_ptr = Clam_AddDefinition(CLAM_TSTRING, "-bs");
+	ArgDef_t *term_ptr = Clam_AddDefinition(CLAM_TSTRING, "-tm");
+	ArgDef_t *dlin_ptr = Clam_AddDefinition(CLAM_TSTRING, "-dl");
+	ArgDef_t *dmsv_ptr = Clam_AddDefinition(CLAM_TSTRING, "-dm");
+	ArgDef_t *dmcl_ptr = Clam_AddDefinition(CLAM_TSTRING, "-dc");
+	ArgDef_t *bfil_ptr = Clam_AddDefinition(CLAM_TSTRING, "-bf");
+	ArgDef_t *fout_ptr = Clam_AddDefinition(CLAM_TSTRING, "-fo");
+	ArgDef_t *csum_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ck");
+	ArgDef_t *ofmt_ptr = Clam_AddDefinition(CLAM_TSTRING, "-of");
+	ArgDef_t *pipl_ptr = Clam_AddDefinition(CLAM_TSTRING, "-pl");
+	ArgDef_t *pdep_ptr = Clam_AddDefinition(CLAM_TSTRING, "-pd");
+	ArgDef_t *ptag_ptr = Clam_AddDefinition(CLAM_TSTRING, "-pt");
+	ArgDef_t *mrtu_ptr = Clam_AddDefinition(CLAM_TSTRING, "-rtu");
+	ArgDef_t *mntr_ptr = Clam_AddDefinition(CLAM_TSTRING, "-mo");
+	ArgDef_t *mbyt_ptr = Clam_AddDefinition(CLAM_TSTRING, "-mb");
+	ArgDef_t *rtpr_ptr = Clam_AddDefinition(CLAM_TSTRING, "-rt");
+	ArgDef_t *tins_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ti");
+	ArgDef_t *tfil_ptr = Clam_AddDefinition(CLAM_TSTRING, "-tf");
+	ArgDef_t *cttl_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ct");
+	ArgDef_t *prio_ptr = Clam_AddDefinition(CLAM_TSTRING, "-pr");
+	ArgDef_t *r485_ptr = Clam_AddDefinition(CLAM_TSTRING, "-rs");
+	ArgDef_t *swep_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ap");
+	ArgDef_t *psch_ptr = Clam_AddDefinition(CLAM_TSTRING, "-ps");
+	ArgDef_t *escr_ptr = Clam_AddDefinition(CLAM_TSTRING, "-es");
+	ArgDef_t *mark_ptr = Clam_AddDefinition(CLAM_TSTRING, "-mk");
+	ArgDef_t *iobk_ptr = Clam_AddDefinition(CLAM_TSTRING, "-io");
 	
 	//Arguments that set a detected flag
 	ArgDef_t *nlin_ptr = Clam_AddDefinition(CLAM_TFLAG, "-nl");
+	ArgDef_t *lowl_ptr = Clam_AddDefinition(CLAM_TFLAG, "-ll");
+	ArgDef_t *cadd_ptr = Clam_AddDefinition(CLAM_TFLAG, "-ca");
+	ArgDef_t *sbus_ptr = Clam_AddDefinition(CLAM_TFLAG, "-sb");
 	
 	//Check the clamerr value to ensure all definitions were added
 	if(clamerr != CLAM_ENONE)
@@ -129,13 +257,48 @@ int main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 	
+	/*** Real time scheduling, applies to every mode including the daemon ****/
+	if(rtpr_ptr->detected)
+	{
+		const char* const flag_name = "Real time Priority";
+		
+		long strval = 0;
+		int ret = GetNumericLimitedFromArg(rtpr_ptr->arg_str, &strval, 99);
+		
+		if(ret == 0 && strval < 1) ret = -2;
+		if(ret == -1) PrintErrorAndExit(flag_name, rtpr_ptr->arg_str,
+		                                 invalid_num_str);
+		if(ret == -2) PrintErrorAndExit(flag_name, rtpr_ptr->arg_str,
+		                                 out_of_range);
+		
+		ApplyRealtime((int)strval);
+	}
+	
+	/*** If daemon mode was requested, serve queries until signalled **********/
+	//All serial parameters are given per query by the clients
+	if(dmsv_ptr->detected)
+	{
+		int dmn_err = Dmn_Serve(dmsv_ptr->arg_str);
+		if(dmn_err != 0)
+		{
+			PrintErrorAndExit("Daemon failed on Socket", dmsv_ptr->arg_str,
+			                  strerror(dmn_err));
+		}
+		exit(EXIT_SUCCESS);
+	}
+	
 	/*** Failsafe checks. Port and Message Must be defined ********************/
-	if(port_ptr->detected == false)
+	//Fan-out and Periodic modes get both from their list file instead
+	if(port_ptr->detected == false && fout_ptr->detected == false &&
+	   psch_ptr->detected == false)
 	{
 		PrintErrorAndExit("You must specify a port with -p", "", "");
 	}
 	
-	if(mesg_ptr->detected == false)
+	if(mesg_ptr->detected == false && bfil_ptr->detected == false &&
+	   fout_ptr->detected == false && pipl_ptr->detected == false &&
+	   mntr_ptr->detected == false && mrtu_ptr->detected == false &&
+	   psch_ptr->detected == false && escr_ptr->detected == false)
 	{
 		PrintErrorAndExit("You must specify a message with -m", "", "");
 	}
@@ -147,103 +310,93 @@ int main(int argc, char *argv[])
 		const char* const flag_name = "Baudrate";
 	
 		long strval = 0;
-		int ret = GetNumericLimitedFromArg(baud_ptr->arg_str, &strval, 115200);
+		int ret = GetNumericLimitedFromArg(baud_ptr->arg_str, &strval, 
+		                                   16000000);
 		
 		if(ret == -1) PrintErrorAndExit(flag_name, baud_ptr->arg_str,
 		                                 invalid_num_str);
 	
-		//Check input matches supported Baudrate values
-		switch(strval)
-		{
-			case 2400:
-				conf_baud = B2400;
-				break;
-			case 4800:
-				conf_baud = B4800;
-				break;
-			case 9600:
-				conf_baud = B9600;
-				break;
-			case 19200:
-				conf_baud = B19200;
-				break;
-			case 38400:
-				conf_baud = B38400;
-				break;
-			case 115200:
-				conf_baud = B115200;
-				break;
-			
-			default:
-				PrintErrorAndExit(flag_name, baud_ptr->arg_str, 
-				"Not a valid Baudrate");
-		}
+		//Any rate is accepted, rates without a standard Bxxx constant are set
+		//with termios2 when the port is opened
+		if(ret == 0 && strval < 1) ret = -2;
+		if(ret == -2) PrintErrorAndExit(flag_name, baud_ptr->arg_str,
+		                                 out_of_range);
+		
+		conf_baud = (unsigned int)strval;
 	}
 	
-	//Transmit Delay
+	//Timing. Plain values are 0.1 sec increments, or use a ms or us suffix
 	if(tdel_ptr->detected)
 	{
-		const char* const flag_name = "TX Delay";
-	
-		long strval = 0;
-		const char *arg = tdel_ptr->arg_str;
-		int ret = GetNumericLimitedFromArg(arg, &strval, 1000);
-		
-		//If any error has occured, print a message and exit (also check if 
-		//value is negative)
-		if(strval < 0) ret = -2;
-		if(ret != 0)
-		{
-			if(ret == -1) PrintErrorAndExit(flag_name, arg, invalid_num_str);
-			if(ret == -2) PrintErrorAndExit(flag_name, arg, out_of_range);
-		}
-		
-		//Otherwsie set the configuration value. Cast to unsigned int
-		conf_txdelay = (unsigned int)strval;
+		conf_txdelay = GetTimeFromArgOrExit("TX Delay", tdel_ptr->arg_str);
 	}
 	
-	//Receive Delay
 	if(rdel_ptr->detected)
 	{
-		const char* const flag_name = "RX Delay";
+		conf_rxdelay = GetTimeFromArgOrExit("RX Delay", rdel_ptr->arg_str);
+	}
 	
-		long strval = 0;
-		const char *arg = rdel_ptr->arg_str;
-		int ret = GetNumericLimitedFromArg(arg, &strval, 1000);
-		
-		//If any error has occured, print a message and exit (also check if 
-		//value is negative)
-		if(strval < 0) ret = -2;
-		if(ret != 0)
+	if(time_ptr->detected)
+	{
+		conf_timeout = GetTimeFromArgOrExit("Timeout", time_ptr->arg_str);
+	}
+	
+	if(ichr_ptr->detected)
+	{
+		conf_interchar = GetTimeFromArgOrExit("Inter Character Timeout",
+		                                      ichr_ptr->arg_str);
+	}
+	
+	if(dlin_ptr->detected)
+	{
+		conf_deadline = GetTimeFromArgOrExit("Deadline", dlin_ptr->arg_str);
+	}
+	
+	//Terminator. The receive delay is not needed when waiting for one, so it
+	//defaults to 0 unless given explicitly. The gap between bytes defaults to
+	//the Timeout, so a slow response is not cut short
+	size_t conf_term_len = 0;
+	if(term_ptr->detected)
+	{
+		conf_term_len = Esc_Decode((char *)term_ptr->arg_str);
+		if(conf_term_len == 0)
 		{
-			if(ret == -1) PrintErrorAndExit(flag_name, arg, invalid_num_str);
-			if(ret == -2) PrintErrorAndExit(flag_name, arg, out_of_range);
+			PrintErrorAndExit("Terminator", term_ptr->arg_str, "Cannot be empty");
+		}
+		if(conf_term_len > QRY_MAX_TERM_LEN)
+		{
+			PrintErrorAndExit("Terminator", term_ptr->arg_str, "Is too long");
 		}
 		
-		//Otherwsie set the configuration value. Cast to unsigned int
-		conf_rxdelay = (unsigned int)strval;
+		if(rdel_ptr->detected == false) conf_rxdelay = 0;
+		if(ichr_ptr->detected == false) conf_interchar = conf_timeout;
 	}
 	
-	//Timeout
-	if(time_ptr->detected)
+	//End Markers. Matched as the response arrives, with the same defaults as
+	//the Terminator. Only single queries report the marker found
+	MrkSet conf_markers;
+	MrkMatch marker_match;
+	if(mark_ptr->detected)
 	{
-		const char* const flag_name = "Timeout";
-	
-		long strval = 0;
-		const char *arg = time_ptr->arg_str;
-		int ret = GetNumericLimitedFromArg(arg, &strval, 255);
+		if(dmcl_ptr->detected || bfil_ptr->detected || fout_ptr->detected ||
+		   pipl_ptr->detected || mntr_ptr->detected || mrtu_ptr->detected ||
+		   swep_ptr->detected || psch_ptr->detected || escr_ptr->detected ||
+		   sbus_ptr->detected || csum_ptr->detected)
+		{
+			PrintErrorAndExit("-mk cannot be used with -dc, -bf, -fo, -pl, -mo, "
+			                  "-rtu, -ap, -ps, -es, -sb or -ck", "", "");
+		}
 		
-		//If any error has occured, print a message and exit (also check if 
-		//value is negative)
-		if(strval < 0) ret = -2;
-		if(ret != 0)
+		int mrk_err = Mrk_Parse(mark_ptr->arg_str, &conf_markers);
+		if(mrk_err != 0)
 		{
-			if(ret == -1) PrintErrorAndExit(flag_name, arg, invalid_num_str);
-			if(ret == -2) PrintErrorAndExit(flag_name, arg, out_of_range);
+			PrintErrorAndExit("Not a Valid Marker List", mark_ptr->arg_str,
+			                  mrk_err == EINVAL ? "" : strerror(mrk_err));
 		}
+		Mrk_Begin(&marker_match, &conf_markers);
 		
-		//Otherwsie set the configuration value. Cast to uint8_t
-		conf_timeout = (uint8_t)strval;
+		if(rdel_ptr->detected == false) conf_rxdelay = 0;
+		if(ichr_ptr->detected == false) conf_interchar = conf_timeout;
 	}
 	
 	//Bit Length
@@ -285,8 +438,8 @@ int main(int argc, char *argv[])
 		int ret = GetNumericLimitedFromArg(arg, &strval, (1<<16)); //64KiB
 		
 		//If any error has occured, print a message and exit (also check if 
-		//value is negative)
-		if(strval < 0) ret = -2;
+		//value is less than 1)
+		if(ret == 0 && strval < 1) ret = -2;
 		if(ret != 0)
 		{
 			if(ret == -1) PrintErrorAndExit(flag_name, arg, invalid_num_str);
@@ -297,117 +450,879 @@ int main(int argc, char *argv[])
 		conf_buffersize = (size_t)strval;
 	}
 	
-	/*** Communicate with Termios library *************************************/
-	int ser_err;
+	//Timing Instrumentation. Only single queries are traced, the phases of
+	//the other modes overlap. Through the daemon, only its queue and bus
+	//times are known
+	TrcFormat conf_trace = TRC_FMT_JSON;
+	if(tins_ptr->detected)
+	{
+		if(strcmp(tins_ptr->arg_str, "json") == 0)    conf_trace = TRC_FMT_JSON;
+		else if(strcmp(tins_ptr->arg_str, "kv") == 0) conf_trace = TRC_FMT_KV;
+		else PrintErrorAndExit("Not a Valid Timing Format", tins_ptr->arg_str,
+		                       "");
+		
+		if(bfil_ptr->detected || fout_ptr->detected || pipl_ptr->detected ||
+		   mntr_ptr->detected || mrtu_ptr->detected || swep_ptr->detected ||
+		   psch_ptr->detected || escr_ptr->detected)
+		{
+			PrintErrorAndExit("-ti cannot be used with -bf, -fo, -pl, -mo, -rtu, "
+			                  "-ap, -ps or -es", "", "");
+		}
+		
+		Trc_Enable(true);
+		Trc_Mark(TRC_PARSED);
+	}
 	
-	//Create and open a device. Error and exit if device didn't open
-	SerialDevice dev;
-	ser_err = Ser_OpenDevice(port_ptr->arg_str, &dev);
+	//Output Format
+	OutFormat conf_output = OUT_TEXT;
+	if(ofmt_ptr->detected && Out_ParseFormat(ofmt_ptr->arg_str, &conf_output) != 0)
+	{
+		PrintErrorAndExit("Not a Valid Output Format", ofmt_ptr->arg_str, "");
+	}
 	
-	if(ser_err != 0)
+	//Checksum. Only single queries are checked
+	ChkState conf_chk;
+	if(csum_ptr->detected)
 	{
-		PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
-		                  strerror(ser_err));
+		if(Chk_Begin(csum_ptr->arg_str, &conf_chk) != 0)
+		{
+			PrintErrorAndExit("Not a Valid Checksum", csum_ptr->arg_str, "");
+		}
+		
+		if(bfil_ptr->detected || fout_ptr->detected || pipl_ptr->detected ||
+		   mntr_ptr->detected || mrtu_ptr->detected || psch_ptr->detected ||
+		   escr_ptr->detected)
+		{
+			PrintErrorAndExit("-ck cannot be used with -bf, -fo, -pl, -mo, -rtu, "
+			                  "-ps or -es", "", "");
+		}
+	}
+	
+	if(cadd_ptr->detected && csum_ptr->detected == false)
+	{
+		PrintErrorAndExit("-ca needs a Checksum given with -ck", "", "");
+	}
+	
+	//RS-485 mode. The daemon, Fan-out and Periodic modes open their ports
+	//themselves
+	SerRS485 conf_rs485;
+	if(r485_ptr->detected)
+	{
+		if(Ser_ParseRS485(r485_ptr->arg_str, &conf_rs485) != 0)
+		{
+			PrintErrorAndExit("Not a Valid RS-485 Setting", r485_ptr->arg_str,
+			                  "");
+		}
+		
+		if(dmcl_ptr->detected || fout_ptr->detected || psch_ptr->detected)
+		{
+			PrintErrorAndExit("-rs cannot be used with -dc, -fo or -ps", "", "");
+		}
 	}
 	
-	//Set some known parameters of the serial device
-	dev.terminal.c_oflag = 0;            //Disable remapping, delays, etc
-	dev.terminal.c_lflag = 0;            //Disable signaling chars, echo, etc
-	Ser_SetAttr(&dev);
+	//Response Cache TTL. A single query has nothing to reuse, so only batch
+	//mode and the daemon keep a cache
+	uint64_t conf_cache_ttl = 0;
+	if(cttl_ptr->detected)
+	{
+		conf_cache_ttl = GetTimeFromArgOrExit("Cache TTL", cttl_ptr->arg_str);
+		
+		if(dmcl_ptr->detected == false && bfil_ptr->detected == false)
+		{
+			PrintErrorAndExit("-ct needs Batch mode -bf or a daemon given with -dc",
+			                  "", "");
+		}
+	}
 	
-	Ser_EnableRead(true, &dev);
-	Ser_IgnoreBreak(false, &dev);
-	Ser_SetParity(false, false, &dev);
-	Ser_TwoStopBit(false, &dev);
-	Ser_EnableSoftwareControl(false, &dev);
-	Ser_EnableHardwareControl(false, &dev);
-	Ser_SetVmin(0, &dev);
+	//Only single queries share the bus, the daemon already runs one at a time
+	if(sbus_ptr->detected && (dmcl_ptr->detected || bfil_ptr->detected ||
+	   fout_ptr->detected || pipl_ptr->detected || mntr_ptr->detected ||
+	   mrtu_ptr->detected || swep_ptr->detected || escr_ptr->detected ||
+	   psch_ptr->detected))
+	{
+		PrintErrorAndExit("-sb cannot be used with -dc, -bf, -fo, -pl, -mo, "
+		                  "-rtu, -ap, -es or -ps", "", "");
+	}
 	
-	//Set the user configured parameters
-	Ser_SetBaud(conf_baud, &dev);
-	Ser_SetBits(conf_bitlength, &dev);
-	Ser_SetVtime(conf_timeout, &dev);
+	//Daemon queue Priority
+	DmnSchedule dmn_sched = {SCH_NORMAL, 0, 0};
+	if(prio_ptr->detected)
+	{
+		if(Sch_ParseClass(prio_ptr->arg_str, &dmn_sched.priority) != 0)
+		{
+			PrintErrorAndExit("Not a Valid Priority", prio_ptr->arg_str, "");
+		}
+		
+		if(dmcl_ptr->detected == false)
+		{
+			PrintErrorAndExit("-pr needs a daemon given with -dc", "", "");
+		}
+	}
 	
-	//Wait for an amount of time specified by Transmit Delay before sending data
-	WaitIncrement(conf_txdelay);
+	/*** Build the Query Settings ********************************************/
+	PortSettings port_conf = {
+		.baud = conf_baud,
+		.bitlength = conf_bitlength
+	};
 	
-	/*** Write/Read from the Serial Device ************************************/
-	//Write the message given to the PORT. Append newline if -nl is detected	
-	ser_err = Ser_WriteBuffer(mesg_ptr->arg_str, strlen(mesg_ptr->arg_str), &dev);
-	if(nlin_ptr->detected) Ser_WriteBuffer("\r\n", 2, &dev);
+	QuerySettings query_conf;
+	Qry_DefaultQuerySettings(&query_conf);
+	query_conf.txdelay = conf_txdelay;
+	query_conf.rxdelay = conf_rxdelay;
+	query_conf.first_byte = conf_timeout;
+	query_conf.inter_char = conf_interchar;
+	query_conf.deadline = conf_deadline;
+	query_conf.cache_ttl = conf_cache_ttl;
+	if(term_ptr->detected)
+	{
+		query_conf.term = term_ptr->arg_str;
+		query_conf.term_len = conf_term_len;
+	}
+	if(mark_ptr->detected) query_conf.markers = &marker_match;
 	
-	if(ser_err != 0)
+	/*** Batch Mode. Run every message from the file on one open port *******/
+	if(bfil_ptr->detected)
 	{
-		PrintErrorAndExit("Cannot Write to Port", port_ptr->arg_str, 
-		                  strerror(ser_err));
+		if(dmcl_ptr->detected)
+		{
+			PrintErrorAndExit("Batch mode cannot be used with -dc", "", "");
+		}
+		
+		//Open the batch file, "-" means stdin
+		FILE *batch_file = stdin;
+		if(strcmp(bfil_ptr->arg_str, "-") != 0)
+		{
+			batch_file = fopen(bfil_ptr->arg_str, "r");
+			if(batch_file == NULL)
+			{
+				PrintErrorAndExit("Cannot open Batch File", bfil_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		ResponseCache cache;
+		Cch_Init(&cache);
+		
+		long failed = Bat_Run(batch_file, stdout, &dev, &port_conf, &query_conf,
+		                      nlin_ptr->detected, conf_buffersize, &cache);
+		
+		if(cttl_ptr->detected) Cch_PrintStats(&cache, stderr);
+		Cch_Free(&cache);
+		
+		Ser_CloseDevice(&dev);
+		if(batch_file != stdin) fclose(batch_file);
+		
+		if(failed < 0)
+		{
+			PrintErrorAndExit("Batch I/O Failed", bfil_ptr->arg_str,
+			                  strerror(errno));
+		}
+		
+		exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	
+	/*** Fan-out Mode. Query every port in the list file at once *************/
+	IobBackend io_backend = IOB_POLL;
+	if(iobk_ptr->detected)
+	{
+		if(Iob_ParseBackend(iobk_ptr->arg_str, &io_backend) != 0)
+		{
+			PrintErrorAndExit("Not a Valid I/O Backend", iobk_ptr->arg_str, "");
+		}
+		
+		if(fout_ptr->detected == false)
+		{
+			PrintErrorAndExit("-io can only be used with -fo", "", "");
+		}
+	}
+	
+	if(fout_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Fan-out mode cannot be used with -dc or -bf", "",
+			                  "");
+		}
+		
+		//Open the list file, "-" means stdin
+		FILE *list_file = stdin;
+		if(strcmp(fout_ptr->arg_str, "-") != 0)
+		{
+			list_file = fopen(fout_ptr->arg_str, "r");
+			if(list_file == NULL)
+			{
+				PrintErrorAndExit("Cannot open Fan-out File", fout_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		FanEntry *entries = NULL;
+		unsigned long line_num = 0;
+		long count = Fan_ReadList(list_file, &query_conf, nlin_ptr->detected,
+		                          &entries, &line_num);
+		if(list_file != stdin) fclose(list_file);
+		
+		if(count < 0)
+		{
+			char line_str[32];
+			snprintf(line_str, sizeof(line_str), "line %lu", line_num);
+			PrintErrorAndExit("Invalid Fan-out File", fout_ptr->arg_str,
+			                  line_num ? line_str : strerror(errno));
+		}
+		
+		if(count == 0)
+		{
+			PrintErrorAndExit("Fan-out File has no entries", fout_ptr->arg_str,
+			                  "");
+		}
+		
+		int uring_err = 0;
+		long failed = Fan_Run(entries, (size_t)count, &port_conf,
+		                      conf_buffersize, io_backend, &uring_err);
+		if(failed < 0)
+		{
+			PrintErrorAndExit("Fan-out Failed", "", strerror(errno));
+		}
+		
+		//auto falls back quietly, an explicit uring is worth a warning
+		if(io_backend == IOB_URING && uring_err != 0)
+		{
+			fprintf(stderr, "Warning: io_uring not available (%s), using poll\n",
+			        strerror(uring_err));
+		}
+		
+		Fan_PrintResults(entries, (size_t)count, stdout);
+		Fan_FreeList(entries, (size_t)count);
+		
+		exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	
+	/*** Periodic Mode. Run a schedule of queries until signalled ***********/
+	if(psch_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected || fout_ptr->detected)
+		{
+			PrintErrorAndExit("Periodic mode cannot be used with -dc, -bf or -fo",
+			                  "", "");
+		}
+		
+		//Open the schedule file, "-" means stdin
+		FILE *list_file = stdin;
+		if(strcmp(psch_ptr->arg_str, "-") != 0)
+		{
+			list_file = fopen(psch_ptr->arg_str, "r");
+			if(list_file == NULL)
+			{
+				PrintErrorAndExit("Cannot open Schedule File", psch_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		PerEntry *entries = NULL;
+		unsigned long line_num = 0;
+		long count = Per_ReadList(list_file, nlin_ptr->detected, &entries,
+		                          &line_num);
+		if(list_file != stdin) fclose(list_file);
+		
+		if(count < 0)
+		{
+			char line_str[32];
+			snprintf(line_str, sizeof(line_str), "line %lu", line_num);
+			PrintErrorAndExit("Invalid Schedule File", psch_ptr->arg_str,
+			                  line_num ? line_str : strerror(errno));
+		}
+		
+		if(count == 0)
+		{
+			PrintErrorAndExit("Schedule File has no entries", psch_ptr->arg_str,
+			                  "");
+		}
+		
+		//A port is busy until its response arrives, so don't wait any longer
+		//than needed before receiving unless asked
+		if(rdel_ptr->detected == false) query_conf.rxdelay = 0;
+		
+		int per_err = Per_Run(entries, (size_t)count, &port_conf, &query_conf,
+		                      conf_buffersize, stdout);
+		
+		Per_PrintStats(entries, (size_t)count, stderr);
+		Per_FreeList(entries, (size_t)count);
+		
+		if(per_err != 0)
+		{
+			PrintErrorAndExit("Periodic Mode Failed", "", strerror(per_err));
+		}
+		exit(EXIT_SUCCESS);
+	}
+	
+	/*** Pipelined Mode. Keep many tagged queries outstanding on one port ****/
+	if(pipl_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Pipelined mode cannot be used with -dc or -bf", "",
+			                  "");
+		}
+		
+		//Pipeline Depth
+		size_t conf_depth = 8;
+		if(pdep_ptr->detected)
+		{
+			long strval = 0;
+			int ret = GetNumericLimitedFromArg(pdep_ptr->arg_str, &strval,
+			                                   PIP_MAX_DEPTH);
+			
+			if(ret == 0 && strval < 1) ret = -2;
+			if(ret == -1) PrintErrorAndExit("Pipeline Depth", pdep_ptr->arg_str,
+			                                 invalid_num_str);
+			if(ret == -2) PrintErrorAndExit("Pipeline Depth", pdep_ptr->arg_str,
+			                                 out_of_range);
+			
+			conf_depth = (size_t)strval;
+		}
+		
+		//Replies are always split by a terminator, a newline by default
+		if(term_ptr->detected == false)
+		{
+			query_conf.term = "\n";
+			query_conf.term_len = 1;
+		}
+		
+		regex_t tag_re;
+		const char *pattern = ptag_ptr->detected ? ptag_ptr->arg_str : "^([^ ]+)";
+		int re_err = regcomp(&tag_re, pattern, REG_EXTENDED);
+		if(re_err != 0)
+		{
+			char re_str[128];
+			regerror(re_err, &tag_re, re_str, sizeof(re_str));
+			PrintErrorAndExit("Invalid Pipeline Tag pattern", pattern, re_str);
+		}
+		
+		//Open the list file, "-" means stdin
+		FILE *list_file = stdin;
+		if(strcmp(pipl_ptr->arg_str, "-") != 0)
+		{
+			list_file = fopen(pipl_ptr->arg_str, "r");
+			if(list_file == NULL)
+			{
+				PrintErrorAndExit("Cannot open Pipeline File", pipl_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		PipEntry *entries = NULL;
+		unsigned long line_num = 0;
+		long count = Pip_ReadList(list_file, &query_conf, nlin_ptr->detected,
+		                          &entries, &line_num);
+		if(list_file != stdin) fclose(list_file);
+		
+		if(count < 0)
+		{
+			char line_str[32];
+			snprintf(line_str, sizeof(line_str), "line %lu", line_num);
+			PrintErrorAndExit("Invalid Pipeline File", pipl_ptr->arg_str,
+			                  line_num ? line_str : strerror(errno));
+		}
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		long failed = Pip_Run(entries, (size_t)count, &dev, &query_conf,
+		                      conf_depth, &tag_re, conf_buffersize, stdout);
+		
+		Ser_CloseDevice(&dev);
+		Pip_FreeList(entries, (size_t)count);
+		regfree(&tag_re);
+		
+		if(failed < 0)
+		{
+			PrintErrorAndExit("Pipeline Failed on Port", port_ptr->arg_str,
+			                  strerror(errno));
+		}
+		
+		exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	
+	/*** Modbus RTU Mode. One request, framed by the 3.5 character silence **/
+	if(mrtu_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Modbus mode cannot be used with -dc or -bf", "", "");
+		}
+		
+		//Large enough for the values of any request, so kept off the stack
+		MbRequest *mb_req = malloc(sizeof(MbRequest));
+		MbResponse *mb_resp = malloc(sizeof(MbResponse));
+		if(mb_req == NULL || mb_resp == NULL)
+		{
+			PrintErrorAndExit("Cannot allocate Modbus Request", "", "");
+		}
+		
+		if(Mb_ParseRequest(mrtu_ptr->arg_str, mb_req) != 0)
+		{
+			PrintErrorAndExit("Not a Valid Modbus Request", mrtu_ptr->arg_str, "");
+		}
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		//Time the silence from the rate the port is really running at
+		unsigned int actual_baud = conf_baud;
+		Ser_GetBaudRate(&actual_baud, &dev);
+		
+		Tim_SleepUs(conf_txdelay);
+		int mb_err = Mb_Transact(&dev, mb_req, actual_baud, conf_timeout,
+		                         mb_resp);
+		Ser_CloseDevice(&dev);
+		
+		if(mb_err != 0)
+		{
+			PrintErrorAndExit("Modbus Request Failed on Port", port_ptr->arg_str,
+			                  strerror(mb_err));
+		}
+		
+		if(mb_resp->exception != 0)
+		{
+			char code_str[8];
+			snprintf(code_str, sizeof(code_str), "%u", mb_resp->exception);
+			PrintErrorAndExit("Modbus Exception", code_str,
+			                  Mb_ExceptionString(mb_resp->exception));
+		}
+		
+		//Print the values read, or OK for a write
+		if(mb_resp->count == 0) fputs("OK", stdout);
+		for(size_t idx = 0; idx < mb_resp->count; idx++)
+		{
+			printf(idx ? " %u" : "%u", mb_resp->values[idx]);
+		}
+		fputc('\n', stdout);
+		
+		free(mb_req);
+		free(mb_resp);
+		exit(EXIT_SUCCESS);
+	}
+	
+	/*** Monitor Mode. Capture everything the port sends ********************/
+	if(mntr_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Monitor mode cannot be used with -dc or -bf", "",
+			                  "");
+		}
+		
+		//Large chunks keep up with fast links, unless -bs is given
+		MonSettings mon_conf = {
+			.limit = 0,
+			.interval = TIM_MS(1000),
+			.chunk_len = buff_ptr->detected ? conf_buffersize : (1 << 16)
+		};
+		
+		if(mbyt_ptr->detected)
+		{
+			long strval = 0;
+			int ret = GetNumericLimitedFromArg(mbyt_ptr->arg_str, &strval,
+			                                   LONG_MAX);
+			if(ret == 0 && strval < 0) ret = -2;
+			if(ret == -1) PrintErrorAndExit("Monitor Byte limit",
+			                                 mbyt_ptr->arg_str, invalid_num_str);
+			if(ret == -2) PrintErrorAndExit("Monitor Byte limit",
+			                                 mbyt_ptr->arg_str, out_of_range);
+			
+			mon_conf.limit = (uint64_t)strval;
+		}
+		
+		//Open the capture file, "-" means stdout
+		int out_fd = STDOUT_FILENO;
+		if(strcmp(mntr_ptr->arg_str, "-") != 0)
+		{
+			out_fd = open(mntr_ptr->arg_str, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(out_fd < 0)
+			{
+				PrintErrorAndExit("Cannot open Monitor File", mntr_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		//Optionally send a message first, e.g. to start a stream
+		if(mesg_ptr->detected)
+		{
+			Tim_SleepUs(conf_txdelay);
+			ser_err = Ser_WriteBuffer(mesg_ptr->arg_str, strlen(mesg_ptr->arg_str),
+			                          &dev);
+			if(ser_err == 0 && nlin_ptr->detected)
+			{
+				ser_err = Ser_WriteBuffer("\r\n", 2, &dev);
+			}
+			
+			if(ser_err != 0)
+			{
+				PrintErrorAndExit("Cannot write to Port", port_ptr->arg_str,
+				                  strerror(ser_err));
+			}
+		}
+		
+		uint64_t total = 0;
+		int mon_err = Mon_Run(&dev, out_fd, &mon_conf, stderr, &total);
+		
+		Ser_CloseDevice(&dev);
+		if(out_fd != STDOUT_FILENO && close(out_fd) != 0 && mon_err == 0)
+		{
+			mon_err = errno;
+		}
+		
+		if(mon_err != 0)
+		{
+			PrintErrorAndExit("Monitor Failed on Port", port_ptr->arg_str,
+			                  strerror(mon_err));
+		}
+		
+		exit(EXIT_SUCCESS);
+	}
+	
+	/*** Expect Mode. Run a send/expect conversation script ****************/
+	if(escr_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Expect mode cannot be used with -dc or -bf", "", "");
+		}
+		
+		//Open the script file, "-" means stdin
+		FILE *script_file = stdin;
+		if(strcmp(escr_ptr->arg_str, "-") != 0)
+		{
+			script_file = fopen(escr_ptr->arg_str, "r");
+			if(script_file == NULL)
+			{
+				PrintErrorAndExit("Cannot open Script File", escr_ptr->arg_str,
+				                  strerror(errno));
+			}
+		}
+		
+		ExpScript script;
+		unsigned long line_num = 0;
+		int exp_ret = Exp_ReadScript(script_file, nlin_ptr->detected, &script,
+		                             &line_num);
+		if(script_file != stdin) fclose(script_file);
+		
+		if(exp_ret != 0)
+		{
+			char line_str[32];
+			snprintf(line_str, sizeof(line_str), "line %lu", line_num);
+			PrintErrorAndExit("Invalid Script File", escr_ptr->arg_str,
+			                  line_num ? line_str : strerror(errno));
+		}
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		//Only what arrives after the script starts is matched
+		Tim_SleepUs(conf_txdelay);
+		Ser_FlushInput(&dev);
+		
+		unsigned long fail_line = 0;
+		exp_ret = Exp_Run(&script, &dev, stdout, &fail_line);
+		int exp_errno = errno;
+		
+		Ser_CloseDevice(&dev);
+		Exp_FreeScript(&script);
+		
+		if(exp_ret < 0)
+		{
+			PrintErrorAndExit("Script Failed on Port", port_ptr->arg_str,
+			                  strerror(exp_errno));
+		}
+		
+		if(fail_line != 0)
+		{
+			fprintf(stderr, "Script: expect on line %lu timed out\n", fail_line);
+		}
+		exit(exp_ret);
+	}
+	
+	/*** Sweep Mode. Poll every address on a multi-drop bus ******************/
+	if(swep_ptr->detected)
+	{
+		if(dmcl_ptr->detected || bfil_ptr->detected)
+		{
+			PrintErrorAndExit("Sweep mode cannot be used with -dc or -bf", "", "");
+		}
+		
+		SwpList addr_list;
+		if(Swp_ParseList(swep_ptr->arg_str, &addr_list) != 0)
+		{
+			PrintErrorAndExit("Not a Valid Address List", swep_ptr->arg_str, "");
+		}
+		
+		//Slaves answer as soon as they can, so don't wait before receiving
+		if(rdel_ptr->detected == false) query_conf.rxdelay = 0;
+		
+		SerialDevice dev;
+		int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+		if(ser_err != 0)
+		{
+			PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+			                  strerror(ser_err));
+		}
+		ReportBaudRate(&dev, conf_baud);
+		if(lowl_ptr->detected) ApplyLowLatency(&dev);
+		if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+		
+		uint64_t sweep_start = Tim_NowUs();
+		long failed = Swp_Run(&dev, &query_conf, mesg_ptr->arg_str,
+		                      strlen(mesg_ptr->arg_str),
+		                      csum_ptr->detected ? &conf_chk : NULL,
+		                      cadd_ptr->detected, nlin_ptr->detected,
+		                      &addr_list, conf_buffersize, stdout);
+		uint64_t sweep_time = Tim_NowUs() - sweep_start;
+		
+		Ser_CloseDevice(&dev);
+		
+		if(failed < 0)
+		{
+			PrintErrorAndExit("Sweep Output Failed", "", strerror(errno));
+		}
+		
+		fprintf(stderr, "Sweep: addresses=%zu failed=%ld time=%lluus\n",
+		        addr_list.count, failed, (unsigned long long)sweep_time);
+		exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
 	
-	//Wait for an amount of time specified in rxdelay, this is to the PORT can
-	//Compute the transmitted message and be ready to transmit back
-	WaitIncrement(conf_rxdelay);
+	/*** Build the Message ***************************************************/
+	//Append the checksum if -ca is detected, then newline if -nl is detected
+	size_t mesg_len = strlen(mesg_ptr->arg_str);
+	char *mesg = malloc(mesg_len + CHK_MAX_LEN + 2);
+	if(mesg == NULL) PrintErrorAndExit("Cannot allocate Message", "", "");
 	
-	//Read the response from the Serial Port into a buffer of specified size
-	char resp_buffer[conf_buffersize];
+	memcpy(mesg, mesg_ptr->arg_str, mesg_len);
+	if(cadd_ptr->detected)
+	{
+		ChkState mesg_chk = conf_chk;
+		Chk_Update(&mesg_chk, mesg, mesg_len);
+		mesg_len += Chk_Encode(&mesg_chk, Chk_Final(&mesg_chk),
+		                       (uint8_t *)mesg + mesg_len);
+	}
 	
-	//Read from the PORT into the buffer
-	ssize_t byte_count = Ser_ReadBuffer(resp_buffer, conf_buffersize, &dev);
-	if(byte_count < 0)
+	if(nlin_ptr->detected)
 	{
-		PrintErrorAndExit("Cannot Read from Port:", port_ptr->arg_str,
-			strerror(ser_err));
+		memcpy(mesg + mesg_len, "\r\n", 2);
+		mesg_len += 2;
 	}
 	
-	//Implant a '\0' into the string so further operations can be done.
-	//If the chars read is less than the buffer, add it one past the string end
-	//If the string has filled the buffer, put it at the last char of the buffer
-	if(byte_count <= (ssize_t)conf_buffersize)
+	//The response is streamed to stdout as it arrives, through a fixed size
+	//buffer. It is on the heap to keep large buffers off small stacks
+	char *resp_buffer = malloc(conf_buffersize);
+	if(resp_buffer == NULL) PrintErrorAndExit("Cannot allocate Buffer", "", "");
+	ssize_t byte_count;
+	
+	//The -mk marker that ended the response, copied out of the marker set
+	char found_text[MRK_MAX_LEN];
+	size_t found_len = 0;
+	
+	//Written straight to the stdout fd, stdio is not used for the response
+	OutWriter resp_out;
+	Out_Init(&resp_out, STDOUT_FILENO, conf_output);
+	
+	//The checksum is checked on the way to the output
+	QuerySink resp_sink = Out_Write;
+	void *resp_ctx = &resp_out;
+	ChkStream resp_chk;
+	if(csum_ptr->detected)
 	{
-		resp_buffer[byte_count] = '\0';
-	} else 
+		Chk_StreamBegin(&resp_chk, &conf_chk, conf_term_len, Out_Write,
+		                &resp_out);
+		resp_sink = Chk_StreamSink;
+		resp_ctx = &resp_chk;
+	}
+	
+	/*** Query through the daemon if requested ********************************/
+	if(dmcl_ptr->detected)
 	{
-		resp_buffer[conf_buffersize] = '\0';
+		byte_count = Dmn_Query(dmcl_ptr->arg_str, port_ptr->arg_str, &port_conf,
+		                       &query_conf, mesg, mesg_len, resp_buffer,
+		                       conf_buffersize, resp_sink, resp_ctx, &dmn_sched);
+		Trc_SetTime(TRC_QUEUE_TIME, dmn_sched.queue_us);
+		Trc_SetTime(TRC_BUS_TIME, dmn_sched.bus_us);
+		
+		if(byte_count < 0)
+		{
+			PrintErrorAndExit("Daemon Query Failed on Port", port_ptr->arg_str,
+			                  strerror(errno));
+		}
+	} else {
+	/*** Share the bus with other sqirt processes if requested ****************/
+		BusLink bus;
+		bool shared = false;
+		if(sbus_ptr->detected)
+		{
+			int bus_err = Bus_Open(port_ptr->arg_str, &bus);
+			if(bus_err != 0)
+			{
+				PrintErrorAndExit("Cannot share the Bus of Port",
+				                  port_ptr->arg_str, strerror(bus_err));
+			}
+			
+			int shared_err = 0;
+			bus_err = Bus_Begin(&bus, &port_conf, &query_conf, mesg, mesg_len,
+			                    resp_sink, resp_ctx, &shared, &shared_err);
+			if(bus_err != 0)
+			{
+				PrintErrorAndExit("Cannot share the Bus of Port",
+				                  port_ptr->arg_str, strerror(bus_err));
+			}
+			
+			if(shared && shared_err != 0)
+			{
+				PrintErrorAndExit("Cannot Query Port:", port_ptr->arg_str,
+				                  strerror(shared_err));
+			}
+			
+			resp_sink = Bus_Sink;
+			resp_ctx = &bus;
+		}
+		
+	/*** Communicate with Termios library *************************************/
+		//Create and open a device. Error and exit if device didn't open
+		if(shared == false)
+		{
+			SerialDevice dev;
+			int ser_err = Qry_OpenPort(port_ptr->arg_str, &port_conf, &dev);
+			
+			if(ser_err != 0)
+			{
+				if(sbus_ptr->detected) Bus_End(&bus, ser_err);
+				if(mark_ptr->detected) Mrk_Free(&conf_markers);
+				PrintErrorAndExit("Cannot open Port", port_ptr->arg_str, 
+				                  strerror(ser_err));
+			}
+			ReportBaudRate(&dev, conf_baud);
+			if(lowl_ptr->detected) ApplyLowLatency(&dev);
+			if(r485_ptr->detected) ApplyRS485(&dev, &conf_rs485);
+			
+			/*** Write/Read from the Serial Device ****************************/
+			byte_count = Qry_TransactStream(&dev, &query_conf, mesg, mesg_len,
+			                   resp_buffer, conf_buffersize, resp_sink, resp_ctx);
+			int qry_err = byte_count < 0 ? errno : 0;
+			
+			Ser_CloseDevice(&dev);
+			
+			//Only the marker found is reported from here on. Keep a copy of it
+			//and free the set before anything can exit
+			if(mark_ptr->detected)
+			{
+				int marker = marker_match.marker;
+				if(marker >= 0)
+				{
+					found_len = conf_markers.len[marker];
+					memcpy(found_text, conf_markers.text[marker], found_len);
+				}
+				Mrk_Free(&conf_markers);
+			}
+			
+			//Waiting processes get the same response, or error
+			if(sbus_ptr->detected) Bus_End(&bus, qry_err);
+			
+			if(byte_count < 0)
+			{
+				PrintErrorAndExit("Cannot Query Port:", port_ptr->arg_str,
+				                  strerror(qry_err));
+			}
+		}
+		
+		if(sbus_ptr->detected) Bus_Close(&bus);
 	}
 	
-	//Print the buffer received to stdout
-	fprintf(stdout, "%s\n", resp_buffer);
-
-	//Done
-	Ser_CloseDevice(&dev);	
-	return 0;
-}
-
-/*** Function Definitions *****************************************************/
-void WaitIncrement(const size_t inc)
-{
-	if(inc == 0) return;
-
-	static size_t last_inc = 0;
+	free(mesg);
+	free(resp_buffer);
+	
+	//End the response, with a newline unless it is raw
+	int out_err = Out_Finish(&resp_out);
+	if(out_err != 0) PrintErrorAndExit("Cannot write Output", "",
+	                                   strerror(out_err));
+	
+	if(Trc_Enabled()) PrintTrace(conf_trace, tfil_ptr->arg_str);
 	
-	//(obsolute) usleep implimentation for old/badly supported devices (Onion)
-	#ifdef SLEEP_MODE_USLEEP
-	static useconds_t usec = 0;
-	if(inc != last_inc)
+	if(csum_ptr->detected)
 	{
-		usec = (useconds_t)inc * 100000;
-		last_inc = inc;
+		int chk_err = Chk_StreamResult(&resp_chk);
+		if(chk_err != 0)
+		{
+			fprintf(stderr, "Error: Checksum \'%s\' %s\n", csum_ptr->arg_str,
+			        chk_err == EBADMSG ? "does not match" : "is missing");
+			exit(EXIT_CHECKSUM);
+		}
 	}
-	usleep(usec);
-	#endif
 	
-	//nanosleep implimentation for modern systems (recommended)
-	#ifdef SLEEP_MODE_NANOSLEEP
-	static struct timespec time, rem;
-	if(inc != last_inc)
+	//Report the marker that ended the response, and exit with its status
+	if(mark_ptr->detected)
 	{
-		//Split seconds and nanoseconds
-		time.tv_sec = (long)inc / 10;
-		time.tv_nsec = ((long)inc % 10) * 100000000;
-		last_inc = inc;
+		int marker = marker_match.marker;
+		if(marker < 0)
+		{
+			fprintf(stderr, "Error: No Marker was received\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		fprintf(stderr, "Marker: %d ", marker);
+		Esc_Encode(found_text, found_len, stderr);
+		fputc('\n', stderr);
+		
+		if(marker != 0) exit(EXIT_MARKER + marker);
 	}
-	nanosleep(&time, &rem);
-	#endif
+
+	//Done
+	return 0;
 }
 
+/*** Function Definitions *****************************************************/
 int GetNumericLimitedFromArg(const char *str, long *val, const long limit)
 {
 	//Check String is valid numeric
@@ -424,6 +1339,101 @@ int GetNumericLimitedFromArg(const char *str, long *val, const long limit)
 	return 0;
 }
 
+uint64_t GetTimeFromArgOrExit(const char *flag_name, const char *str)
+{
+	uint64_t us = 0;
+	int ret = Tim_ParseUs(str, &us, TIM_INC(1000));
+	
+	if(ret == -1) PrintErrorAndExit(flag_name, str, invalid_num_str);
+	if(ret == -2) PrintErrorAndExit(flag_name, str, out_of_range);
+	
+	return us;
+}
+
+void ReportBaudRate(SerialDevice *dev, const unsigned int requested)
+{
+	unsigned int actual = 0;
+	if(Ser_GetBaudRate(&actual, dev) != 0 || actual == requested) return;
+	
+	fprintf(stderr, "Warning: Baudrate %u requested, PORT is running at %u\n",
+	        requested, actual);
+}
+
+void ApplyLowLatency(SerialDevice *dev)
+{
+	int ser_err = Ser_SetLowLatency(true, dev);
+	if(ser_err == 0)
+	{
+		fprintf(stderr, "Low Latency: ASYNC_LOW_LATENCY applied\n");
+	} else {
+		fprintf(stderr, "Low Latency: ASYNC_LOW_LATENCY not applied (%s)\n",
+		        strerror(ser_err));
+	}
+	
+	//1ms is the lowest latency_timer USB serial drivers accept
+	unsigned int old_ms = 0;
+	ser_err = Ser_GetLatencyTimer(&old_ms, dev);
+	if(ser_err == 0) ser_err = Ser_SetLatencyTimer(1, dev);
+	if(ser_err == 0)
+	{
+		fprintf(stderr, "Low Latency: latency_timer %ums -> 1ms applied\n",
+		        old_ms);
+	} else {
+		fprintf(stderr, "Low Latency: latency_timer not applied (%s)\n",
+		        strerror(ser_err));
+	}
+}
+
+void ApplyRS485(SerialDevice *dev, const SerRS485 *conf)
+{
+	int ser_err = Ser_SetRS485(conf, dev);
+	if(ser_err != 0)
+	{
+		PrintErrorAndExit("Cannot set RS-485 mode on Port", dev->filename,
+		                  strerror(ser_err));
+	}
+}
+
+void ApplyRealtime(const int priority)
+{
+	int tim_err = Tim_LockMemory();
+	if(tim_err == 0)
+	{
+		fprintf(stderr, "Real time: memory lock applied\n");
+	} else {
+		fprintf(stderr, "Real time: memory lock not applied (%s)\n",
+		        strerror(tim_err));
+	}
+	
+	tim_err = Tim_SetRealtime(priority);
+	if(tim_err == 0)
+	{
+		fprintf(stderr, "Real time: SCHED_FIFO priority %d applied\n", priority);
+	} else {
+		fprintf(stderr, "Real time: SCHED_FIFO priority %d not applied (%s)\n",
+		        priority, strerror(tim_err));
+	}
+}
+
+void PrintTrace(const TrcFormat format, const char *path)
+{
+	FILE *out = stderr;
+	if(path != NULL)
+	{
+		out = fopen(path, "a");
+		if(out == NULL)
+		{
+			PrintErrorAndExit("Cannot open Timing File", path, strerror(errno));
+		}
+	}
+	
+	int ret = Trc_Print(format, out);
+	if(out != stderr && fclose(out) != 0) ret = EOF;
+	
+	if(ret != 0) PrintErrorAndExit("Cannot write Timing File",
+	                                path ? path : "stderr", "");
+}
+
 void PrintErrorAndExit(const char *pri, const char *sec, const char *ter)
 {
 	//Always print the Primary string
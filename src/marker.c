@@ -0,0 +1,195 @@
+/*******************************************************************************
+* Marker matcher - Finds the first of several end markers in a response as it
+* is received, with an Aho-Corasick automaton.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "marker.h"
+#include "escape.h"
+
+//Transition that has not been added to the trie yet
+#define MRK_NONE UINT16_MAX
+
+/*** Private Functions ********************************************************/
+//Splits [str] on each '|' that is not escaped, decoding each marker into
+//[set]. Returns errno (=0 if ok)
+static int Mrk_Split(const char *str, MrkSet *set)
+{
+	char *buf = malloc(strlen(str) + 1);
+	if(buf == NULL) return ENOMEM;
+
+	int err = 0;
+	const char *pos = str;
+	while(err == 0)
+	{
+		//Copy one marker, keeping escapes other than "\|" for Esc_Decode
+		size_t len = 0;
+		while(*pos != '\0' && *pos != '|')
+		{
+			if(pos[0] == '\\' && pos[1] == '|') ++pos;
+			else if(pos[0] == '\\' && pos[1] != '\0') buf[len++] = *pos++;
+			buf[len++] = *pos++;
+		}
+		buf[len] = '\0';
+
+		len = Esc_Decode(buf);
+		if(len == 0 || set->count == MRK_MAX_MARKERS)
+		{
+			err = EINVAL;
+			break;
+		}
+
+		char *text = malloc(len);
+		if(text == NULL)
+		{
+			err = ENOMEM;
+			break;
+		}
+		memcpy(text, buf, len);
+
+		set->text[set->count] = text;
+		set->len[set->count++] = len;
+
+		if(*pos == '\0') break;
+		++pos;
+	}
+
+	free(buf);
+	return err;
+}
+
+//Builds the automaton of the markers in [set], with at most [max_states]
+//states. Returns errno (=0 if ok)
+static int Mrk_Build(MrkSet *set, const size_t max_states)
+{
+	set->next = malloc(max_states * 256 * sizeof(uint16_t));
+	set->found = malloc(max_states * sizeof(int8_t));
+	uint16_t *fail = malloc(max_states * sizeof(uint16_t));
+	uint16_t *queue = malloc(max_states * sizeof(uint16_t));
+	if(set->next == NULL || set->found == NULL || fail == NULL ||
+	   queue == NULL)
+	{
+		free(fail);
+		free(queue);
+		return ENOMEM;
+	}
+
+	/*** Add every marker to a trie *******************************************/
+	memset(set->next, 0xFF, max_states * 256 * sizeof(uint16_t));
+	memset(set->found, -1, max_states * sizeof(int8_t));
+	set->state_count = 1;
+
+	for(size_t idx = 0; idx < set->count; idx++)
+	{
+		uint16_t state = 0;
+		for(size_t chr = 0; chr < set->len[idx]; chr++)
+		{
+			uint16_t *next = &set->next[(size_t)state * 256 +
+			                            (unsigned char)set->text[idx][chr]];
+			if(*next == MRK_NONE) *next = (uint16_t)set->state_count++;
+			state = *next;
+		}
+
+		//The same marker given twice reports the first
+		if(set->found[state] < 0) set->found[state] = (int8_t)idx;
+	}
+
+	/*** Turn the trie into a complete state machine, breadth first ***********/
+	//A missing transition goes where the longest suffix that is also a
+	//prefix of a marker would, so a failed partial match never rescans
+	size_t head = 0, tail = 0;
+	for(size_t chr = 0; chr < 256; chr++)
+	{
+		uint16_t *next = &set->next[chr];
+		if(*next == MRK_NONE)
+		{
+			*next = 0;
+		} else {
+			fail[*next] = 0;
+			queue[tail++] = *next;
+		}
+	}
+
+	while(head < tail)
+	{
+		uint16_t state = queue[head++];
+
+		//A marker that ends inside a longer one is found at the same byte
+		if(set->found[state] < 0) set->found[state] = set->found[fail[state]];
+
+		for(size_t chr = 0; chr < 256; chr++)
+		{
+			uint16_t *next = &set->next[(size_t)state * 256 + chr];
+			uint16_t fallback = set->next[(size_t)fail[state] * 256 + chr];
+			if(*next == MRK_NONE)
+			{
+				*next = fallback;
+			} else {
+				fail[*next] = fallback;
+				queue[tail++] = *next;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+int Mrk_Parse(const char *str, MrkSet *set)
+{
+	memset(set, 0, sizeof(*set));
+
+	int err = Mrk_Split(str, set);
+
+	size_t total = 0;
+	for(size_t idx = 0; idx < set->count; idx++) total += set->len[idx];
+	if(err == 0 && total > MRK_MAX_LEN) err = EINVAL;
+
+	if(err == 0) err = Mrk_Build(set, total + 1);
+
+	if(err != 0) Mrk_Free(set);
+	return err;
+}
+
+void Mrk_Begin(MrkMatch *match, const MrkSet *set)
+{
+	match->set = set;
+	match->state = 0;
+	match->marker = -1;
+}
+
+bool Mrk_Feed(MrkMatch *match, const char *data, const size_t len)
+{
+	if(match->marker >= 0) return true;
+
+	const MrkSet *set = match->set;
+	uint16_t state = match->state;
+	for(size_t idx = 0; idx < len; idx++)
+	{
+		state = set->next[(size_t)state * 256 + (unsigned char)data[idx]];
+		if(set->found[state] >= 0)
+		{
+			match->marker = set->found[state];
+			break;
+		}
+	}
+
+	match->state = state;
+	return match->marker >= 0;
+}
+
+void Mrk_Free(MrkSet *set)
+{
+	for(size_t idx = 0; idx < set->count; idx++) free(set->text[idx]);
+	free(set->next);
+	free(set->found);
+
+	memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,353 @@
+/*******************************************************************************
+* Modbus RTU master - Encodes requests for function codes 1-6, 15 and 16,
+* performs the transaction on a SerialDevice and decodes the response.
+* The end of a response frame is found by its length as soon as that is known,
+* or by the 3.5 character silence computed from the baudrate, so a poll takes
+* the wire time plus the device time.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus.h"
+#include "checksum.h"
+#include "query.h"
+#include "serial.h"
+#include "timing.h"
+
+/*** Private Functions ********************************************************/
+static void Mb_PutU16(uint8_t *buf, const uint16_t val)
+{
+	buf[0] = (uint8_t)(val >> 8);
+	buf[1] = (uint8_t)val;
+}
+
+static uint16_t Mb_GetU16(const uint8_t *buf)
+{
+	return (uint16_t)((buf[0] << 8) | buf[1]);
+}
+
+//Returns true if [function] reads coils or discrete inputs
+static bool Mb_IsBitRead(const uint8_t function)
+{
+	return function == 1 || function == 2;
+}
+
+//Returns true if [function] reads registers
+static bool Mb_IsRegRead(const uint8_t function)
+{
+	return function == 3 || function == 4;
+}
+
+//Returns the length of the response to [req] once enough of it has arrived
+//in [frame] to tell, or 0 if that is not known yet
+static size_t Mb_ResponseLength(const MbRequest *req, const uint8_t *frame,
+                                const size_t got)
+{
+	if(got < 2) return 0;
+
+	//Exception: address, function | 0x80, code, CRC
+	if(frame[1] & 0x80) return 5;
+
+	//Reads: address, function, byte count, data, CRC
+	if(Mb_IsBitRead(req->function) || Mb_IsRegRead(req->function))
+	{
+		return got < 3 ? 0 : (size_t)frame[2] + 5;
+	}
+
+	//Writes echo the address and value or count
+	return 8;
+}
+
+/*** API Functions ************************************************************/
+uint16_t Mb_Crc16(const uint8_t *data, const size_t len)
+{
+	uint32_t crc = 0;
+	Chk_Compute("crc16-modbus", data, len, &crc);
+	return (uint16_t)crc;
+}
+
+uint64_t Mb_SilenceUs(const unsigned int baud)
+{
+	if(baud == 0 || baud > 19200) return 1750;
+
+	//3.5 characters of 11 bits each, in microseconds rounded up
+	return (38500000ULL + baud - 1) / baud;
+}
+
+int Mb_ParseRequest(const char *str, MbRequest *req)
+{
+	//unit, function, address, then the count or values
+	unsigned long fields[3 + MB_MAX_WRITE_BITS];
+	size_t field_count = 0;
+
+	const char *pos = str;
+	for(;;)
+	{
+		if(field_count >= sizeof(fields) / sizeof(fields[0])) return -1;
+
+		//Decimal, or hex with a 0x prefix. strtoul() would also take spaces,
+		//a sign, and a leading 0 as octal
+		int base = 10;
+		if(pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X'))
+		{
+			base = 16;
+			pos += 2;
+		}
+		if((base == 10 && isdigit((unsigned char)*pos) == 0) ||
+		   (base == 16 && isxdigit((unsigned char)*pos) == 0))
+		{
+			return -1;
+		}
+
+		char *end;
+		errno = 0;
+		fields[field_count] = strtoul(pos, &end, base);
+		if(errno != 0 || fields[field_count] > 0xFFFF) return -1;
+		++field_count;
+
+		if(*end == '\0') break;
+		if(*end != ',') return -1;
+		pos = end + 1;
+	}
+
+	if(field_count < 4 || fields[0] > 247) return -1;
+
+	memset(req, 0, sizeof(*req));
+	req->unit = (uint8_t)fields[0];
+	req->function = (uint8_t)fields[1];
+	req->addr = (uint16_t)fields[2];
+
+	size_t value_count = field_count - 3;
+	switch(req->function)
+	{
+		case 1: case 2: case 3: case 4:
+			if(value_count != 1) return -1;
+			req->count = (uint16_t)fields[3];
+			break;
+
+		case 5: case 6:
+			if(value_count != 1) return -1;
+			if(req->function == 5 && fields[3] > 1) return -1;
+			req->count = 1;
+			req->values[0] = (uint16_t)fields[3];
+			break;
+
+		case 15: case 16:
+			if(req->function == 16 && value_count > MB_MAX_WRITE_REGS) return -1;
+			req->count = (uint16_t)value_count;
+			for(size_t idx = 0; idx < value_count; idx++)
+			{
+				if(req->function == 15 && fields[3 + idx] > 1) return -1;
+				req->values[idx] = (uint16_t)fields[3 + idx];
+			}
+			break;
+
+		default:
+			return -1;
+	}
+
+	//Only writes may be broadcast
+	if(req->unit == 0 && req->function < 5) return -1;
+
+	uint8_t frame[MB_MAX_ADU];
+	size_t len;
+	return Mb_Encode(req, frame, &len) == 0 ? 0 : -1;
+}
+
+int Mb_Encode(const MbRequest *req, uint8_t *frame, size_t *len)
+{
+	frame[0] = req->unit;
+	frame[1] = req->function;
+	Mb_PutU16(frame + 2, req->addr);
+
+	size_t pos = 6;
+	switch(req->function)
+	{
+		case 1: case 2:
+			if(req->count < 1 || req->count > MB_MAX_READ_BITS) return EINVAL;
+			Mb_PutU16(frame + 4, req->count);
+			break;
+
+		case 3: case 4:
+			if(req->count < 1 || req->count > MB_MAX_READ_REGS) return EINVAL;
+			Mb_PutU16(frame + 4, req->count);
+			break;
+
+		case 5:
+			Mb_PutU16(frame + 4, req->values[0] ? 0xFF00 : 0x0000);
+			break;
+
+		case 6:
+			Mb_PutU16(frame + 4, req->values[0]);
+			break;
+
+		//Coils are packed 8 to a byte, the first in the lowest bit
+		case 15:
+		{
+			if(req->count < 1 || req->count > MB_MAX_WRITE_BITS) return EINVAL;
+			Mb_PutU16(frame + 4, req->count);
+
+			uint8_t byte_count = (uint8_t)((req->count + 7) / 8);
+			frame[6] = byte_count;
+			memset(frame + 7, 0, byte_count);
+			for(size_t idx = 0; idx < req->count; idx++)
+			{
+				if(req->values[idx]) frame[7 + idx / 8] |= (uint8_t)(1 << (idx % 8));
+			}
+			pos = 7 + byte_count;
+			break;
+		}
+
+		case 16:
+			if(req->count < 1 || req->count > MB_MAX_WRITE_REGS) return EINVAL;
+			Mb_PutU16(frame + 4, req->count);
+
+			frame[6] = (uint8_t)(req->count * 2);
+			for(size_t idx = 0; idx < req->count; idx++)
+			{
+				Mb_PutU16(frame + 7 + idx * 2, req->values[idx]);
+			}
+			pos = 7 + (size_t)req->count * 2;
+			break;
+
+		default:
+			return EINVAL;
+	}
+
+	//The CRC is sent low byte first
+	uint16_t crc = Mb_Crc16(frame, pos);
+	frame[pos++] = (uint8_t)crc;
+	frame[pos++] = (uint8_t)(crc >> 8);
+
+	*len = pos;
+	return 0;
+}
+
+int Mb_Decode(const MbRequest *req, const uint8_t *frame, const size_t len,
+              MbResponse *resp)
+{
+	resp->exception = 0;
+	resp->count = 0;
+
+	if(len < 5) return EBADMSG;
+
+	uint16_t crc = (uint16_t)(frame[len - 2] | (frame[len - 1] << 8));
+	if(Mb_Crc16(frame, len - 2) != crc) return EBADMSG;
+
+	if(frame[0] != req->unit) return EPROTO;
+
+	if(frame[1] == (req->function | 0x80))
+	{
+		if(len != 5) return EPROTO;
+		resp->exception = frame[2];
+		return 0;
+	}
+
+	if(frame[1] != req->function) return EPROTO;
+
+	if(Mb_IsBitRead(req->function))
+	{
+		size_t byte_count = ((size_t)req->count + 7) / 8;
+		if(frame[2] != byte_count || len != byte_count + 5) return EPROTO;
+
+		for(size_t idx = 0; idx < req->count; idx++)
+		{
+			resp->values[idx] = (frame[3 + idx / 8] >> (idx % 8)) & 1;
+		}
+		resp->count = req->count;
+		return 0;
+	}
+
+	if(Mb_IsRegRead(req->function))
+	{
+		size_t byte_count = (size_t)req->count * 2;
+		if(frame[2] != byte_count || len != byte_count + 5) return EPROTO;
+
+		for(size_t idx = 0; idx < req->count; idx++)
+		{
+			resp->values[idx] = Mb_GetU16(frame + 3 + idx * 2);
+		}
+		resp->count = req->count;
+		return 0;
+	}
+
+	//Writes echo the address, and the value (5, 6) or count (15, 16)
+	uint8_t sent[MB_MAX_ADU];
+	size_t sent_len;
+	Mb_Encode(req, sent, &sent_len);
+
+	if(len != 8 || memcmp(frame + 2, sent + 2, 4) != 0) return EPROTO;
+	return 0;
+}
+
+int Mb_Transact(SerialDevice *dev, const MbRequest *req, const unsigned int baud,
+                const uint64_t timeout, MbResponse *resp)
+{
+	uint8_t frame[MB_MAX_ADU];
+	size_t frame_len;
+
+	int mb_err = Mb_Encode(req, frame, &frame_len);
+	if(mb_err != 0) return mb_err;
+
+	//Frames must be separated by at least 3.5 characters of silence
+	uint64_t silence = Mb_SilenceUs(baud);
+	Tim_SleepUs(silence);
+	Ser_FlushInput(dev);
+
+	mb_err = Ser_WriteBuffer((const char *)frame, frame_len, dev);
+	if(mb_err != 0) return mb_err;
+
+	resp->exception = 0;
+	resp->count = 0;
+	if(req->unit == 0) return 0;
+
+	//The response must start within the timeout, and ends at a silence, or
+	//as soon as its length is known and reached
+	QuerySettings query;
+	Qry_DefaultQuerySettings(&query);
+	query.rxdelay = 0;
+	query.first_byte = timeout;
+	query.inter_char = silence;
+
+	QueryRx rx;
+	Qry_RxBegin(&rx, &query, MB_MAX_ADU);
+
+	while(rx.done == false)
+	{
+		ssize_t byte_count = Ser_ReadTimed((char *)frame + rx.total,
+		                                   MB_MAX_ADU - rx.total,
+		                                   Qry_RxDeadline(&rx), dev);
+		if(byte_count < 0) return errno;
+
+		Qry_RxAdd(&rx, &query, (char *)frame + rx.total, (size_t)byte_count);
+
+		size_t expected = Mb_ResponseLength(req, frame, rx.total);
+		if(expected != 0 && rx.total >= expected) rx.done = true;
+	}
+
+	if(rx.total == 0) return ETIMEDOUT;
+	return Mb_Decode(req, frame, rx.total, resp);
+}
+
+const char *Mb_ExceptionString(const uint8_t code)
+{
+	switch(code)
+	{
+		case 0x01: return "Illegal Function";
+		case 0x02: return "Illegal Data Address";
+		case 0x03: return "Illegal Data Value";
+		case 0x04: return "Server Device Failure";
+		case 0x05: return "Acknowledge";
+		case 0x06: return "Server Device Busy";
+		case 0x08: return "Memory Parity Error";
+		case 0x0A: return "Gateway Path Unavailable";
+		case 0x0B: return "Gateway Target Device Failed to Respond";
+		default:   return "Unknown Exception";
+	}
+}
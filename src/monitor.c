@@ -0,0 +1,268 @@
+/*******************************************************************************
+* Monitor handler - Keeps a SerialDevice open and captures everything it sends
+* to a file descriptor, until a signal, a byte limit or an error. Bytes are
+* moved with splice() where the kernel supports it, or large reads otherwise.
+* Running driver counters (see Ser_GetCounters) and the rate are written to a
+* stats stream as it runs.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //splice(), pipe2(), F_SETPIPE_SZ
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "monitor.h"
+#include "output.h"
+#include "timing.h"
+#include "serial.h"
+
+/*** Monitor State ************************************************************/
+static volatile sig_atomic_t _mon_stop = 0;
+
+typedef struct
+{
+	SerialDevice *dev;
+	int out_fd;
+	int pipe_fd[2];              //Carries spliced bytes from the port to out
+	bool use_splice;
+	OutWriter out;               //Raw writer for the read() fallback
+	char *buf;
+	size_t buf_len;
+} MonTransfer;
+
+/*** Private Functions ********************************************************/
+static void Mon_SignalHandler(int sig)
+{
+	(void)sig;
+	_mon_stop = 1;
+}
+
+//Writes what is left in the pipe to out with read()/write(), for when out
+//cannot be spliced to. Returns errno (=0 if ok)
+static int Mon_DrainPipe(MonTransfer *xfer, size_t left)
+{
+	while(left > 0)
+	{
+		size_t want = left < xfer->buf_len ? left : xfer->buf_len;
+		ssize_t got = read(xfer->pipe_fd[0], xfer->buf, want);
+		if(got < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+
+		int out_err = Out_Write(xfer->buf, (size_t)got, &xfer->out);
+		if(out_err != 0) return out_err;
+		left -= (size_t)got;
+	}
+
+	return 0;
+}
+
+//Moves up to [len] waiting bytes from the port to out.
+//Returns bytes moved, 0 if none were waiting, -1 on error (see errno)
+static ssize_t Mon_Transfer(MonTransfer *xfer, const size_t len)
+{
+	if(xfer->use_splice)
+	{
+		ssize_t got = splice(xfer->dev->filedesc, NULL, xfer->pipe_fd[1], NULL,
+		                     len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		//Not every tty driver can be spliced from, fall back to read()
+		if(got < 0 && (errno == EINVAL || errno == ENOSYS))
+		{
+			xfer->use_splice = false;
+			return Mon_Transfer(xfer, len);
+		}
+
+		if(got < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+		if(got <= 0) return got;
+
+		size_t left = (size_t)got;
+		while(left > 0)
+		{
+			ssize_t put = splice(xfer->pipe_fd[0], NULL, xfer->out_fd, NULL,
+			                     left, SPLICE_F_MOVE);
+			if(put < 0)
+			{
+				if(errno == EINTR) continue;
+
+				//Out cannot be spliced to either, copy from now on
+				if(errno == EINVAL)
+				{
+					xfer->use_splice = false;
+					int out_err = Mon_DrainPipe(xfer, left);
+					if(out_err == 0) break;
+					errno = out_err;
+				}
+
+				return -1;
+			}
+
+			left -= (size_t)put;
+		}
+
+		return got;
+	}
+
+	ssize_t got = Ser_ReadBuffer(xfer->buf, len, xfer->dev);
+	if(got <= 0) return got;
+
+	int out_err = Out_Write(xfer->buf, (size_t)got, &xfer->out);
+	if(out_err != 0)
+	{
+		errno = out_err;
+		return -1;
+	}
+
+	return got;
+}
+
+//Writes a stats line of the bytes captured, the rate since the last line and
+//the driver counters since the start
+static void Mon_PrintStats(FILE *stats, SerialDevice *dev,
+                           const SerCounters *base, const bool base_ok,
+                           const uint64_t total, const uint64_t bytes,
+                           const uint64_t us)
+{
+	double rate = us ? (double)bytes * 1e6 / (double)us : 0.0;
+	fprintf(stats, "Monitor: bytes=%llu rate=%.0f B/s",
+	        (unsigned long long)total, rate);
+
+	SerCounters now;
+	if(base_ok && Ser_GetCounters(&now, dev) == 0)
+	{
+		fprintf(stats, " overrun=%lu buf_overrun=%lu frame=%lu parity=%lu\n",
+		        now.overrun - base->overrun,
+		        now.buf_overrun - base->buf_overrun,
+		        now.frame - base->frame, now.parity - base->parity);
+	} else {
+		fprintf(stats, " overrun=n/a\n");
+	}
+
+	fflush(stats);
+}
+
+/*** API Functions ************************************************************/
+int Mon_Run(SerialDevice *dev, const int out_fd, const MonSettings *mon,
+            FILE *stats, uint64_t *total)
+{
+	*total = 0;
+
+	MonTransfer xfer = {
+		.dev = dev,
+		.out_fd = out_fd,
+		.pipe_fd = {-1, -1},
+		.use_splice = false,
+		.buf_len = mon->chunk_len
+	};
+	Out_Init(&xfer.out, out_fd, OUT_RAW);
+
+	xfer.buf = malloc(xfer.buf_len);
+	if(xfer.buf == NULL) return ENOMEM;
+
+	//Make the pipe big enough to carry a whole chunk in one splice
+	if(pipe2(xfer.pipe_fd, O_CLOEXEC) == 0)
+	{
+		fcntl(xfer.pipe_fd[1], F_SETPIPE_SZ, (int)xfer.buf_len);
+		xfer.use_splice = true;
+	}
+
+	//Stop cleanly on SIGINT or SIGTERM. Without SA_RESTART, poll() returns
+	//as soon as one arrives
+	struct sigaction sig_act, old_int, old_term;
+	memset(&sig_act, 0, sizeof(sig_act));
+	sig_act.sa_handler = Mon_SignalHandler;
+	sigemptyset(&sig_act.sa_mask);
+	sigaction(SIGINT, &sig_act, &old_int);
+	sigaction(SIGTERM, &sig_act, &old_term);
+	_mon_stop = 0;
+
+	SerCounters base;
+	bool base_ok = Ser_GetCounters(&base, dev) == 0;
+
+	uint64_t start = Tim_NowUs();
+	uint64_t last_time = start, last_total = 0;
+	uint64_t next_stats = mon->interval ? start + mon->interval : TIM_NEVER;
+
+	int mon_err = 0;
+	while(_mon_stop == 0 && (mon->limit == 0 || *total < mon->limit))
+	{
+		int timeout_ms = -1;
+		if(next_stats != TIM_NEVER)
+		{
+			timeout_ms = (int)((Tim_Remaining(next_stats) + 999) / 1000);
+		}
+
+		struct pollfd pfd = {dev->filedesc, POLLIN, 0};
+		int ret = poll(&pfd, 1, timeout_ms);
+		if(ret < 0 && errno != EINTR)
+		{
+			mon_err = errno;
+			break;
+		}
+
+		if(ret > 0)
+		{
+			//A hangup with nothing left to read would otherwise spin forever
+			if((pfd.revents & POLLIN) == 0)
+			{
+				mon_err = EIO;
+				break;
+			}
+
+			size_t want = xfer.buf_len;
+			if(mon->limit != 0 && mon->limit - *total < want)
+			{
+				want = (size_t)(mon->limit - *total);
+			}
+
+			ssize_t moved = Mon_Transfer(&xfer, want);
+			if(moved < 0)
+			{
+				mon_err = errno;
+				break;
+			}
+			*total += (uint64_t)moved;
+		}
+
+		uint64_t now = Tim_NowUs();
+		if(now >= next_stats)
+		{
+			if(stats != NULL)
+			{
+				Mon_PrintStats(stats, dev, &base, base_ok, *total,
+				               *total - last_total, now - last_time);
+			}
+
+			last_time = now;
+			last_total = *total;
+			next_stats += mon->interval;
+		}
+	}
+
+	//A final line with the average rate of the whole capture
+	if(stats != NULL)
+	{
+		Mon_PrintStats(stats, dev, &base, base_ok, *total, *total,
+		               Tim_NowUs() - start);
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	if(xfer.pipe_fd[0] >= 0)
+	{
+		close(xfer.pipe_fd[0]);
+		close(xfer.pipe_fd[1]);
+	}
+	free(xfer.buf);
+
+	return mon_err;
+}
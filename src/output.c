@@ -0,0 +1,182 @@
+/*******************************************************************************
+* Output handler - Writes a response to a file descriptor as it is streamed,
+* in raw binary, text, hex or base64. Bytes go straight to the fd with
+* write()/writev(), so every byte received is written, including 0x00, with
+* no stdio buffering or extra copies.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "output.h"
+
+//Encoded bytes are built in a buffer of this size, then written at once
+#define OUT_CHUNK_LEN 4096
+
+static const char _hex_digits[] = "0123456789abcdef";
+static const char _b64_digits[] =
+                 "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*** Private Functions ********************************************************/
+//Writes every byte of [iov_cnt] buffers in [iov] to [fd], continuing after
+//short writes. [iov] is modified. Returns errno (=0 if ok)
+static int Out_WriteAll(const int fd, struct iovec *iov, int iov_cnt)
+{
+	while(iov_cnt > 0)
+	{
+		ssize_t ret = writev(fd, iov, iov_cnt);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+
+			//A non-blocking fd is full, wait until there is room again
+			if(errno == EAGAIN)
+			{
+				struct pollfd pfd = {fd, POLLOUT, 0};
+				if(poll(&pfd, 1, -1) < 0 && errno != EINTR) return errno;
+				continue;
+			}
+
+			return errno;
+		}
+
+		//Skip the buffers that were written, and the written part of the next
+		size_t done = (size_t)ret;
+		while(iov_cnt > 0 && done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			++iov;
+			--iov_cnt;
+		}
+
+		if(iov_cnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return 0;
+}
+
+//Writes [len] bytes of [buf] to [fd]. Returns errno (=0 if ok)
+static int Out_WriteBuf(const int fd, const char *buf, const size_t len)
+{
+	struct iovec iov = {(void *)buf, len};
+	return Out_WriteAll(fd, &iov, 1);
+}
+
+//Encodes the 1 to 3 bytes of [in] as 4 base64 chars into [enc]
+static void Out_Base64Group(const unsigned char *in, const size_t len,
+                            char *enc)
+{
+	unsigned long group = (unsigned long)in[0] << 16;
+	if(len > 1) group |= (unsigned long)in[1] << 8;
+	if(len > 2) group |= in[2];
+
+	enc[0] = _b64_digits[(group >> 18) & 0x3F];
+	enc[1] = _b64_digits[(group >> 12) & 0x3F];
+	enc[2] = len > 1 ? _b64_digits[(group >> 6) & 0x3F] : '=';
+	enc[3] = len > 2 ? _b64_digits[group & 0x3F] : '=';
+}
+
+/*** API Functions ************************************************************/
+void Out_Init(OutWriter *out, const int fd, const OutFormat format)
+{
+	out->fd = fd;
+	out->format = format;
+	out->carry_len = 0;
+}
+
+int Out_ParseFormat(const char *name, OutFormat *format)
+{
+	if(strcmp(name, "text") == 0)        *format = OUT_TEXT;
+	else if(strcmp(name, "raw") == 0)    *format = OUT_RAW;
+	else if(strcmp(name, "hex") == 0)    *format = OUT_HEX;
+	else if(strcmp(name, "base64") == 0) *format = OUT_BASE64;
+	else return -1;
+
+	return 0;
+}
+
+int Out_Write(const char *data, const size_t len, void *ctx)
+{
+	OutWriter *out = ctx;
+	const unsigned char *bytes = (const unsigned char *)data;
+	char enc[OUT_CHUNK_LEN];
+	size_t enc_len = 0;
+	int out_err;
+
+	switch(out->format)
+	{
+		//The received bytes are written as they are, without a copy
+		case OUT_TEXT:
+		case OUT_RAW:
+			return Out_WriteBuf(out->fd, data, len);
+
+		case OUT_HEX:
+			for(size_t idx = 0; idx < len; idx++)
+			{
+				if(enc_len + 2 > sizeof(enc))
+				{
+					if((out_err = Out_WriteBuf(out->fd, enc, enc_len)) != 0)
+					{
+						return out_err;
+					}
+					enc_len = 0;
+				}
+
+				enc[enc_len++] = _hex_digits[bytes[idx] >> 4];
+				enc[enc_len++] = _hex_digits[bytes[idx] & 0x0F];
+			}
+			break;
+
+		//Groups of 3 bytes may be split between calls, the bytes left over
+		//are carried to the next call
+		case OUT_BASE64:
+			for(size_t idx = 0; idx < len; idx++)
+			{
+				out->carry[out->carry_len++] = bytes[idx];
+				if(out->carry_len < 3) continue;
+
+				if(enc_len + 4 > sizeof(enc))
+				{
+					if((out_err = Out_WriteBuf(out->fd, enc, enc_len)) != 0)
+					{
+						return out_err;
+					}
+					enc_len = 0;
+				}
+
+				Out_Base64Group(out->carry, 3, enc + enc_len);
+				enc_len += 4;
+				out->carry_len = 0;
+			}
+			break;
+	}
+
+	return Out_WriteBuf(out->fd, enc, enc_len);
+}
+
+int Out_Finish(OutWriter *out)
+{
+	if(out->format == OUT_RAW) return 0;
+
+	//The last partial base64 group and the newline go in one write
+	char enc[4];
+	struct iovec iov[2] = {{enc, 0}, {"\n", 1}};
+
+	if(out->format == OUT_BASE64 && out->carry_len > 0)
+	{
+		Out_Base64Group(out->carry, out->carry_len, enc);
+		iov[0].iov_len = 4;
+		out->carry_len = 0;
+	}
+
+	return Out_WriteAll(out->fd, iov, 2);
+}
@@ -0,0 +1,572 @@
+/*******************************************************************************
+* Periodic handler - Runs a schedule of queries at fixed periods from one
+* resident process, on timerfd deadlines and ports that are kept open.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "periodic.h"
+#include "escape.h"
+#include "timing.h"
+#include "query.h"
+#include "serial.h"
+
+//epoll data of a port, timers use the index of their entry
+#define PER_PORT_TAG ((uint64_t)1 << 32)
+
+/*** Periodic State ***********************************************************/
+static volatile sig_atomic_t _per_stop = 0;
+
+typedef struct
+{
+	const char *name;
+	SerialDevice dev;
+	bool open;
+
+	//The run in progress
+	PerEntry *active;            //NULL when the port is idle
+	uint64_t rx_start;           //End of the receive delay, TIM_NEVER once
+	                             //receiving
+	QueryRx rx;
+	char *resp;
+} PerPort;
+
+typedef struct
+{
+	PerEntry *entries;
+	size_t count;
+	PerPort *ports;
+	size_t port_count;
+
+	const PortSettings *port_conf;
+	const QuerySettings *query;
+	size_t resp_len;
+
+	int epfd;
+	int64_t wall_offset;         //Wall clock time minus Tim_NowUs()
+	FILE *out;
+} PerRun;
+
+/*** Private Functions ********************************************************/
+static void Per_SignalHandler(int sig)
+{
+	(void)sig;
+	_per_stop = 1;
+}
+
+//Parses one schedule line (already stripped of its line ending) into [entry].
+//Returns 0 if ok, -1 if the line is not valid
+static int Per_ParseLine(char *line, const bool newline, PerEntry *entry)
+{
+	//Split the port, message, period and optional offset fields
+	char *mesg = strchr(line, '\t');
+	if(mesg == NULL || mesg == line) return -1;
+	*mesg++ = '\0';
+
+	char *period = strchr(mesg, '\t');
+	if(period == NULL) return -1;
+	*period++ = '\0';
+
+	char *offset = strchr(period, '\t');
+	if(offset != NULL) *offset++ = '\0';
+
+	memset(entry, 0, sizeof(*entry));
+	entry->timerfd = -1;
+
+	if(Tim_ParseUs(period, &entry->period, TIM_INC(864000)) != 0 ||
+	   entry->period < PER_MIN_PERIOD) return -1;
+
+	if(offset != NULL &&
+	   Tim_ParseUs(offset, &entry->offset, TIM_INC(864000)) != 0) return -1;
+
+	size_t mesg_len = Esc_Decode(mesg);
+
+	entry->port = strdup(line);
+	entry->mesg = malloc(mesg_len + 2);
+	if(entry->port == NULL || entry->mesg == NULL)
+	{
+		free(entry->port);
+		free(entry->mesg);
+		return -1;
+	}
+
+	memcpy(entry->mesg, mesg, mesg_len);
+	if(newline)
+	{
+		memcpy(entry->mesg + mesg_len, "\r\n", 2);
+		mesg_len += 2;
+	}
+	entry->mesg_len = mesg_len;
+
+	return 0;
+}
+
+//Writes the start of a record for [entry], for a run that was due at [due]
+static void Per_PrintHeader(const PerRun *run, const PerEntry *entry,
+                            const uint64_t due)
+{
+	uint64_t wall = (uint64_t)((int64_t)due + run->wall_offset);
+
+	fprintf(run->out, "%llu.%06llu\t%lu\t%s\t",
+	        (unsigned long long)(wall / 1000000),
+	        (unsigned long long)(wall % 1000000), entry->line, entry->port);
+}
+
+static void Per_ClosePort(PerRun *run, PerPort *port)
+{
+	if(port->open == false) return;
+
+	epoll_ctl(run->epfd, EPOLL_CTL_DEL, port->dev.filedesc, NULL);
+	Ser_CloseDevice(&port->dev);
+	port->open = false;
+}
+
+//Ends the run on [port] with [status] and writes its record.
+//Nothing received, or the terminator never arriving, is a timeout
+static void Per_Finish(PerRun *run, PerPort *port, int status)
+{
+	PerEntry *entry = port->active;
+
+	if(port->rx_start == TIM_NEVER)
+	{
+		epoll_ctl(run->epfd, EPOLL_CTL_DEL, port->dev.filedesc, NULL);
+	}
+
+	bool has_term = run->query->term != NULL && run->query->term_len != 0;
+	if(status == 0 && (port->rx.total == 0 ||
+	   (has_term && port->rx.term_found == false)))
+	{
+		status = ETIMEDOUT;
+	}
+
+	Per_PrintHeader(run, entry, entry->run_due);
+	if(status != 0)
+	{
+		fprintf(run->out, "ERR\t%s\n", strerror(status));
+	} else {
+		fputs("OK\t", run->out);
+		Esc_Encode(port->resp, port->rx.total, run->out);
+		fputc('\n', run->out);
+	}
+	fflush(run->out);
+
+	++entry->runs;
+	if(status != 0) ++entry->failed;
+	entry->pending = false;
+
+	port->active = NULL;
+	port->rx_start = 0;
+}
+
+//Starts receiving the response of the run on [port]
+static void Per_BeginRx(PerRun *run, PerPort *port)
+{
+	port->rx_start = TIM_NEVER;
+	Qry_RxBegin(&port->rx, run->query, run->resp_len);
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = PER_PORT_TAG | (uint64_t)(port - run->ports)
+	};
+	if(epoll_ctl(run->epfd, EPOLL_CTL_ADD, port->dev.filedesc, &ev) != 0)
+	{
+		int err = errno;
+		port->rx_start = 0;
+		Per_Finish(run, port, err);
+	}
+}
+
+//Starts the earliest due run queued for [port], if it is idle
+static void Per_StartNext(PerRun *run, PerPort *port)
+{
+	size_t port_idx = (size_t)(port - run->ports);
+
+	while(port->active == NULL)
+	{
+		PerEntry *next = NULL;
+		for(size_t idx = 0; idx < run->count; idx++)
+		{
+			PerEntry *entry = &run->entries[idx];
+			if(entry->port_idx != port_idx || entry->pending == false) continue;
+
+			if(next == NULL || entry->run_due < next->run_due) next = entry;
+		}
+		if(next == NULL) return;
+
+		port->active = next;
+		port->rx.total = 0;
+
+		uint64_t late = Tim_NowUs() - next->run_due;
+		if(late > next->max_late) next->max_late = late;
+
+		//Ports are opened on their first run, and again after an error.
+		//The transmit delay is only needed after opening
+		int err = 0;
+		if(port->open == false)
+		{
+			err = Qry_OpenPort(port->name, run->port_conf, &port->dev);
+			if(err == 0)
+			{
+				port->open = true;
+				Tim_SleepUs(run->query->txdelay);
+			}
+		}
+
+		if(err == 0)
+		{
+			Ser_FlushInput(&port->dev);
+			err = Ser_WriteBuffer(next->mesg, next->mesg_len, &port->dev);
+			if(err != 0) Per_ClosePort(run, port);
+		}
+
+		if(err != 0)
+		{
+			Per_Finish(run, port, err);
+			continue;
+		}
+
+		if(run->query->rxdelay != 0)
+		{
+			port->rx_start = Tim_DeadlineIn(run->query->rxdelay);
+		} else {
+			Per_BeginRx(run, port);
+		}
+	}
+}
+
+//Handles the timer of [entry] expiring. Runs that came due while the entry
+//was still queued or running are missed
+static void Per_TimerFired(PerRun *run, PerEntry *entry)
+{
+	uint64_t expirations;
+	if(read(entry->timerfd, &expirations, sizeof(expirations)) !=
+	   (ssize_t)sizeof(expirations) || expirations == 0) return;
+
+	entry->due += expirations * entry->period;
+	uint64_t latest = entry->due - entry->period;
+
+	uint64_t missed = expirations;
+	if(entry->pending == false)
+	{
+		--missed;
+		entry->pending = true;
+		entry->run_due = latest;
+	}
+
+	if(missed != 0)
+	{
+		entry->missed += (unsigned long)missed;
+
+		Per_PrintHeader(run, entry, latest);
+		fprintf(run->out, "MISS\t%llu\n", (unsigned long long)missed);
+		fflush(run->out);
+	}
+
+	Per_StartNext(run, &run->ports[entry->port_idx]);
+}
+
+//Handles data, or an error, on [port]
+static void Per_PortReady(PerRun *run, PerPort *port, const uint32_t events)
+{
+	if(port->active == NULL || port->rx_start != TIM_NEVER) return;
+
+	ssize_t byte_count = Ser_ReadBuffer(port->resp + port->rx.total,
+	                                    run->resp_len - port->rx.total,
+	                                    &port->dev);
+
+	//A hangup with nothing left to read would otherwise spin forever
+	if(byte_count == 0 && (events & (EPOLLHUP | EPOLLERR)))
+	{
+		byte_count = -1;
+		errno = EIO;
+	}
+
+	if(byte_count < 0)
+	{
+		int err = errno;
+		Per_Finish(run, port, err);
+		Per_ClosePort(run, port);
+	} else if(byte_count > 0 && Qry_RxAdd(&port->rx, run->query,
+	                                      port->resp + port->rx.total,
+	                                      (size_t)byte_count)) {
+		Per_Finish(run, port, 0);
+	} else {
+		return;
+	}
+
+	Per_StartNext(run, port);
+}
+
+//Arms the timer of every entry, the first runs are due [offset] after [start]
+static int Per_ArmTimers(PerRun *run, const uint64_t start)
+{
+	for(size_t idx = 0; idx < run->count; idx++)
+	{
+		PerEntry *entry = &run->entries[idx];
+
+		entry->timerfd = timerfd_create(CLOCK_MONOTONIC,
+		                                TFD_NONBLOCK | TFD_CLOEXEC);
+		if(entry->timerfd < 0) return errno;
+
+		entry->due = start + entry->offset;
+
+		struct itimerspec spec = {
+			.it_interval.tv_sec = (time_t)(entry->period / 1000000),
+			.it_interval.tv_nsec = (long)(entry->period % 1000000) * 1000,
+			.it_value.tv_sec = (time_t)(entry->due / 1000000),
+			.it_value.tv_nsec = (long)(entry->due % 1000000) * 1000
+		};
+		if(timerfd_settime(entry->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+		{
+			return errno;
+		}
+
+		struct epoll_event ev = {.events = EPOLLIN, .data.u64 = idx};
+		if(epoll_ctl(run->epfd, EPOLL_CTL_ADD, entry->timerfd, &ev) != 0)
+		{
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+//Finds the port of every entry, entries on the same port share it.
+//Returns errno (=0 if ok)
+static int Per_SetupPorts(PerRun *run)
+{
+	run->ports = calloc(run->count, sizeof(PerPort));
+	if(run->ports == NULL) return ENOMEM;
+
+	for(size_t idx = 0; idx < run->count; idx++)
+	{
+		PerEntry *entry = &run->entries[idx];
+
+		size_t port_idx = 0;
+		while(port_idx < run->port_count &&
+		      strcmp(run->ports[port_idx].name, entry->port) != 0) ++port_idx;
+
+		if(port_idx == run->port_count)
+		{
+			PerPort *port = &run->ports[run->port_count++];
+			port->name = entry->port;
+			port->resp = malloc(run->resp_len);
+			if(port->resp == NULL) return ENOMEM;
+		}
+
+		entry->port_idx = port_idx;
+	}
+
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+long Per_ReadList(FILE *in, const bool newline, PerEntry **entries,
+                  unsigned long *line_num)
+{
+	PerEntry *list = NULL;
+	size_t count = 0;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+
+	*line_num = 0;
+	while((line_len = getline(&line, &line_size, in)) >= 0)
+	{
+		++*line_num;
+
+		//Strip the line ending, then skip empty lines and comments
+		while(line_len > 0 && (line[line_len - 1] == '\n' ||
+		                       line[line_len - 1] == '\r'))
+		{
+			line[--line_len] = '\0';
+		}
+		if(line_len == 0 || line[0] == '#') continue;
+
+		if(count >= PER_MAX_ENTRIES) goto error;
+
+		PerEntry *grown = realloc(list, (count + 1) * sizeof(PerEntry));
+		if(grown == NULL)
+		{
+			*line_num = 0;
+			goto error;
+		}
+		list = grown;
+
+		if(Per_ParseLine(line, newline, &list[count]) != 0) goto error;
+		list[count++].line = *line_num;
+	}
+
+	if(ferror(in))
+	{
+		*line_num = 0;
+		goto error;
+	}
+
+	free(line);
+	*entries = list;
+	return (long)count;
+
+error:
+	free(line);
+	Per_FreeList(list, count);
+	return -1;
+}
+
+int Per_Run(PerEntry *entries, const size_t count, const PortSettings *port,
+            const QuerySettings *query, const size_t resp_len, FILE *out)
+{
+	PerRun run = {
+		.entries = entries,
+		.count = count,
+		.port_conf = port,
+		.query = query,
+		.resp_len = resp_len,
+		.out = out
+	};
+
+	//Records are stamped with the wall clock, deadlines use the monotonic one
+	struct timespec wall_ts;
+	clock_gettime(CLOCK_REALTIME, &wall_ts);
+	uint64_t start = Tim_NowUs();
+	run.wall_offset = (int64_t)wall_ts.tv_sec * 1000000 +
+	                  wall_ts.tv_nsec / 1000 - (int64_t)start;
+
+	run.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(run.epfd < 0) return errno;
+
+	int per_err = Per_SetupPorts(&run);
+	if(per_err == 0) per_err = Per_ArmTimers(&run, start);
+
+	//Stop cleanly on SIGINT or SIGTERM. Without SA_RESTART, epoll_wait()
+	//returns as soon as one arrives
+	struct sigaction sig_act, old_int, old_term;
+	memset(&sig_act, 0, sizeof(sig_act));
+	sig_act.sa_handler = Per_SignalHandler;
+	sigemptyset(&sig_act.sa_mask);
+	sigaction(SIGINT, &sig_act, &old_int);
+	sigaction(SIGTERM, &sig_act, &old_term);
+	_per_stop = 0;
+
+	struct epoll_event events[32];
+	while(per_err == 0 && _per_stop == 0)
+	{
+		//Sleep until the nearest receive delay or deadline of any port, the
+		//timers wake the loop for everything else.
+		//Rounded up, epoll_wait() only has millisecond resolution
+		uint64_t next = TIM_NEVER;
+		for(size_t idx = 0; idx < run.port_count; idx++)
+		{
+			PerPort *crnt = &run.ports[idx];
+			if(crnt->active == NULL) continue;
+
+			uint64_t deadline = crnt->rx_start != TIM_NEVER ? crnt->rx_start
+			                                   : Qry_RxDeadline(&crnt->rx);
+			if(deadline < next) next = deadline;
+		}
+
+		int timeout_ms = -1;
+		if(next != TIM_NEVER)
+		{
+			timeout_ms = (int)((Tim_Remaining(next) + 999) / 1000);
+		}
+
+		int ev_count = epoll_wait(run.epfd, events, 32, timeout_ms);
+		if(ev_count < 0)
+		{
+			if(errno != EINTR) per_err = errno;
+			continue;
+		}
+
+		for(int ev_idx = 0; ev_idx < ev_count; ev_idx++)
+		{
+			uint64_t tag = events[ev_idx].data.u64;
+			if(tag & PER_PORT_TAG)
+			{
+				Per_PortReady(&run, &run.ports[tag & ~PER_PORT_TAG],
+				              events[ev_idx].events);
+			} else {
+				Per_TimerFired(&run, &run.entries[tag]);
+			}
+		}
+
+		//Start receiving once the receive delay is over, and finish every run
+		//whose deadline has passed
+		uint64_t now = Tim_NowUs();
+		for(size_t idx = 0; idx < run.port_count; idx++)
+		{
+			PerPort *crnt = &run.ports[idx];
+			if(crnt->active == NULL) continue;
+
+			if(crnt->rx_start != TIM_NEVER)
+			{
+				if(crnt->rx_start <= now) Per_BeginRx(&run, crnt);
+			} else if(Qry_RxDeadline(&crnt->rx) <= now) {
+				Per_Finish(&run, crnt, 0);
+			}
+
+			Per_StartNext(&run, crnt);
+		}
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		if(entries[idx].timerfd >= 0) close(entries[idx].timerfd);
+		entries[idx].timerfd = -1;
+	}
+
+	if(run.ports != NULL)
+	{
+		for(size_t idx = 0; idx < run.port_count; idx++)
+		{
+			Per_ClosePort(&run, &run.ports[idx]);
+			free(run.ports[idx].resp);
+		}
+		free(run.ports);
+	}
+
+	close(run.epfd);
+	return per_err;
+}
+
+void Per_PrintStats(const PerEntry *entries, const size_t count, FILE *out)
+{
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		const PerEntry *entry = &entries[idx];
+
+		fprintf(out, "Periodic: line=%lu port=%s runs=%lu failed=%lu missed=%lu"
+		        " max_late=%lluus\n", entry->line, entry->port, entry->runs,
+		        entry->failed, entry->missed,
+		        (unsigned long long)entry->max_late);
+	}
+
+	fflush(out);
+}
+
+void Per_FreeList(PerEntry *entries, const size_t count)
+{
+	if(entries == NULL) return;
+
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		free(entries[idx].port);
+		free(entries[idx].mesg);
+	}
+
+	free(entries);
+}
@@ -0,0 +1,341 @@
+/*******************************************************************************
+* Pipeline handler - Keeps up to a set number of queries outstanding on one
+* SerialDevice, for devices that accept a new command before answering the last
+* one and tag each reply. Replies are matched back to their query by tag, so
+* they may arrive in any order, and results are written in query order.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pipeline.h"
+#include "escape.h"
+#include "timing.h"
+#include "query.h"
+#include "serial.h"
+
+/*** Private Functions ********************************************************/
+//Parses one list line (already stripped of its line ending) into [entry].
+//Returns 0 if ok, -1 if the line is not valid
+static int Pip_ParseLine(char *line, const QuerySettings *query,
+                         const bool newline, PipEntry *entry)
+{
+	//Split the tag, message and optional timeout fields
+	char *mesg = strchr(line, '\t');
+	if(mesg == NULL || mesg == line) return -1;
+	*mesg++ = '\0';
+
+	char *timeout = strchr(mesg, '\t');
+	if(timeout != NULL) *timeout++ = '\0';
+
+	memset(entry, 0, sizeof(*entry));
+	entry->timeout = query->first_byte;
+
+	if(timeout != NULL &&
+	   Tim_ParseUs(timeout, &entry->timeout, TIM_INC(1000)) != 0)
+	{
+		return -1;
+	}
+
+	size_t mesg_len = Esc_Decode(mesg);
+
+	entry->tag = strdup(line);
+	entry->mesg = malloc(mesg_len + 2);
+	if(entry->tag == NULL || entry->mesg == NULL)
+	{
+		free(entry->tag);
+		free(entry->mesg);
+		return -1;
+	}
+
+	memcpy(entry->mesg, mesg, mesg_len);
+	if(newline)
+	{
+		memcpy(entry->mesg + mesg_len, "\r\n", 2);
+		mesg_len += 2;
+	}
+	entry->mesg_len = mesg_len;
+
+	return 0;
+}
+
+//Returns true if a query in [from] to [to] is awaiting a reply tagged [tag]
+static bool Pip_TagOutstanding(const PipEntry *entries, const size_t from,
+                               const size_t to, const char *tag)
+{
+	for(size_t idx = from; idx < to; idx++)
+	{
+		if(entries[idx].done == false && strcmp(entries[idx].tag, tag) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//Finds the outstanding query in [from] to [to] that [reply] of [len] bytes
+//belongs to, and gives the reply to it.
+//Returns true if it matched, false if the reply is discarded
+static bool Pip_MatchReply(PipEntry *entries, const size_t from,
+                           const size_t to, const regex_t *tag_re,
+                           const char *reply, const size_t len, char *scratch)
+{
+	//regexec() needs a string
+	memcpy(scratch, reply, len);
+	scratch[len] = '\0';
+
+	regmatch_t match[2];
+	if(regexec(tag_re, scratch, 2, match, 0) != 0) return false;
+
+	//Use the first group if the pattern has one, otherwise the whole match
+	regmatch_t *tag = match[1].rm_so >= 0 ? &match[1] : &match[0];
+	scratch[tag->rm_eo] = '\0';
+	const char *tag_str = scratch + tag->rm_so;
+
+	for(size_t idx = from; idx < to; idx++)
+	{
+		PipEntry *entry = &entries[idx];
+		if(entry->done || strcmp(entry->tag, tag_str) != 0) continue;
+
+		entry->resp = malloc(len);
+		if(entry->resp == NULL)
+		{
+			entry->status = ENOMEM;
+		} else {
+			memcpy(entry->resp, reply, len);
+			entry->resp_len = len;
+		}
+
+		entry->done = true;
+		return true;
+	}
+
+	return false;
+}
+
+//Writes the result record of [entry] to [out]. Returns 0 if ok, EOF on error
+static int Pip_PrintEntry(const PipEntry *entry, FILE *out)
+{
+	if(entry->status != 0)
+	{
+		fprintf(out, "%s\tERR\t%s\n", entry->tag, strerror(entry->status));
+	} else {
+		fprintf(out, "%s\tOK\t", entry->tag);
+		Esc_Encode(entry->resp, entry->resp_len, out);
+		fputc('\n', out);
+	}
+
+	//Flush each record so consumers see results as they happen
+	return fflush(out);
+}
+
+/*** API Functions ************************************************************/
+long Pip_ReadList(FILE *in, const QuerySettings *query, const bool newline,
+                  PipEntry **entries, unsigned long *line_num)
+{
+	PipEntry *list = NULL;
+	size_t count = 0;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+
+	*line_num = 0;
+	while((line_len = getline(&line, &line_size, in)) >= 0)
+	{
+		++*line_num;
+
+		//Strip the line ending, then skip empty lines and comments
+		while(line_len > 0 && (line[line_len - 1] == '\n' ||
+		                       line[line_len - 1] == '\r'))
+		{
+			line[--line_len] = '\0';
+		}
+		if(line_len == 0 || line[0] == '#') continue;
+
+		if(count >= PIP_MAX_ENTRIES) goto error;
+
+		PipEntry *grown = realloc(list, (count + 1) * sizeof(PipEntry));
+		if(grown == NULL)
+		{
+			*line_num = 0;
+			goto error;
+		}
+		list = grown;
+
+		if(Pip_ParseLine(line, query, newline, &list[count]) != 0) goto error;
+		++count;
+	}
+
+	if(ferror(in))
+	{
+		*line_num = 0;
+		goto error;
+	}
+
+	free(line);
+	*entries = list;
+	return (long)count;
+
+error:
+	free(line);
+	Pip_FreeList(list, count);
+	return -1;
+}
+
+long Pip_Run(PipEntry *entries, const size_t count, SerialDevice *dev,
+             const QuerySettings *query, const size_t depth,
+             const regex_t *tag_re, const size_t resp_len, FILE *out)
+{
+	const char *term = query->term;
+	const size_t term_len = query->term_len;
+	if(term == NULL || term_len == 0 || resp_len < term_len || depth == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	//Received bytes are gathered in [frame] until a terminator arrives
+	char *frame = malloc(resp_len);
+	char *scratch = malloc(resp_len + 1);
+	if(frame == NULL || scratch == NULL)
+	{
+		free(frame);
+		free(scratch);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t frame_len = 0;
+	bool overflowed = false;     //Discarding a reply longer than resp_len
+
+	size_t next_send = 0, next_print = 0, outstanding = 0;
+	long failed = 0;
+
+	Tim_SleepUs(query->txdelay);
+	Ser_FlushInput(dev);
+
+	while(next_print < count)
+	{
+		/*** Keep the pipeline full *******************************************/
+		//A tag that is still outstanding is not reused, or its reply would be
+		//ambiguous, so sending waits for it instead
+		while(next_send < count && outstanding < depth &&
+		      !Pip_TagOutstanding(entries, next_print, next_send,
+		                          entries[next_send].tag))
+		{
+			PipEntry *entry = &entries[next_send];
+
+			int ser_err = Ser_WriteBuffer(entry->mesg, entry->mesg_len, dev);
+			if(ser_err != 0)
+			{
+				errno = ser_err;
+				goto error;
+			}
+
+			entry->sent = true;
+			entry->deadline = Tim_NowUs() + entry->timeout;
+			++outstanding;
+			++next_send;
+		}
+
+		/*** Write every result that is ready, in order ***********************/
+		while(next_print < next_send && entries[next_print].done)
+		{
+			if(entries[next_print].status != 0) ++failed;
+			if(Pip_PrintEntry(&entries[next_print], out) != 0) goto error;
+			++next_print;
+		}
+		if(next_print >= count) break;
+
+		/*** Receive until the nearest reply is due ***************************/
+		uint64_t next = TIM_NEVER;
+		for(size_t idx = next_print; idx < next_send; idx++)
+		{
+			if(entries[idx].done == false && entries[idx].deadline < next)
+			{
+				next = entries[idx].deadline;
+			}
+		}
+
+		//A hangup (EIO) stops the run, no outstanding reply can arrive after it
+		ssize_t byte_count = Ser_ReadTimed(frame + frame_len,
+		                                   resp_len - frame_len, next, dev);
+		if(byte_count < 0) goto error;
+
+		//Split off every complete reply. Only the new bytes, and the end of
+		//the old ones a terminator could have started in, are searched
+		size_t search = frame_len > term_len - 1 ? frame_len - (term_len - 1)
+		                                         : 0;
+		frame_len += (size_t)byte_count;
+
+		char *end;
+		while((end = memmem(frame + search, frame_len - search, term,
+		                    term_len)) != NULL)
+		{
+			size_t reply_len = (size_t)(end - frame) + term_len;
+
+			if(overflowed == false &&
+			   Pip_MatchReply(entries, next_print, next_send, tag_re,
+			                  frame, reply_len, scratch))
+			{
+				--outstanding;
+			}
+			overflowed = false;
+
+			frame_len -= reply_len;
+			memmove(frame, frame + reply_len, frame_len);
+			search = 0;
+		}
+
+		//A reply too long for the buffer cannot be matched. Discard it up to
+		//its terminator, keeping the bytes that may be the start of one
+		if(frame_len == resp_len)
+		{
+			size_t keep = term_len - 1;
+			memmove(frame, frame + frame_len - keep, keep);
+			frame_len = keep;
+			overflowed = true;
+		}
+
+		/*** Time out every query whose reply is overdue **********************/
+		uint64_t now = Tim_NowUs();
+		for(size_t idx = next_print; idx < next_send; idx++)
+		{
+			PipEntry *entry = &entries[idx];
+			if(entry->done || entry->deadline > now) continue;
+
+			entry->status = ETIMEDOUT;
+			entry->done = true;
+			--outstanding;
+		}
+	}
+
+	free(frame);
+	free(scratch);
+	return failed;
+
+error:
+	free(frame);
+	free(scratch);
+	return -1;
+}
+
+void Pip_FreeList(PipEntry *entries, const size_t count)
+{
+	if(entries == NULL) return;
+
+	for(size_t idx = 0; idx < count; idx++)
+	{
+		free(entries[idx].tag);
+		free(entries[idx].mesg);
+		free(entries[idx].resp);
+	}
+
+	free(entries);
+}
@@ -0,0 +1,287 @@
+/*******************************************************************************
+* Query handler - Configures a SerialDevice and performs a single transmit then
+* receive transaction on it. Shared by the sqirt command line and the daemon
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <termios.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "query.h"
+#include "serial.h"
+#include "timing.h"
+#include "trace.h"
+
+/*** Private Functions ********************************************************/
+//Searches [buf] of length [len] for the sequence [seq], starting at [from].
+//Returns true if the sequence was found
+static bool Qry_ContainsSequence(const char *buf, const size_t len,
+                         size_t from, const char *seq, const size_t seq_len)
+{
+	if(seq_len == 0 || len < seq_len) return false;
+
+	for( ; from <= len - seq_len; from++)
+	{
+		if(memcmp(buf + from, seq, seq_len) == 0) return true;
+	}
+
+	return false;
+}
+
+//Sets the user configurable settings of a port, without applying them.
+//Returns errno (=0 if ok)
+static int Qry_SetPortSettings(const PortSettings *port, SerialDevice *dev)
+{
+	int ser_err;
+
+	if((ser_err = Ser_SetBaudRate(port->baud, dev)) != 0) return ser_err;
+	return Ser_SetBits(port->bitlength, dev);
+}
+
+//Waits txdelay, transmits [mesg] then waits rxdelay.
+//Returns 0 if ok, -1 if an error occured. See errno
+static int Qry_Transmit(SerialDevice *dev, const QuerySettings *query,
+                        const char *mesg, const size_t mesg_len)
+{
+	//Wait for an amount of time specified by Transmit Delay before sending data
+	Tim_SleepUs(query->txdelay);
+	Trc_Mark(TRC_TX_DELAY);
+
+	//Discard anything left over from a previous query that timed out, so it
+	//is not mistaken for the start of this response
+	Ser_FlushInput(dev);
+
+	int ser_err = Ser_WriteBuffer(mesg, mesg_len, dev);
+
+	//When tracing, wait for the message to leave the port so the time it
+	//takes to transmit can be told apart from the response time
+	if(ser_err == 0 && Trc_Enabled())
+	{
+		ser_err = Ser_Drain(dev);
+		Trc_Mark(TRC_WRITTEN);
+	}
+
+	if(ser_err != 0)
+	{
+		errno = ser_err;
+		return -1;
+	}
+
+	//Wait for an amount of time specified in rxdelay, this is to the PORT can
+	//Compute the transmitted message and be ready to transmit back
+	Tim_SleepUs(query->rxdelay);
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+void Qry_DefaultPortSettings(PortSettings *port)
+{
+	port->baud = 115200;
+	port->bitlength = CS8;
+}
+
+void Qry_DefaultQuerySettings(QuerySettings *query)
+{
+	query->txdelay = 0;
+	query->rxdelay = TIM_INC(5);
+	query->first_byte = TIM_INC(5);
+	query->inter_char = 0;
+	query->deadline = 0;
+	query->term = NULL;
+	query->term_len = 0;
+	query->markers = NULL;
+	query->cache_ttl = 0;
+}
+
+int Qry_OpenPort(const char *filename, const PortSettings *port,
+                 SerialDevice *dev)
+{
+	int ser_err = Ser_OpenDevice(filename, dev);
+	if(ser_err != 0) return ser_err;
+
+	//Collect every setting, then apply them with a single tcsetattr
+	Ser_BeginConfig(dev);
+
+	//Set some known parameters of the serial device
+	dev->terminal.c_oflag = 0;            //Disable remapping, delays, etc
+	dev->terminal.c_lflag = 0;            //Disable signaling chars, echo, etc
+
+	Ser_EnableRead(true, dev);
+	Ser_IgnoreBreak(false, dev);
+	Ser_SetParity(false, false, dev);
+	Ser_TwoStopBit(false, dev);
+	Ser_EnableSoftwareControl(false, dev);
+	Ser_EnableHardwareControl(false, dev);
+	Ser_SetVmin(0, dev);
+	Ser_SetVtime(0, dev);
+
+	ser_err = Qry_SetPortSettings(port, dev);
+	if(ser_err != 0)
+	{
+		dev->defer_attr = false;
+		Ser_CloseDevice(dev);
+		return ser_err;
+	}
+
+	ser_err = Ser_CommitConfig(dev);
+	if(ser_err != 0) Ser_CloseDevice(dev);
+	else Trc_Mark(TRC_CONFIGURED);
+
+	return ser_err;
+}
+
+int Qry_ApplyPortSettings(const PortSettings *port, SerialDevice *dev)
+{
+	Ser_BeginConfig(dev);
+
+	int ser_err = Qry_SetPortSettings(port, dev);
+	if(ser_err != 0)
+	{
+		//Put the stored termios data back to what the port is using
+		dev->defer_attr = false;
+		Ser_GetAttr(dev);
+		return ser_err;
+	}
+
+	return Ser_CommitConfig(dev);
+}
+
+ssize_t Qry_Transact(SerialDevice *dev, const QuerySettings *query,
+                     const char *mesg, const size_t mesg_len,
+                     char *resp, const size_t resp_len)
+{
+	if(Qry_Transmit(dev, query, mesg, mesg_len) != 0) return -1;
+
+	//Read until the terminator is received, the response buffer is full, the
+	//overall deadline passes, or the first byte/inter character timeout runs out
+	QueryRx rx;
+	Qry_RxBegin(&rx, query, resp_len);
+
+	while(rx.done == false)
+	{
+		ssize_t byte_count = Ser_ReadTimed(resp + rx.total, resp_len - rx.total,
+		                                   Qry_RxDeadline(&rx), dev);
+		if(byte_count < 0) return -1;
+
+		Qry_RxAdd(&rx, query, resp + rx.total, (size_t)byte_count);
+	}
+
+	return (ssize_t)rx.total;
+}
+
+ssize_t Qry_TransactStream(SerialDevice *dev, const QuerySettings *query,
+                           const char *mesg, const size_t mesg_len,
+                           char *buf, const size_t buf_len,
+                           QuerySink sink, void *ctx)
+{
+	if(Qry_Transmit(dev, query, mesg, mesg_len) != 0) return -1;
+
+	//The same receive rules as Qry_Transact, without a size limit. Each chunk
+	//is handed to the sink, then the buffer is reused
+	QueryRx rx;
+	Qry_RxBegin(&rx, query, 0);
+
+	while(rx.done == false)
+	{
+		ssize_t byte_count = Ser_ReadTimed(buf, buf_len, Qry_RxDeadline(&rx),
+		                                   dev);
+		if(byte_count < 0) return -1;
+
+		Qry_RxAdd(&rx, query, buf, (size_t)byte_count);
+
+		int sink_err;
+		if(byte_count > 0 && (sink_err = sink(buf, (size_t)byte_count, ctx)) != 0)
+		{
+			errno = sink_err;
+			return -1;
+		}
+	}
+
+	return (ssize_t)rx.total;
+}
+
+void Qry_RxBegin(QueryRx *rx, const QuerySettings *query, const size_t limit)
+{
+	rx->end = Tim_DeadlineIn(query->deadline);
+	rx->wait_end = query->first_byte ? Tim_DeadlineIn(query->first_byte)
+	                                 : Tim_NowUs();
+	rx->total = 0;
+	rx->limit = limit;
+	rx->tail_len = 0;
+	rx->term_found = false;
+	rx->done = false;
+
+	if(query->markers != NULL)
+	{
+		Mrk_Begin(query->markers, query->markers->set);
+	}
+}
+
+uint64_t Qry_RxDeadline(const QueryRx *rx)
+{
+	return rx->wait_end < rx->end ? rx->wait_end : rx->end;
+}
+
+bool Qry_RxAdd(QueryRx *rx, const QuerySettings *query, const char *data,
+               const size_t len)
+{
+	if(len == 0)
+	{
+		rx->done = true;
+		return true;
+	}
+
+	rx->total += len;
+
+	size_t term_len = query->term_len;
+	if(query->term != NULL && term_len != 0 && term_len <= QRY_MAX_TERM_LEN)
+	{
+		//Check for a terminator split between the kept tail and the new data,
+		//then for one entirely inside the new data
+		char joined[(QRY_MAX_TERM_LEN - 1) * 2];
+		size_t head_len = len < term_len - 1 ? len : term_len - 1;
+		memcpy(joined, rx->tail, rx->tail_len);
+		memcpy(joined + rx->tail_len, data, head_len);
+
+		if(Qry_ContainsSequence(joined, rx->tail_len + head_len, 0,
+		                        query->term, term_len) ||
+		   Qry_ContainsSequence(data, len, 0, query->term, term_len))
+		{
+			rx->term_found = true;
+		}
+
+		//Keep the last (term_len - 1) bytes received for the next check
+		size_t keep = term_len - 1;
+		if(len >= keep)
+		{
+			memcpy(rx->tail, data + len - keep, keep);
+			rx->tail_len = keep;
+		} else {
+			size_t old_keep = rx->tail_len + len > keep ? keep - len
+			                                            : rx->tail_len;
+			memmove(rx->tail, rx->tail + rx->tail_len - old_keep, old_keep);
+			memcpy(rx->tail + old_keep, data, len);
+			rx->tail_len = old_keep + len;
+		}
+	}
+
+	//Markers are matched as they arrive, the state carries across reads
+	if(query->markers != NULL && Mrk_Feed(query->markers, data, len))
+	{
+		rx->done = true;
+	}
+
+	if(rx->term_found || (rx->limit != 0 && rx->total >= rx->limit))
+	{
+		rx->done = true;
+	}
+
+	//The gap to the next byte is timed from this one. With no inter
+	//character timeout, only bytes that are already waiting are read
+	rx->wait_end = query->inter_char ? Tim_DeadlineIn(query->inter_char)
+	                                 : Tim_NowUs();
+	return rx->done;
+}
@@ -0,0 +1,165 @@
+/*******************************************************************************
+* Request scheduler - Orders queued requests for a shared bus by priority
+* class, so urgent queries are not stuck behind bulk transfers.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <string.h>
+#include <errno.h>
+
+#include "scheduler.h"
+#include "timing.h"
+
+/*** Private Variables ********************************************************/
+static const char *const _sch_names[SCH_CLASS_COUNT] = {
+	"high", "normal", "bulk"
+};
+
+/*** Private Functions ********************************************************/
+//Returns the class [entry] is treated as after waiting until [now]
+static SchClass Sch_AgedClass(const Scheduler *sched, const SchEntry *entry,
+                              const uint64_t now)
+{
+	SchClass class = entry->class;
+	uint64_t wait = now - entry->queued;
+
+	while(class > SCH_HIGH && sched->conf[class].age != 0 &&
+	      wait >= sched->conf[class].age)
+	{
+		wait -= sched->conf[class].age;
+		class = (SchClass)(class - 1);
+	}
+
+	return class;
+}
+
+//Removes entry [idx] from the queue, returning its item
+static void *Sch_Remove(Scheduler *sched, const size_t idx, SchClass *class,
+                        uint64_t *wait, const uint64_t now)
+{
+	SchEntry *entry = &sched->entries[idx];
+	void *item = entry->item;
+	*class = entry->class;
+	*wait = now - entry->queued;
+
+	//Order is kept by seq, so the last entry can simply fill the gap
+	sched->entries[idx] = sched->entries[--sched->count];
+	return item;
+}
+
+/*** API Functions ************************************************************/
+void Sch_Init(Scheduler *sched)
+{
+	memset(sched, 0, sizeof(*sched));
+
+	sched->conf[SCH_HIGH].deadline = TIM_INC(10);
+	sched->conf[SCH_NORMAL].deadline = TIM_INC(100);
+	sched->conf[SCH_NORMAL].age = TIM_INC(10);
+	sched->conf[SCH_BULK].age = TIM_INC(20);
+}
+
+int Sch_ParseClass(const char *str, SchClass *class)
+{
+	for(int idx = 0; idx < SCH_CLASS_COUNT; idx++)
+	{
+		if(strcmp(str, _sch_names[idx]) == 0)
+		{
+			*class = (SchClass)idx;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *Sch_ClassName(const SchClass class)
+{
+	return _sch_names[class];
+}
+
+int Sch_Push(Scheduler *sched, void *item, const SchClass class,
+             const uint64_t queued)
+{
+	if(sched->count >= SCH_MAX_QUEUED) return ENOSPC;
+
+	//A time in the future would make the wait underflow
+	uint64_t now = Tim_NowUs();
+
+	SchEntry *entry = &sched->entries[sched->count++];
+	entry->item = item;
+	entry->class = class;
+	entry->queued = (queued == 0 || queued > now) ? now : queued;
+	entry->seq = sched->seq++;
+
+	return 0;
+}
+
+void *Sch_PopExpired(Scheduler *sched, SchClass *class, uint64_t *wait)
+{
+	uint64_t now = Tim_NowUs();
+
+	for(size_t idx = 0; idx < sched->count; idx++)
+	{
+		const SchEntry *entry = &sched->entries[idx];
+		uint64_t deadline = sched->conf[entry->class].deadline;
+		if(deadline == 0 || now - entry->queued < deadline) continue;
+
+		++sched->stats[entry->class].expired;
+		return Sch_Remove(sched, idx, class, wait, now);
+	}
+
+	return NULL;
+}
+
+void *Sch_Pop(Scheduler *sched, SchClass *class, uint64_t *wait)
+{
+	if(sched->count == 0) return NULL;
+
+	uint64_t now = Tim_NowUs();
+	size_t best = 0;
+	SchClass best_class = Sch_AgedClass(sched, &sched->entries[0], now);
+
+	for(size_t idx = 1; idx < sched->count; idx++)
+	{
+		SchClass crnt_class = Sch_AgedClass(sched, &sched->entries[idx], now);
+		if(crnt_class < best_class || (crnt_class == best_class &&
+		   sched->entries[idx].seq < sched->entries[best].seq))
+		{
+			best = idx;
+			best_class = crnt_class;
+		}
+	}
+
+	return Sch_Remove(sched, best, class, wait, now);
+}
+
+void Sch_Record(Scheduler *sched, const SchClass class, const uint64_t wait,
+                const uint64_t bus)
+{
+	SchStats *stats = &sched->stats[class];
+
+	++stats->run;
+	stats->wait_total += wait;
+	stats->bus_total += bus;
+	if(wait > stats->wait_max) stats->wait_max = wait;
+	if(bus > stats->bus_max) stats->bus_max = bus;
+}
+
+void Sch_PrintStats(const Scheduler *sched, const char *prefix, FILE *out)
+{
+	for(int idx = 0; idx < SCH_CLASS_COUNT; idx++)
+	{
+		const SchStats *stats = &sched->stats[idx];
+		unsigned long run = stats->run ? stats->run : 1;
+
+		fprintf(out, "%sQueue %s: run=%lu expired=%lu wait_avg=%lluus "
+		        "wait_max=%lluus bus_avg=%lluus bus_max=%lluus\n", prefix,
+		        _sch_names[idx], stats->run, stats->expired,
+		        (unsigned long long)(stats->wait_total / run),
+		        (unsigned long long)stats->wait_max,
+		        (unsigned long long)(stats->bus_total / run),
+		        (unsigned long long)stats->bus_max);
+	}
+
+	fflush(out);
+}
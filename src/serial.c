@@ -7,23 +7,64 @@
 * (c) ADBeta    Version 1.1.0    03 Nov 2023
 *******************************************************************************/
 #include <termios.h>
+#include <poll.h>
 #include <fcntl.h> 
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "serial.h"
+#include "timing.h"
+#include "termios2.h"
+#include "trace.h"
+
+/*** Baudrate Table ***********************************************************/
+//Standard baudrates and their Bxxx constants. Higher rates are not defined on
+//every platform
+static const struct
+{
+	unsigned int rate;
+	speed_t speed;
+} _baud_table[] = {
+	{50, B50}, {75, B75}, {110, B110}, {134, B134}, {150, B150}, {200, B200},
+	{300, B300}, {600, B600}, {1200, B1200}, {1800, B1800}, {2400, B2400},
+	{4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400},
+	{57600, B57600}, {115200, B115200}, {230400, B230400},
+	#ifdef B460800
+	{460800, B460800}, {500000, B500000}, {576000, B576000},
+	{921600, B921600}, {1000000, B1000000}, {1152000, B1152000},
+	{1500000, B1500000}, {2000000, B2000000}, {2500000, B2500000},
+	{3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+	#endif
+};
+
+static const unsigned int _baud_table_len =
+                                    sizeof(_baud_table) / sizeof(_baud_table[0]);
 
 int Ser_OpenDevice(const char *filename, SerialDevice *dev)
 {
 	dev->filename = filename;
-	//Open the given filename (Serial Port name) as read/write tty, with sync
-	dev->filedesc = open(dev->filename, O_RDWR | O_NOCTTY | O_SYNC);
+	dev->defer_attr = false;
+	dev->custom_baud = 0;
+	//Open the given filename (Serial Port name) as read/write tty, with sync.
+	//Non-blocking, all waiting is done with poll() (see Ser_ReadTimed)
+	dev->filedesc = open(dev->filename,
+	                     O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
 	
 	//Make sure the file opened correctly
 	if(dev->filedesc < 0) return errno;
+	Trc_Mark(TRC_OPENED);
 	
 	//Pre-load the attributes for the device. Returns its return value
 	return Ser_GetAttr(dev);
@@ -31,34 +72,334 @@ int Ser_OpenDevice(const char *filename, SerialDevice *dev)
 
 int Ser_CloseDevice(SerialDevice *dev)
 {
-	close(dev->filedesc);
-	return errno;
+	if(close(dev->filedesc) != 0) return errno;
+	Trc_Mark(TRC_CLOSED);
+	return 0;
 }
 
 int Ser_WriteBuffer(const char *buff, const size_t len, SerialDevice *dev)
 {
-	write(dev->filedesc, buff, len);
-	return errno;
+	//Keep writing until the whole buffer has been sent
+	size_t done = 0;
+	while(done < len)
+	{
+		ssize_t ret = write(dev->filedesc, buff + done, len - done);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			//Output buffer is full, wait until there is room again
+			if(errno == EAGAIN)
+			{
+				struct pollfd pfd = {dev->filedesc, POLLOUT, 0};
+				if(poll(&pfd, 1, -1) < 0 && errno != EINTR) return errno;
+				continue;
+			}
+			
+			return errno;
+		}
+		
+		done += (size_t)ret;
+	}
+	
+	return 0;
+}
+
+ssize_t Ser_WriteSome(const char *buff, const size_t len, SerialDevice *dev)
+{
+	//A full output buffer is not an error, the caller waits for POLLOUT
+	ssize_t ret = write(dev->filedesc, buff, len);
+	if(ret < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	
+	return ret;
 }
 
 ssize_t Ser_ReadBuffer(char *buff, const size_t len, SerialDevice *dev)
 {
 	//Returns number of bytes read, if -1 then error occured. see errno
-	return read(dev->filedesc, buff, len);
+	//No data being available yet is not an error
+	ssize_t ret = read(dev->filedesc, buff, len);
+	if(ret < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	
+	if(ret > 0)
+	{
+		Trc_MarkFirst(TRC_FIRST_BYTE);
+		Trc_Mark(TRC_LAST_BYTE);
+	}
+	
+	return ret;
+}
+
+ssize_t Ser_ReadTimed(char *buff, const size_t len, const uint64_t deadline,
+                      SerialDevice *dev)
+{
+	for(;;)
+	{
+		int revents = Tim_WaitReadable(dev->filedesc, deadline);
+		if(revents <= 0) return revents;
+		
+		ssize_t ret = Ser_ReadBuffer(buff, len, dev);
+		if(ret != 0) return ret;
+		
+		//With VMIN and VTIME at 0, a hung up port also reads 0 bytes. Only
+		//poll() tells it apart from data that was already taken (or EAGAIN)
+		if(revents & (POLLHUP | POLLERR | POLLNVAL))
+		{
+			errno = EIO;
+			return -1;
+		}
+	}
+}
+
+int Ser_Drain(SerialDevice *dev)
+{
+	while(tcdrain(dev->filedesc) != 0)
+	{
+		if(errno != EINTR) return errno;
+	}
+	return 0;
+}
+
+int Ser_FlushInput(SerialDevice *dev)
+{
+	if(tcflush(dev->filedesc, TCIFLUSH) != 0) return errno;
+	return 0;
+}
+
+/*** Latency Settings *******************************************************/
+//Builds the sysfs latency_timer path of a USB serial adapter into [path].
+//Returns errno (=0 if ok)
+static int Ser_LatencyTimerPath(char *path, const size_t len,
+                                const SerialDevice *dev)
+{
+	//Follow symlinks such as /dev/serial/by-id/ to the real tty name
+	char real[PATH_MAX];
+	if(realpath(dev->filename, real) == NULL) return errno;
+	
+	int ret = snprintf(path, len, "/sys/class/tty/%s/device/latency_timer",
+	                   basename(real));
+	if(ret < 0 || (size_t)ret >= len) return ENAMETOOLONG;
+	
+	return 0;
+}
+
+int Ser_SetLowLatency(const bool en, SerialDevice *dev)
+{
+	#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	const int flag = (int)ASYNC_LOW_LATENCY;
+	struct serial_struct serial;
+	if(ioctl(dev->filedesc, TIOCGSERIAL, &serial) != 0) return errno;
+	
+	if(en) serial.flags |= flag;
+	else   serial.flags &= ~flag;
+	
+	if(ioctl(dev->filedesc, TIOCSSERIAL, &serial) != 0) return errno;
+	
+	//Some drivers accept the ioctl but ignore the flag, check it was kept
+	if(ioctl(dev->filedesc, TIOCGSERIAL, &serial) != 0) return errno;
+	if(((serial.flags & flag) != 0) != en) return ENOTSUP;
+	
+	return 0;
+	#else
+	(void)en;
+	(void)dev;
+	return ENOTSUP;
+	#endif
+}
+
+int Ser_GetLatencyTimer(unsigned int *ms, SerialDevice *dev)
+{
+	char path[PATH_MAX];
+	int ser_err = Ser_LatencyTimerPath(path, sizeof(path), dev);
+	if(ser_err != 0) return ser_err;
+	
+	FILE *file = fopen(path, "r");
+	if(file == NULL) return errno;
+	
+	int ret = fscanf(file, "%u", ms);
+	fclose(file);
+	
+	if(ret != 1) return EIO;
+	return 0;
+}
+
+int Ser_SetLatencyTimer(const unsigned int ms, SerialDevice *dev)
+{
+	char path[PATH_MAX];
+	int ser_err = Ser_LatencyTimerPath(path, sizeof(path), dev);
+	if(ser_err != 0) return ser_err;
+	
+	FILE *file = fopen(path, "w");
+	if(file == NULL) return errno;
+	
+	//The value is only written (and checked by the driver) on close
+	fprintf(file, "%u\n", ms);
+	if(fclose(file) != 0) return errno;
+	
+	return 0;
+}
+
+int Ser_GetCounters(SerCounters *counters, SerialDevice *dev)
+{
+	#ifdef TIOCGICOUNT
+	struct serial_icounter_struct icount;
+	if(ioctl(dev->filedesc, TIOCGICOUNT, &icount) != 0) return errno;
+	
+	counters->rx = (unsigned long)icount.rx;
+	counters->tx = (unsigned long)icount.tx;
+	counters->frame = (unsigned long)icount.frame;
+	counters->parity = (unsigned long)icount.parity;
+	counters->brk = (unsigned long)icount.brk;
+	counters->overrun = (unsigned long)icount.overrun;
+	counters->buf_overrun = (unsigned long)icount.buf_overrun;
+	return 0;
+	#else
+	(void)counters;
+	(void)dev;
+	return ENOTSUP;
+	#endif
+}
+
+/*** RS-485 *******************************************************************/
+int Ser_ParseRS485(const char *str, SerRS485 *conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->enable = true;
+	conf->rts_on_send = true;
+	
+	char list[128];
+	if(strlen(str) >= sizeof(list)) return -1;
+	strcpy(list, str);
+	
+	char *save = NULL;
+	for(char *item = strtok_r(list, ",", &save); item != NULL;
+	    item = strtok_r(NULL, ",", &save))
+	{
+		unsigned int *delay = NULL;
+		
+		if(strcmp(item, "rts=high") == 0)      conf->rts_on_send = true;
+		else if(strcmp(item, "rts=low") == 0)  conf->rts_on_send = false;
+		else if(strcmp(item, "echo") == 0)     conf->rx_during_tx = true;
+		else if(strcmp(item, "off") == 0)      conf->enable = false;
+		else if(strncmp(item, "before=", 7) == 0) delay = &conf->delay_before;
+		else if(strncmp(item, "after=", 6) == 0)  delay = &conf->delay_after;
+		else return -1;
+		
+		if(delay == NULL) continue;
+		
+		//Delays are whole milliseconds, the driver limits them to 100ms
+		const char *value = strchr(item, '=') + 1;
+		char *end;
+		unsigned long ms = strtoul(value, &end, 10);
+		if(*value < '0' || *value > '9' || *end != '\0' || ms > 100) return -1;
+		*delay = (unsigned int)ms;
+	}
+	
+	return 0;
+}
+
+int Ser_SetRS485(const SerRS485 *conf, SerialDevice *dev)
+{
+	#ifdef TIOCSRS485
+	struct serial_rs485 rs485;
+	memset(&rs485, 0, sizeof(rs485));
+	
+	if(conf->enable)
+	{
+		rs485.flags = SER_RS485_ENABLED;
+		rs485.flags |= conf->rts_on_send ? SER_RS485_RTS_ON_SEND
+		                                 : SER_RS485_RTS_AFTER_SEND;
+		if(conf->rx_during_tx) rs485.flags |= SER_RS485_RX_DURING_TX;
+		
+		rs485.delay_rts_before_send = conf->delay_before;
+		rs485.delay_rts_after_send = conf->delay_after;
+	}
+	
+	if(ioctl(dev->filedesc, TIOCSRS485, &rs485) != 0) return errno;
+	
+	//Drivers without RS-485 support may accept the ioctl and keep nothing
+	if(ioctl(dev->filedesc, TIOCGRS485, &rs485) != 0) return errno;
+	if(((rs485.flags & SER_RS485_ENABLED) != 0) != conf->enable) return ENOTSUP;
+	
+	return 0;
+	#else
+	(void)conf;
+	(void)dev;
+	return ENOTSUP;
+	#endif
 }
 
 /*** Serial Setings & variable handling ***************************************/
 int Ser_GetAttr(SerialDevice *dev)
 {
-	tcgetattr(dev->filedesc, &dev->terminal); 
-	return errno;
+	if(tcgetattr(dev->filedesc, &dev->terminal) != 0) return errno;
+	return 0;
 }
 
 int Ser_SetAttr(SerialDevice *dev)
 {
+	//Changes are applied all at once by Ser_CommitConfig
+	if(dev->defer_attr) return 0;
+	
+	//tcsetattr can only set standard baudrates. A custom one is applied with
+	//the rest of the settings in a single termios2 update
+	if(dev->custom_baud != 0)
+	{
+		T2Attr attr = {
+			dev->terminal.c_iflag, dev->terminal.c_oflag,
+			dev->terminal.c_cflag, dev->terminal.c_lflag,
+			dev->terminal.c_line,
+			dev->terminal.c_cc, sizeof(dev->terminal.c_cc)
+		};
+		return T2_SetAttr(dev->filedesc, &attr, dev->custom_baud);
+	}
+	
 	//Force an attribute update now
-	tcsetattr(dev->filedesc, TCSANOW, &dev->terminal);
-	return errno;
+	if(tcsetattr(dev->filedesc, TCSANOW, &dev->terminal) != 0) return errno;
+	return 0;
+}
+
+int Ser_BeginConfig(SerialDevice *dev)
+{
+	dev->defer_attr = true;
+	return 0;
+}
+
+int Ser_CommitConfig(SerialDevice *dev)
+{
+	dev->defer_attr = false;
+	
+	//Read what the port is set to now, and skip the update if nothing changed.
+	//Some USB Serial drivers renegotiate the line on every tcsetattr
+	struct termios current;
+	if(tcgetattr(dev->filedesc, &current) != 0) return errno;
+	
+	//A custom baudrate is not stored in the termios data, check it separately
+	tcflag_t cflag_mask = ~(tcflag_t)0;
+	bool speed_match = cfgetispeed(&current) == cfgetispeed(&dev->terminal) &&
+	                   cfgetospeed(&current) == cfgetospeed(&dev->terminal);
+	
+	if(dev->custom_baud != 0)
+	{
+		unsigned int rate = 0;
+		speed_match = T2_GetBaudRate(dev->filedesc, &rate) == 0 &&
+		              rate == dev->custom_baud;
+		#if defined(CBAUD) && defined(CIBAUD)
+		cflag_mask = ~(tcflag_t)(CBAUD | CIBAUD);
+		#endif
+	}
+	
+	if(speed_match &&
+	   current.c_iflag == dev->terminal.c_iflag &&
+	   current.c_oflag == dev->terminal.c_oflag &&
+	   (current.c_cflag & cflag_mask) == (dev->terminal.c_cflag & cflag_mask) &&
+	   current.c_lflag == dev->terminal.c_lflag &&
+	   memcmp(current.c_cc, dev->terminal.c_cc, sizeof(current.c_cc)) == 0)
+	{
+		return 0;
+	}
+	
+	return Ser_SetAttr(dev);
 }
 
 int Ser_SetBaud(const unsigned int baud, SerialDevice *dev)
@@ -66,9 +407,54 @@ int Ser_SetBaud(const unsigned int baud, SerialDevice *dev)
 	if(cfsetospeed(&dev->terminal, baud) != 0) return errno;
 	if(cfsetispeed(&dev->terminal, baud) != 0) return errno;
 	
+	dev->custom_baud = 0;
+	return Ser_SetAttr(dev);
+}
+
+int Ser_SetBaudRate(const unsigned int rate, SerialDevice *dev)
+{
+	if(rate == 0) return EINVAL;
+	
+	//Use the standard interface whenever a Bxxx constant exists
+	speed_t speed = Ser_BaudToSpeed(rate);
+	if(speed != B0) return Ser_SetBaud(speed, dev);
+	
+	dev->custom_baud = rate;
 	return Ser_SetAttr(dev);
 }
 
+int Ser_GetBaudRate(unsigned int *rate, SerialDevice *dev)
+{
+	//Prefer what the driver reports, it may have rounded the rate
+	if(T2_GetBaudRate(dev->filedesc, rate) == 0) return 0;
+	
+	//Otherwise convert the Bxxx constant back to an integer
+	struct termios current;
+	if(tcgetattr(dev->filedesc, &current) != 0) return errno;
+	
+	speed_t speed = cfgetospeed(&current);
+	for(unsigned int idx = 0; idx < _baud_table_len; idx++)
+	{
+		if(_baud_table[idx].speed == speed)
+		{
+			*rate = _baud_table[idx].rate;
+			return 0;
+		}
+	}
+	
+	return EINVAL;
+}
+
+speed_t Ser_BaudToSpeed(const unsigned int rate)
+{
+	for(unsigned int idx = 0; idx < _baud_table_len; idx++)
+	{
+		if(_baud_table[idx].rate == rate) return _baud_table[idx].speed;
+	}
+	
+	return B0;
+}
+
 int Ser_SetBits(const unsigned int bits, SerialDevice *dev)
 {
 	//Unset all bitlength flags
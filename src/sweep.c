@@ -0,0 +1,201 @@
+/*******************************************************************************
+* Address sweep - Polls every slave on a multi-drop (e.g. RS-485) bus in one
+* run, on one open SerialDevice.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //memmem()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sweep.h"
+#include "escape.h"
+#include "query.h"
+#include "serial.h"
+
+/*** Private Functions ********************************************************/
+//Writes [mesg] with [addr] substituted into [out], which must hold at least
+//(mesg_len * 2) bytes. Returns the length written
+static size_t Swp_Expand(const char *mesg, const size_t mesg_len,
+                         const unsigned char addr, char *out)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t len = 0;
+
+	for(size_t idx = 0; idx < mesg_len; idx++)
+	{
+		if(mesg[idx] != '%' || idx + 1 == mesg_len)
+		{
+			out[len++] = mesg[idx];
+			continue;
+		}
+
+		switch(mesg[++idx])
+		{
+			case 'a':
+				len += (size_t)sprintf(out + len, "%u", addr);
+				break;
+
+			case 'x':
+				out[len++] = hex[addr >> 4];
+				out[len++] = hex[addr & 0x0F];
+				break;
+
+			case 'b':
+				out[len++] = (char)addr;
+				break;
+
+			case '%':
+				out[len++] = '%';
+				break;
+
+			//Not a substitution, keep it as it is
+			default:
+				out[len++] = '%';
+				out[len++] = mesg[idx];
+				break;
+		}
+	}
+
+	return len;
+}
+
+//Checks that [resp] of length [len] ends with its checksum, followed by
+//[term_len] bytes of terminator.
+//Returns 0 if it does, EBADMSG if it does not, ENODATA if it is too short
+static int Swp_CheckResponse(const ChkState *chk, const char *resp,
+                             const size_t len, const size_t term_len)
+{
+	size_t chk_len = Chk_Length(chk);
+	if(len < chk_len + term_len) return ENODATA;
+
+	size_t body_len = len - chk_len - term_len;
+	ChkState resp_chk = *chk;
+	Chk_Update(&resp_chk, resp, body_len);
+
+	uint8_t expected[CHK_MAX_LEN];
+	Chk_Encode(&resp_chk, Chk_Final(&resp_chk), expected);
+
+	return memcmp(resp + body_len, expected, chk_len) == 0 ? 0 : EBADMSG;
+}
+
+/*** API Functions ************************************************************/
+int Swp_ParseList(const char *str, SwpList *list)
+{
+	list->count = 0;
+
+	const char *pos = str;
+	while(*pos != '\0')
+	{
+		char *end;
+		if(*pos < '0' || *pos > '9') return -1;
+		unsigned long first = strtoul(pos, &end, 10);
+		unsigned long last = first;
+
+		if(*end == '-')
+		{
+			pos = end + 1;
+			if(*pos < '0' || *pos > '9') return -1;
+			last = strtoul(pos, &end, 10);
+		}
+
+		if(first > last || last > SWP_MAX_ADDRESS) return -1;
+
+		for(unsigned long addr = first; addr <= last; addr++)
+		{
+			if(list->count > SWP_MAX_ADDRESS) return -1;
+			list->addrs[list->count++] = (unsigned char)addr;
+		}
+
+		if(*end == ',') ++end;
+		else if(*end != '\0') return -1;
+		pos = end;
+	}
+
+	return list->count == 0 ? -1 : 0;
+}
+
+long Swp_Run(SerialDevice *dev, const QuerySettings *query, const char *mesg,
+             const size_t mesg_len, const ChkState *chk, const bool chk_append,
+             const bool newline, const SwpList *list, const size_t resp_len,
+             FILE *out)
+{
+	long failed = 0;
+
+	//Both buffers are reused for every address
+	char *frame = malloc(mesg_len * 2 + CHK_MAX_LEN + 2);
+	char *resp = malloc(resp_len);
+	if(frame == NULL || resp == NULL)
+	{
+		free(frame);
+		free(resp);
+		return -1;
+	}
+
+	bool has_term = query->term != NULL && query->term_len != 0;
+
+	for(size_t idx = 0; idx < list->count; idx++)
+	{
+		unsigned char addr = list->addrs[idx];
+
+		size_t frame_len = Swp_Expand(mesg, mesg_len, addr, frame);
+		if(chk != NULL && chk_append)
+		{
+			ChkState frame_chk = *chk;
+			Chk_Update(&frame_chk, frame, frame_len);
+			frame_len += Chk_Encode(&frame_chk, Chk_Final(&frame_chk),
+			                        (uint8_t *)frame + frame_len);
+		}
+
+		if(newline)
+		{
+			memcpy(frame + frame_len, "\r\n", 2);
+			frame_len += 2;
+		}
+
+		ssize_t byte_count = Qry_Transact(dev, query, frame, frame_len,
+		                                  resp, resp_len);
+
+		//A slave that did not answer, or did not finish, timed out
+		if(byte_count == 0 || (byte_count > 0 && has_term &&
+		   memmem(resp, (size_t)byte_count, query->term,
+		          query->term_len) == NULL))
+		{
+			byte_count = -1;
+			errno = ETIMEDOUT;
+		}
+
+		int chk_err;
+		if(byte_count > 0 && chk != NULL &&
+		   (chk_err = Swp_CheckResponse(chk, resp, (size_t)byte_count,
+		                        has_term ? query->term_len : 0)) != 0)
+		{
+			byte_count = -1;
+			errno = chk_err;
+		}
+
+		if(byte_count < 0)
+		{
+			++failed;
+			fprintf(out, "%u\tERR\t%s\n", addr, strerror(errno));
+		} else {
+			fprintf(out, "%u\tOK\t", addr);
+			Esc_Encode(resp, (size_t)byte_count, out);
+			fputc('\n', out);
+		}
+
+		if(ferror(out))
+		{
+			failed = -1;
+			break;
+		}
+	}
+
+	//Records are flushed once at the end, so the sweep itself is not slowed
+	if(fflush(out) != 0) failed = -1;
+
+	free(frame);
+	free(resp);
+	return failed;
+}
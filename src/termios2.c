@@ -0,0 +1,82 @@
+/*******************************************************************************
+* termios2 helpers - Sets and reads arbitrary baudrates with the Linux
+* termios2/BOTHER interface. Kept apart from serial.c because <asm/termbits.h>
+* conflicts with <termios.h>. Only used by serial.c
+*
+* PLEASE NOTE: All functions return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#define _GNU_SOURCE              //syscall()
+#include <errno.h>
+#include <string.h>
+
+#include "termios2.h"
+
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//<sys/ioctl.h> pulls in the <termios.h> definitions again, and the C
+//libraries do not agree on the prototype of ioctl(), so call it directly
+static int T2_Ioctl(const int fd, const unsigned long request,
+                    struct termios2 *tio)
+{
+	if(syscall(SYS_ioctl, fd, request, tio) != 0) return errno;
+	return 0;
+}
+
+int T2_SetAttr(const int fd, const T2Attr *attr, const unsigned int rate)
+{
+	//Start from the current settings so any control character <termios.h>
+	//does not know keeps its value
+	struct termios2 tio;
+	int err = T2_Ioctl(fd, TCGETS2, &tio);
+	if(err != 0) return err;
+
+	tio.c_iflag = attr->iflag;
+	tio.c_oflag = attr->oflag;
+	tio.c_lflag = attr->lflag;
+	tio.c_line = attr->line;
+	size_t cc_len = attr->cc_len < NCCS ? attr->cc_len : NCCS;
+	memcpy(tio.c_cc, attr->cc, cc_len);
+
+	tio.c_cflag = attr->cflag & ~(tcflag_t)CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ospeed = rate;
+
+	//Input speed follows the output speed when its bits are 0
+	tio.c_cflag &= ~(tcflag_t)(CBAUD << IBSHIFT);
+	tio.c_ispeed = rate;
+
+	return T2_Ioctl(fd, TCSETS2, &tio);
+}
+
+int T2_GetBaudRate(const int fd, unsigned int *rate)
+{
+	struct termios2 tio;
+	int err = T2_Ioctl(fd, TCGETS2, &tio);
+	if(err != 0) return err;
+
+	*rate = tio.c_ospeed;
+	return 0;
+}
+
+#else
+//Other platforms only support the standard Bxxx baudrates
+int T2_SetAttr(const int fd, const T2Attr *attr, const unsigned int rate)
+{
+	(void)fd;
+	(void)attr;
+	(void)rate;
+	return EINVAL;
+}
+
+int T2_GetBaudRate(const int fd, unsigned int *rate)
+{
+	(void)fd;
+	(void)rate;
+	return ENOTSUP;
+}
+#endif
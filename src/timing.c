@@ -0,0 +1,147 @@
+/*******************************************************************************
+* Timing handler - Microsecond resolution delays, deadlines and file descriptor
+* waits, based on CLOCK_MONOTONIC and ppoll().
+* All times are in microseconds. Deadlines are absolute Tim_NowUs() values.
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+//Which sleep method to use: usleep (outdated) or nanosleep
+//#define SLEEP_MODE_USLEEP
+#define SLEEP_MODE_NANOSLEEP
+
+#if defined(SLEEP_MODE_USLEEP) && defined(SLEEP_MODE_NANOSLEEP)
+#error You must not have both usleep and nanosleep methods active at once
+#endif
+
+/******************************************************************************/
+#define _GNU_SOURCE              //ppoll(), sched_setscheduler()
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "timing.h"
+
+/*** Private Functions ********************************************************/
+static struct timespec Tim_ToTimespec(const uint64_t us)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	return ts;
+}
+
+/*** API Functions ************************************************************/
+uint64_t Tim_NowUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000) + ((uint64_t)now.tv_nsec / 1000);
+}
+
+uint64_t Tim_DeadlineIn(const uint64_t us)
+{
+	if(us == 0) return TIM_NEVER;
+	return Tim_NowUs() + us;
+}
+
+uint64_t Tim_Remaining(const uint64_t deadline)
+{
+	uint64_t now = Tim_NowUs();
+	if(deadline <= now) return 0;
+	return deadline - now;
+}
+
+void Tim_SleepUs(const uint64_t us)
+{
+	if(us == 0) return;
+
+	//(obsolute) usleep implimentation for old/badly supported devices (Onion)
+	//Some usleep implimentations do not accept more than 1 second at a time
+	#ifdef SLEEP_MODE_USLEEP
+	uint64_t deadline = Tim_NowUs() + us;
+	uint64_t left;
+	while((left = Tim_Remaining(deadline)) != 0)
+	{
+		usleep((useconds_t)(left > 999999 ? 999999 : left));
+	}
+	#endif
+
+	//nanosleep implimentation for modern systems (recommended)
+	#ifdef SLEEP_MODE_NANOSLEEP
+	struct timespec time = Tim_ToTimespec(us), rem;
+	while(nanosleep(&time, &rem) != 0 && errno == EINTR) time = rem;
+	#endif
+}
+
+int Tim_WaitReadable(const int fd, const uint64_t deadline)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+
+	for(;;)
+	{
+		//A NULL timeout waits forever
+		struct timespec timeout, *timeout_ptr = NULL;
+		if(deadline != TIM_NEVER)
+		{
+			timeout = Tim_ToTimespec(Tim_Remaining(deadline));
+			timeout_ptr = &timeout;
+		}
+
+		int ret = ppoll(&pfd, 1, timeout_ptr, NULL);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			return -1;
+		}
+
+		if(ret == 0) return 0;
+
+		//POLLHUP and POLLERR also count as readable, the caller decides what
+		//an empty read() means from them
+		return pfd.revents;
+	}
+}
+
+int Tim_LockMemory(void)
+{
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) return errno;
+	return 0;
+}
+
+int Tim_SetRealtime(const int priority)
+{
+	struct sched_param param = {.sched_priority = priority};
+	if(sched_setscheduler(0, SCHED_FIFO, &param) != 0) return errno;
+	return 0;
+}
+
+int Tim_ParseUs(const char *str, uint64_t *us, const uint64_t limit)
+{
+	//Split the numeric part from the unit suffix, if there is one
+	uint64_t unit = TIM_INC(1);
+	size_t len = strlen(str);
+	if(len > 2 && strcmp(str + len - 2, "ms") == 0) unit = TIM_MS(1);
+	if(len > 2 && strcmp(str + len - 2, "us") == 0) unit = 1;
+	if(unit != TIM_INC(1)) len -= 2;
+
+	if(len == 0) return -1;
+
+	//Accumulate the digits, stopping early if the limit is exceeded
+	uint64_t value = 0;
+	for(size_t idx = 0; idx < len; idx++)
+	{
+		if(str[idx] < '0' || str[idx] > '9') return -1;
+
+		value = (value * 10) + (uint64_t)(str[idx] - '0');
+		if(value > limit / unit) return -2;
+	}
+
+	*us = value * unit;
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*******************************************************************************
+* Trace handler - Optional per-phase timing of a query. Each phase is stamped
+* with CLOCK_MONOTONIC as it completes, then printed as a single JSON or
+* key=value line, so where the time of a query goes can be compared across
+* adapters, kernels and firmware versions.
+* Stamps are only taken once tracing is enabled, so it costs nothing otherwise
+*
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "timing.h"
+
+/*** Trace State **************************************************************/
+static bool _trc_enabled = false;
+static uint64_t _trc_start;
+static uint64_t _trc_stamps[TRC_PHASE_COUNT];    //0 if not stamped
+static uint64_t _trc_times[TRC_TIME_COUNT];
+static bool _trc_times_set[TRC_TIME_COUNT];
+
+static const char *const _trc_names[TRC_PHASE_COUNT] = {
+	"parsed", "opened", "configured", "tx_delay",
+	"written", "first_byte", "last_byte", "closed"
+};
+
+static const char *const _trc_time_names[TRC_TIME_COUNT] = {
+	"queue", "bus"
+};
+
+/*** API Functions ************************************************************/
+void Trc_Start(void)
+{
+	_trc_start = Tim_NowUs();
+
+	for(int phase = 0; phase < TRC_PHASE_COUNT; phase++)
+	{
+		_trc_stamps[phase] = 0;
+	}
+
+	for(int time = 0; time < TRC_TIME_COUNT; time++)
+	{
+		_trc_times_set[time] = false;
+	}
+}
+
+void Trc_Enable(const bool en)
+{
+	_trc_enabled = en;
+}
+
+bool Trc_Enabled(void)
+{
+	return _trc_enabled;
+}
+
+void Trc_Mark(const TrcPhase phase)
+{
+	if(_trc_enabled) _trc_stamps[phase] = Tim_NowUs();
+}
+
+void Trc_MarkFirst(const TrcPhase phase)
+{
+	if(_trc_enabled && _trc_stamps[phase] == 0) _trc_stamps[phase] = Tim_NowUs();
+}
+
+void Trc_SetTime(const TrcTime time, const uint64_t us)
+{
+	if(_trc_enabled == false) return;
+
+	_trc_times[time] = us;
+	_trc_times_set[time] = true;
+}
+
+int Trc_Print(const TrcFormat format, FILE *out)
+{
+	const char *sep = "";
+
+	if(format == TRC_FMT_JSON) fputc('{', out);
+	for(int idx = 0; idx < TRC_PHASE_COUNT + TRC_TIME_COUNT; idx++)
+	{
+		//Phases are offsets from the start, times are printed as they are
+		const char *name;
+		unsigned long long us;
+		if(idx < TRC_PHASE_COUNT)
+		{
+			if(_trc_stamps[idx] == 0) continue;
+			name = _trc_names[idx];
+			us = (unsigned long long)(_trc_stamps[idx] - _trc_start);
+		} else {
+			int time = idx - TRC_PHASE_COUNT;
+			if(_trc_times_set[time] == false) continue;
+			name = _trc_time_names[time];
+			us = (unsigned long long)_trc_times[time];
+		}
+
+		if(format == TRC_FMT_JSON)
+		{
+			fprintf(out, "%s\"%s_us\":%llu", sep, name, us);
+			sep = ",";
+		} else {
+			fprintf(out, "%s%s_us=%llu", sep, name, us);
+			sep = " ";
+		}
+	}
+	if(format == TRC_FMT_JSON) fputc('}', out);
+	fputc('\n', out);
+
+	return fflush(out);
+}
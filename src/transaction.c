@@ -0,0 +1,175 @@
+/*******************************************************************************
+* Transaction handler - A non-blocking form of Qry_Transact, driven by the
+* caller's event loop through Trn_Step.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <poll.h>
+#include <errno.h>
+
+#include "transaction.h"
+#include "timing.h"
+#include "serial.h"
+#include "query.h"
+
+/*** Private Functions ********************************************************/
+//Ends the transaction with [status]. Returns [status]
+static int Trn_Finish(Transaction *trn, const int status)
+{
+	trn->state = TRN_DONE;
+	trn->status = status;
+	return status;
+}
+
+/*** API Functions ************************************************************/
+void Trn_Begin(Transaction *trn, SerialDevice *dev, const QuerySettings *query,
+               const char *mesg, const size_t mesg_len, char *resp,
+               const size_t resp_len)
+{
+	trn->dev = dev;
+	trn->query = query;
+	trn->mesg = mesg;
+	trn->mesg_len = mesg_len;
+	trn->sent = 0;
+	trn->resp = resp;
+	trn->resp_len = resp_len;
+	trn->rx.total = 0;
+	trn->sink = NULL;
+	trn->ctx = NULL;
+	trn->state = TRN_TX_DELAY;
+	trn->wake = Tim_NowUs() + query->txdelay;
+	trn->status = 0;
+}
+
+void Trn_BeginStream(Transaction *trn, SerialDevice *dev,
+                     const QuerySettings *query, const char *mesg,
+                     const size_t mesg_len, char *buf, const size_t buf_len,
+                     QuerySink sink, void *ctx)
+{
+	Trn_Begin(trn, dev, query, mesg, mesg_len, buf, buf_len);
+	trn->sink = sink;
+	trn->ctx = ctx;
+}
+
+int Trn_Step(Transaction *trn)
+{
+	switch(trn->state)
+	{
+		case TRN_TX_DELAY:
+			if(Tim_NowUs() < trn->wake) return EINPROGRESS;
+
+			//Discard anything left over from a previous query that timed out,
+			//so it is not mistaken for the start of this response
+			Ser_FlushInput(trn->dev);
+			trn->state = TRN_TRANSMIT;
+			//Fall through
+
+		case TRN_TRANSMIT:
+			while(trn->sent < trn->mesg_len)
+			{
+				ssize_t ret = Ser_WriteSome(trn->mesg + trn->sent,
+				                            trn->mesg_len - trn->sent, trn->dev);
+				if(ret < 0) return Trn_Finish(trn, errno);
+				if(ret == 0) return EINPROGRESS;
+
+				trn->sent += (size_t)ret;
+			}
+
+			trn->wake = Tim_NowUs() + trn->query->rxdelay;
+			trn->state = TRN_RX_DELAY;
+			//Fall through
+
+		case TRN_RX_DELAY:
+			if(Tim_NowUs() < trn->wake) return EINPROGRESS;
+
+			//A streamed response has no size limit
+			Qry_RxBegin(&trn->rx, trn->query, trn->sink ? 0 : trn->resp_len);
+			trn->state = TRN_RECEIVE;
+			//Fall through
+
+		case TRN_RECEIVE:;
+			bool got_data = false;
+			while(trn->rx.done == false)
+			{
+				//A streamed response reuses the buffer for every read
+				char *buf = trn->resp;
+				size_t len = trn->resp_len;
+				if(trn->sink == NULL)
+				{
+					buf += trn->rx.total;
+					len -= trn->rx.total;
+				}
+
+				ssize_t ret = Ser_ReadBuffer(buf, len, trn->dev);
+				if(ret < 0) return Trn_Finish(trn, errno);
+
+				//A hung up port reads 0 bytes forever, the same as one with
+				//nothing waiting. Only ask poll() when there was nothing to
+				//read at all, so draining the port costs no extra call
+				if(ret == 0 && got_data == false)
+				{
+					int revents = Tim_WaitReadable(trn->dev->filedesc, 0);
+					if(revents < 0) return Trn_Finish(trn, errno);
+					if(revents & (POLLHUP | POLLERR | POLLNVAL))
+					{
+						return Trn_Finish(trn, EIO);
+					}
+				}
+
+				//Nothing waiting. Done if the deadline has passed, otherwise
+				//wait for more
+				if(ret == 0 && Tim_NowUs() < Qry_RxDeadline(&trn->rx))
+				{
+					return EINPROGRESS;
+				}
+				if(ret > 0) got_data = true;
+
+				Qry_RxAdd(&trn->rx, trn->query, buf, (size_t)ret);
+
+				int sink_err;
+				if(trn->sink != NULL && ret > 0 &&
+				   (sink_err = trn->sink(buf, (size_t)ret, trn->ctx)) != 0)
+				{
+					return Trn_Finish(trn, sink_err);
+				}
+			}
+
+			return Trn_Finish(trn, 0);
+
+		case TRN_DONE:
+		default:
+			return trn->status;
+	}
+}
+
+int Trn_Fd(const Transaction *trn)
+{
+	return trn->dev->filedesc;
+}
+
+short Trn_Events(const Transaction *trn)
+{
+	if(trn->state == TRN_TRANSMIT) return POLLOUT;
+	if(trn->state == TRN_RECEIVE) return POLLIN;
+	return 0;
+}
+
+uint64_t Trn_Deadline(const Transaction *trn)
+{
+	if(trn->state == TRN_TX_DELAY || trn->state == TRN_RX_DELAY)
+	{
+		return trn->wake;
+	}
+	if(trn->state == TRN_RECEIVE) return Qry_RxDeadline(&trn->rx);
+
+	return TIM_NEVER;
+}
+
+int Trn_TimeoutMs(const Transaction *trn)
+{
+	uint64_t deadline = Trn_Deadline(trn);
+	if(deadline == TIM_NEVER) return -1;
+
+	return (int)((Tim_Remaining(deadline) + 999) / 1000);
+}
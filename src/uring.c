@@ -0,0 +1,358 @@
+/*******************************************************************************
+* io_uring handler - A minimal io_uring ring, set up with the raw system calls
+* so no liburing is needed.
+*
+* PLEASE NOTE: Most API functions of this library return errno values.
+* (c) ADBeta 2023
+*******************************************************************************/
+#include <errno.h>
+
+#include "uring.h"
+
+#ifdef SQIRT_NO_URING
+/*** Built without io_uring, every ring fails to start ************************/
+int Urg_Init(UrgRing *ring, const unsigned int entries)
+{
+	(void)entries;
+	ring->ring_fd = -1;
+	return ENOSYS;
+}
+
+int Urg_RegisterBuffer(UrgRing *ring, void *buf, const size_t len)
+{
+	(void)ring; (void)buf; (void)len;
+	return ENOSYS;
+}
+
+int Urg_PrepRead(UrgRing *ring, const int fd, void *buf, const size_t len,
+                 const int buf_index, const bool link, const uint64_t user_data)
+{
+	(void)ring; (void)fd; (void)buf; (void)len; (void)buf_index; (void)link;
+	(void)user_data;
+	return ENOSYS;
+}
+
+int Urg_PrepWrite(UrgRing *ring, const int fd, const void *buf,
+                  const size_t len, const int buf_index, const bool link,
+                  const uint64_t user_data)
+{
+	(void)ring; (void)fd; (void)buf; (void)len; (void)buf_index; (void)link;
+	(void)user_data;
+	return ENOSYS;
+}
+
+int Urg_PrepPoll(UrgRing *ring, const int fd, const short events,
+                 const bool link, const uint64_t user_data)
+{
+	(void)ring; (void)fd; (void)events; (void)link; (void)user_data;
+	return ENOSYS;
+}
+
+int Urg_PrepCancel(UrgRing *ring, const uint64_t target,
+                   const uint64_t user_data)
+{
+	(void)ring; (void)target; (void)user_data;
+	return ENOSYS;
+}
+
+unsigned int Urg_Space(const UrgRing *ring)
+{
+	(void)ring;
+	return 0;
+}
+
+int Urg_Flush(UrgRing *ring, unsigned long *calls)
+{
+	(void)ring; (void)calls;
+	return ENOSYS;
+}
+
+int Urg_Submit(UrgRing *ring, const uint64_t deadline, unsigned long *calls)
+{
+	(void)ring; (void)deadline; (void)calls;
+	return ENOSYS;
+}
+
+bool Urg_NextResult(UrgRing *ring, uint64_t *user_data, int32_t *res)
+{
+	(void)ring; (void)user_data; (void)res;
+	return false;
+}
+
+void Urg_Free(UrgRing *ring)
+{
+	(void)ring;
+}
+
+#else
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "timing.h"
+
+/*** Private Functions ********************************************************/
+//Takes a free submission queue entry, cleared. Returns NULL if it is full
+static struct io_uring_sqe *Urg_GetSqe(UrgRing *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if(ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+
+	unsigned int idx = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+
+	++ring->sq_local_tail;
+	++ring->to_submit;
+	return sqe;
+}
+
+//Queues a read or write request. Returns errno (=0 if ok)
+static int Urg_PrepRw(UrgRing *ring, const uint8_t opcode,
+                      const uint8_t fixed_opcode, const int fd,
+                      const void *buf, const size_t len, const int buf_index,
+                      const bool link, const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = Urg_GetSqe(ring);
+	if(sqe == NULL) return ENOSPC;
+
+	sqe->opcode = buf_index == URG_NO_BUFFER ? opcode : fixed_opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = (uint64_t)-1;     //Current position, ttys cannot seek
+	if(buf_index != URG_NO_BUFFER) sqe->buf_index = (uint16_t)buf_index;
+	if(link) sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+/*** API Functions ************************************************************/
+int Urg_Init(UrgRing *ring, const unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->ring_fd < 0) return errno;
+	ring->features = params.features;
+
+	//Waits need a timeout that does not take a submission entry
+	if((params.features & IORING_FEAT_EXT_ARG) == 0)
+	{
+		close(ring->ring_fd);
+		ring->ring_fd = -1;
+		return ENOTSUP;
+	}
+
+	/*** Map the rings and the submission entries *****************************/
+	ring->sq_map_len = params.sq_off.array +
+	                   params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_len = params.cq_off.cqes +
+	                   params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	//Newer kernels map both rings at once
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single && ring->cq_map_len > ring->sq_map_len)
+	{
+		ring->sq_map_len = ring->cq_map_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+	                    IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED) goto error;
+
+	ring->cq_map = ring->sq_map;
+	if(single == false)
+	{
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		                    IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED) goto error;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+	                  IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) goto error;
+
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+error:;
+	int err = errno;
+	if(ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+	if(ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+	if(ring->sqes == MAP_FAILED) ring->sqes = NULL;
+	Urg_Free(ring);
+	return err;
+}
+
+int Urg_RegisterBuffer(UrgRing *ring, void *buf, const size_t len)
+{
+	struct iovec iov = {buf, len};
+	if(syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS,
+	           &iov, 1) != 0) return errno;
+
+	return 0;
+}
+
+int Urg_PrepRead(UrgRing *ring, const int fd, void *buf, const size_t len,
+                 const int buf_index, const bool link, const uint64_t user_data)
+{
+	return Urg_PrepRw(ring, IORING_OP_READ, IORING_OP_READ_FIXED, fd, buf, len,
+	                  buf_index, link, user_data);
+}
+
+int Urg_PrepWrite(UrgRing *ring, const int fd, const void *buf,
+                  const size_t len, const int buf_index, const bool link,
+                  const uint64_t user_data)
+{
+	return Urg_PrepRw(ring, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, fd, buf,
+	                  len, buf_index, link, user_data);
+}
+
+int Urg_PrepPoll(UrgRing *ring, const int fd, const short events,
+                 const bool link, const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = Urg_GetSqe(ring);
+	if(sqe == NULL) return ENOSPC;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = (uint32_t)(uint16_t)events;
+	if(link) sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+int Urg_PrepCancel(UrgRing *ring, const uint64_t target,
+                   const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = Urg_GetSqe(ring);
+	if(sqe == NULL) return ENOSPC;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = user_data;
+
+	return 0;
+}
+
+unsigned int Urg_Space(const UrgRing *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return ring->sq_entries - (ring->sq_local_tail - head);
+}
+
+int Urg_Flush(UrgRing *ring, unsigned long *calls)
+{
+	while(ring->to_submit > 0)
+	{
+		__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+		int ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd,
+		                       ring->to_submit, 0, 0, NULL, 0);
+		++*calls;
+
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+
+		//The kernel takes requests in order, it stopped at one it could not
+		//take yet
+		if(ret == 0) return EBUSY;
+		ring->to_submit -= (unsigned int)ret < ring->to_submit
+		                   ? (unsigned int)ret : ring->to_submit;
+	}
+
+	return 0;
+}
+
+int Urg_Submit(UrgRing *ring, const uint64_t deadline, unsigned long *calls)
+{
+	//Nothing new for the kernel, and a result already waiting
+	if(ring->to_submit == 0 && *ring->cq_head !=
+	   __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if(deadline != TIM_NEVER)
+	{
+		uint64_t left = Tim_Remaining(deadline);
+		ts.tv_sec = (long long)(left / 1000000);
+		ts.tv_nsec = (long long)(left % 1000000) * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	int ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit,
+	                       1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+	                       &arg, sizeof(arg));
+	++*calls;
+
+	if(ret < 0)
+	{
+		if(errno == ETIME || errno == EINTR) return 0;
+		return errno;
+	}
+
+	ring->to_submit -= (unsigned int)ret < ring->to_submit ? (unsigned int)ret
+	                                                       : ring->to_submit;
+	return 0;
+}
+
+bool Urg_NextResult(UrgRing *ring, uint64_t *user_data, int32_t *res)
+{
+	unsigned int head = *ring->cq_head;
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+
+	struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void Urg_Free(UrgRing *ring)
+{
+	if(ring->sqes != NULL) munmap(ring->sqes, ring->sqes_len);
+	if(ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+	{
+		munmap(ring->cq_map, ring->cq_map_len);
+	}
+	if(ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_len);
+	if(ring->ring_fd >= 0) close(ring->ring_fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->ring_fd = -1;
+}
+#endif